@@ -0,0 +1,183 @@
+#include "block_cache.h"
+#include <stdexcept>
+
+block_cache::block_cache(size_t budget, write_back_func write_back) :
+	budget_(budget),
+	hand_(0),
+	write_back_(write_back)
+{
+	reset_stats();
+}
+
+void block_cache::set_budget(size_t budget)
+{
+	flush();
+	clear();
+	budget_ = budget;
+}
+
+size_t block_cache::get_budget() const
+{
+	return budget_;
+}
+
+bool block_cache::read(uint32_t idx, data_block& data)
+{
+	auto it = index_.find(idx);
+	if (it == index_.end())
+	{
+		stats_.misses_++;
+		return false;
+	}
+	entry& e = entries_[it->second];
+	e.referenced_ = true;
+	data = e.data_;
+	stats_.hits_++;
+	return true;
+}
+
+bool block_cache::contains(uint32_t idx) const
+{
+	return index_.find(idx) != index_.end();
+}
+
+bool block_cache::peek(uint32_t idx, data_block& data) const
+{
+	auto it = index_.find(idx);
+	if (it == index_.end())
+		return false;
+	data = entries_[it->second].data_;
+	return true;
+}
+
+void block_cache::write(uint32_t idx, const data_block& data, bool dirty)
+{
+	if (capacity() == 0)
+	{
+		if (dirty)
+		{
+			write_back_(idx, data);
+			stats_.write_backs_++;
+		}
+		return;
+	}
+	auto it = index_.find(idx);
+	size_t slot;
+	if (it != index_.end())
+	{
+		slot = it->second;
+	}
+	else
+	{
+		if (entries_.size() < capacity())
+		{
+			slot = entries_.size();
+			entries_.emplace_back();
+		}
+		else
+		{
+			slot = find_victim();
+			evict(slot);
+		}
+		entries_[slot].idx_ = idx;
+		entries_[slot].used_ = true;
+		entries_[slot].dirty_ = false;
+		index_[idx] = slot;
+	}
+	entry& e = entries_[slot];
+	e.data_ = data;
+	e.referenced_ = true;
+	e.dirty_ = e.dirty_ || dirty;
+}
+
+void block_cache::erase(uint32_t idx)
+{
+	auto it = index_.find(idx);
+	if (it == index_.end())
+		return;
+	entries_[it->second].used_ = false;
+	entries_[it->second].dirty_ = false;
+	index_.erase(it);
+}
+
+void block_cache::flush()
+{
+	for (auto& e : entries_)
+	{
+		if (!e.used_ || !e.dirty_)
+			continue;
+		write_back_(e.idx_, e.data_);
+		e.dirty_ = false;
+		stats_.write_backs_++;
+	}
+}
+
+void block_cache::flush_block(uint32_t idx)
+{
+	auto it = index_.find(idx);
+	if (it == index_.end())
+		return;
+	entry& e = entries_[it->second];
+	if (!e.dirty_)
+		return;
+	write_back_(e.idx_, e.data_);
+	e.dirty_ = false;
+	stats_.write_backs_++;
+}
+
+void block_cache::clear()
+{
+	entries_.clear();
+	index_.clear();
+	hand_ = 0;
+}
+
+const block_cache_stats& block_cache::get_stats() const
+{
+	return stats_;
+}
+
+void block_cache::reset_stats()
+{
+	stats_.hits_ = 0;
+	stats_.misses_ = 0;
+	stats_.evictions_ = 0;
+	stats_.write_backs_ = 0;
+}
+
+size_t block_cache::capacity() const
+{
+	return budget_ / sizeof(entry);
+}
+
+size_t block_cache::find_victim()
+{
+	while (true)
+	{
+		if (hand_ >= entries_.size())
+			hand_ = 0;
+		entry& e = entries_[hand_];
+		if (!e.used_)
+			return hand_++;
+		if (!e.referenced_)
+			return hand_++;
+		e.referenced_ = false;
+		hand_++;
+	}
+}
+
+void block_cache::evict(size_t slot)
+{
+	entry& e = entries_[slot];
+	if (!e.used_)
+		return;
+	if (e.dirty_)
+	{
+		write_back_(e.idx_, e.data_);
+		stats_.write_backs_++;
+	}
+	index_.erase(e.idx_);
+	e.used_ = false;
+	e.dirty_ = false;
+	stats_.evictions_++;
+}
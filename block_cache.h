@@ -0,0 +1,63 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include "common.h"
+
+struct block_cache_stats
+{
+	uint64_t hits_;
+	uint64_t misses_;
+	uint64_t evictions_;
+	uint64_t write_backs_;
+};
+
+// Fixed budget block cache with CLOCK eviction. Dirty blocks are kept in
+// memory and handed to the write back function on eviction or flush.
+class block_cache
+{
+public:
+	typedef std::function<void(uint32_t, const data_block&)> write_back_func;
+
+	block_cache(size_t budget, write_back_func write_back);
+
+	// budget in bytes, 0 disables caching
+	void set_budget(size_t budget);
+	size_t get_budget() const;
+
+	bool read(uint32_t idx, data_block& data);
+	// doesn't count as a hit or miss
+	bool contains(uint32_t idx) const;
+	// read which changes nothing, for readers sharing the cache
+	bool peek(uint32_t idx, data_block& data) const;
+	void write(uint32_t idx, const data_block& data, bool dirty);
+	void erase(uint32_t idx);
+	void flush();
+	// writes the block back if it is cached dirty
+	void flush_block(uint32_t idx);
+	// drops all blocks without writing dirty ones back
+	void clear();
+
+	const block_cache_stats& get_stats() const;
+	void reset_stats();
+private:
+	struct entry
+	{
+		data_block data_;
+		uint32_t idx_;
+		bool used_;
+		bool referenced_;
+		bool dirty_;
+	};
+
+	size_t capacity() const;
+	size_t find_victim();
+	void evict(size_t slot);
+
+	size_t budget_;
+	std::vector<entry> entries_;
+	std::unordered_map<uint32_t, size_t> index_;
+	size_t hand_;
+	write_back_func write_back_;
+	block_cache_stats stats_;
+};
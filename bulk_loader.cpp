@@ -0,0 +1,174 @@
+#include "bulk_loader.h"
+#include "merkle_storage.h"
+#include "storage_block_parser.h"
+#include "hashes.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace bi;
+
+bulk_loader::bulk_loader(const std::string& file_name, storage_backend_type type)
+	: file_name_(file_name), type_(type), file_(new storage_file()), has_last_(false)
+{
+	// a crashed load is simply started over, so nothing is logged
+	file_->create(file_name, type, false);
+	// finish opens the file with the log, which a removed database may have left
+	if (is_file_exists(file_name + WAL_FILE_SUFFIX))
+		delete_file(file_name + WAL_FILE_SUFFIX);
+	if (file_->allocate_block() != MERKLE_ROOT_BLOCK)
+		throw std::runtime_error("Invalid storage file");
+	storage_block_parser(root_).fill_as_empty_root();
+}
+
+bulk_loader::~bulk_loader()
+{
+	if (!file_)
+		return;
+	try
+	{
+		file_.reset();
+		delete_file(file_name_);
+	}
+	catch (...)
+	{
+	}
+}
+
+void bulk_loader::add(const uint256_t& key, const uint256_t& value)
+{
+	pending_node leaf;
+	storage_block_parser parser(leaf.block_);
+	add_leaf(key, leaf);
+	leaf.hash_ = hash(value);
+	parser.set_value(value);
+	parser.set_first_child_hash(leaf.hash_);
+	last_ = leaf;
+}
+
+void bulk_loader::add(const uint256_t& key, const uint8_t* data, size_t size)
+{
+	if (size > MAX_VALUE_SIZE)
+		throw std::runtime_error("Value is too long");
+	pending_node leaf;
+	storage_block_parser parser(leaf.block_);
+	add_leaf(key, leaf);
+	parser.set_value_size(BYTES_VALUE_FLAG | (uint32_t)size);
+	if (size <= BLOCK_VALUE_SIZE)
+	{
+		parser.set_value_bytes(data, size);
+	}
+	else
+	{
+		uint32_t idx = file_->allocate_extent((uint32_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE));
+		parser.set_first_child_id(idx);
+		data_block block;
+		for (size_t offset = 0; offset < size; offset += BLOCK_SIZE, idx++)
+		{
+			block.fill(0);
+			memcpy(block.data(), data + offset, (std::min)((size_t)BLOCK_SIZE, size - offset));
+			file_->write_block(idx, block);
+		}
+	}
+	leaf.hash_ = hash(data, size);
+	parser.set_first_child_hash(leaf.hash_);
+	last_ = leaf;
+}
+
+std::unique_ptr<merkle_storage> bulk_loader::finish()
+{
+	if (!file_)
+		throw std::runtime_error("Bulk load is finished");
+	if (has_last_)
+	{
+		while (!open_.empty())
+			close_top();
+		storage_block_parser parser(root_);
+		uint256_t prefix;
+		storage_block_parser(last_.block_).get_prefix(prefix);
+		uint32_t idx = last_.idx_;
+		uint256_t slot_hash = attach_last(MERKLE_ROOT_BLOCK, 1);
+		if (key_bit(prefix, 0))
+		{
+			parser.set_second_child_id(idx);
+			parser.set_second_child_hash(slot_hash);
+		}
+		else
+		{
+			parser.set_first_child_id(idx);
+			parser.set_first_child_hash(slot_hash);
+		}
+	}
+	file_->write_block(MERKLE_ROOT_BLOCK, root_);
+	file_->flush();
+	file_.reset();
+	return merkle_storage::open(file_name_, type_);
+}
+
+void bulk_loader::add_leaf(const uint256_t& key, pending_node& leaf)
+{
+	if (!file_)
+		throw std::runtime_error("Bulk load is finished");
+	if (has_last_)
+	{
+		if (key <= last_key_)
+			throw std::runtime_error("Bulk load keys are not increasing");
+		unsigned depth = common_prefix_length(last_key_, key);
+		while (!open_.empty() &&
+			storage_block_parser(open_.back().block_).get_prefix_length() > depth)
+			close_top();
+		if (depth == 0)
+		{
+			// the keys go to different halves, all of the first half is done
+			storage_block_parser parser(root_);
+			parser.set_first_child_id(last_.idx_);
+			parser.set_first_child_hash(attach_last(MERKLE_ROOT_BLOCK, 1));
+		}
+		else
+		{
+			// the last subtree is the first child of a new node at the split
+			pending_node node;
+			storage_block_parser parser(node.block_);
+			node.idx_ = file_->allocate_block();
+			parser.clear();
+			parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+			parser.set_prefix_length(depth);
+			parser.set_prefix(key_prefix(key, depth));
+			parser.set_first_child_id(last_.idx_);
+			parser.set_first_child_hash(attach_last(node.idx_, depth + 1));
+			open_.push_back(node);
+		}
+	}
+	storage_block_parser parser(leaf.block_);
+	leaf.idx_ = file_->allocate_block();
+	parser.clear();
+	parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+	parser.set_prefix_length(KEY_LENGTH);
+	parser.set_prefix(key);
+	last_key_ = key;
+	has_last_ = true;
+}
+
+uint256_t bulk_loader::attach_last(uint32_t parent_idx, unsigned slot_depth)
+{
+	storage_block_parser parser(last_.block_);
+	uint256_t prefix;
+	parser.get_prefix(prefix);
+	parser.set_parent_id(parent_idx);
+	file_->write_block(last_.idx_, last_.block_);
+	return lift_hash(prefix, last_.hash_, parser.get_prefix_length(), slot_depth);
+}
+
+void bulk_loader::close_top()
+{
+	pending_node& node = open_.back();
+	storage_block_parser parser(node.block_);
+	uint256_t first_hash, second_hash;
+	parser.set_second_child_id(last_.idx_);
+	parser.set_second_child_hash(attach_last(node.idx_, parser.get_prefix_length() + 1));
+	parser.get_first_child_hash(first_hash);
+	parser.get_second_child_hash(second_hash);
+	node.hash_ = hash(first_hash, second_hash);
+	last_ = node;
+	open_.pop_back();
+}
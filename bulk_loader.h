@@ -0,0 +1,54 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "storage_file.h"
+
+class merkle_storage;
+
+// Builds a new database from keys added in increasing order in a single
+// pass. The trie is assembled bottom-up: only the nodes on the path to
+// the last key are kept open, a node is hashed and written once when no
+// later key can reach it. Blocks are allocated in key order, so a node
+// sits next to its subtree. The result has the same nodes and root hash
+// as incremental insertion of the keys.
+class bulk_loader
+{
+public:
+	bulk_loader(const std::string& file_name,
+		storage_backend_type type = storage_backend_type::stdio);
+	// an unfinished load removes the file
+	~bulk_loader();
+
+	void add(const bi::uint256_t& key, const bi::uint256_t& value);
+	void add(const bi::uint256_t& key, const uint8_t* data, size_t size);
+	// writes the rest of the trie and opens the database
+	std::unique_ptr<merkle_storage> finish();
+private:
+	struct pending_node
+	{
+		uint32_t idx_;
+		data_block block_;
+		// hash at the node depth
+		bi::uint256_t hash_;
+	};
+
+	// starts the leaf of the key after closing the nodes the key leaves
+	void add_leaf(const bi::uint256_t& key, pending_node& leaf);
+	// hangs the finished subtree of last_ below the node in the slot at
+	// slot_depth, returns the slot hash
+	bi::uint256_t attach_last(uint32_t parent_idx, unsigned slot_depth);
+	void close_top();
+
+	std::string file_name_;
+	storage_backend_type type_;
+	std::unique_ptr<storage_file> file_;
+	// nodes waiting for their second child, from the root down
+	std::vector<pending_node> open_;
+	// subtree of the last key waiting for its parent
+	pending_node last_;
+	bi::uint256_t last_key_;
+	bool has_last_;
+	data_block root_;
+};
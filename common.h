@@ -1,18 +1,52 @@
 #pragma once
 
-#include "uint256_t\uint256_t.h"
+#include "uint256_t/uint256_t.h"
 #include <array>
 
 #define KEY_LENGTH 256
+#define STORAGE_FORMAT_VERSION 6
+// oldest format merkle_storage::open can migrate from
+#define STORAGE_MIN_FORMAT_VERSION 4
 
 #define FREE_BLOCK_TYPE 0
 #define STORAGE_FREE_INFO_BLOCK_TYPE 1
 #define MERKLE_NODE_BLOCK_TYPE 2
+// values of format 4 leaves, newer leaves keep the value inline
 #define VALUE_BLOCK_TYPE 3
+// committed version of the trie kept for snapshots, see merkle_snapshot.h
+#define VERSION_BLOCK_TYPE 4
+// blocks replaced by a version and still used by the older ones
+#define JOURNAL_BLOCK_TYPE 5
+
+// block of the trie root node
+#define MERKLE_ROOT_BLOCK 1
 
 // header: type  + parent block idx + 2 child block idxs
 #define BLOCK_HEADER_SIZE (1 + 4 + 4 + 4)
 #define BLOCK_VALUE_SIZE 32
-#define BLOCK_SIZE (BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE)
+// merkle node key prefix: prefix length in bits + prefix bits
+#define BLOCK_PREFIX_SIZE (2 + 32)
+// merkle node hashes of both child subtrees
+#define BLOCK_HASHES_SIZE (32 + 32)
+#define BLOCK_SIZE (BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE + BLOCK_PREFIX_SIZE + BLOCK_HASHES_SIZE)
+
+// allocation bitmap: block 0 and every FREE_MAP_PAGE_BLOCKS-th block after it
+// is a free info block keeping one "used" bit per block of its group
+#define FREE_MAP_PAGE_BLOCKS 1024
+#define FREE_MAP_PAGE_WORDS (FREE_MAP_PAGE_BLOCKS / 64)
+
+// leaf values given as byte strings have this flag in the value size,
+// those longer than BLOCK_VALUE_SIZE go to an overflow extent of
+// consecutive blocks, which can't span a free info block
+#define BYTES_VALUE_FLAG 0x80000000
+#define MAX_VALUE_SIZE ((FREE_MAP_PAGE_BLOCKS - 1) * BLOCK_SIZE)
+
+// block indices a journal block keeps
+#define JOURNAL_BLOCK_ENTRIES ((BLOCK_SIZE - BLOCK_HEADER_SIZE) / 4)
+
+// deferred hashing gives the workers the subtrees of the nodes below this bit depth
+#define DEFAULT_HASH_SPLIT_DEPTH 8
+// noted keys that start the deferred hashing in the background
+#define DEFERRED_HASH_KEYS 1024
 
 typedef std::array<uint8_t, BLOCK_SIZE> data_block;
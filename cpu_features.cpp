@@ -0,0 +1,85 @@
+#include "cpu_features.h"
+#include <cstdint>
+#ifdef CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+#ifdef CPU_ARM64
+#if defined(WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#ifdef CPU_X86
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+	int res[4];
+	__cpuidex(res, leaf, subleaf);
+	for (unsigned i = 0; i < 4; i++)
+		regs[i] = (uint32_t)res[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// register state the os saves on context switch
+static uint64_t xgetbv()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+static cpu_features detect_cpu_features()
+{
+	cpu_features res = { false, false, false, false, false };
+#ifdef CPU_X86
+	uint32_t regs[4];
+	cpuid(0, 0, regs);
+	uint32_t max_leaf = regs[0];
+	cpuid(1, 0, regs);
+	res.sse2_ = (regs[3] & (1u << 26)) != 0;
+	bool ssse3 = (regs[2] & (1u << 9)) != 0;
+	res.sse41_ = (regs[2] & (1u << 19)) != 0;
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+	uint64_t xcr0 = osxsave ? xgetbv() : 0;
+	bool ymm_state = (xcr0 & 0x6) == 0x6;
+	bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+	if (max_leaf >= 7)
+	{
+		cpuid(7, 0, regs);
+		res.avx2_ = avx && ymm_state && (regs[1] & (1u << 5)) != 0;
+		res.avx512f_ = zmm_state && (regs[1] & (1u << 16)) != 0;
+		res.sha_ = ssse3 && res.sse41_ && (regs[1] & (1u << 29)) != 0;
+	}
+#endif
+#ifdef CPU_ARM64
+#if defined(WIN32)
+	res.sha_ = IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__APPLE__)
+	res.sha_ = true;
+#elif defined(__linux__)
+	res.sha_ = (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#endif
+#endif
+	return res;
+}
+
+const cpu_features& get_cpu_features()
+{
+	static const cpu_features features = detect_cpu_features();
+	return features;
+}
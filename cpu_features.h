@@ -0,0 +1,21 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_X86
+#endif
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define CPU_ARM64
+#endif
+
+struct cpu_features
+{
+	bool sse2_;
+	bool sse41_;
+	bool avx2_;
+	bool avx512f_;
+	// SHA-256 instructions, SHA-NI on x86 and crypto extension on ARMv8
+	bool sha_;
+};
+
+// instruction set extensions usable by this process, detected once
+const cpu_features& get_cpu_features();
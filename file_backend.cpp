@@ -0,0 +1,103 @@
+#include "file_backend.h"
+#include "utils.h"
+#include <stdexcept>
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+file_backend::file_backend() :
+	file_(nullptr, fclose),
+	blocks_amount_(0)
+{
+}
+
+void file_backend::open(const std::string& file_name)
+{
+	file_ = std::unique_ptr<FILE, file_closer>(
+		fopen(file_name.c_str(), "rb+"),
+		fclose
+		);
+	if (!file_)
+		throw std::runtime_error("Failed to open file");
+	int n = fseek(file_.get(), 0, SEEK_END);
+	if (n)
+		throw std::runtime_error("Failed to position cursor");
+	long pos = ftell(file_.get());
+	blocks_amount_ = pos / BLOCK_SIZE;
+}
+
+void file_backend::create(const std::string& file_name)
+{
+	file_ = std::unique_ptr<FILE, file_closer>(
+		fopen(file_name.c_str(), "wb+"),
+		fclose
+		);
+	if (!file_)
+		throw std::runtime_error("Failed to create file");
+	blocks_amount_ = 0;
+}
+
+uint32_t file_backend::blocks_amount() const
+{
+	return blocks_amount_;
+}
+
+void file_backend::read_block(uint32_t idx, data_block& data)
+{
+	std::lock_guard<std::mutex> lock(read_mutex_);
+	int n = fseek(file_.get(), (long)idx * BLOCK_SIZE, SEEK_SET);
+	if (n)
+		throw std::runtime_error("Failed to seek file to block position");
+	n = fread(data.data(), data.size(), 1, file_.get());
+	if (n != 1)
+		throw std::runtime_error("Failed to read block");
+}
+
+void file_backend::write_block(uint32_t idx, const data_block& data)
+{
+	int n = fseek(file_.get(), (long)idx * BLOCK_SIZE, SEEK_SET);
+	if (n)
+		throw std::runtime_error("Failed to seek file to block position");
+	n = fwrite(data.data(), data.size(), 1, file_.get());
+	if (n != 1)
+		throw std::runtime_error("Failed to write block");
+}
+
+uint32_t file_backend::append_block()
+{
+	int n = fseek(file_.get(), 0, SEEK_END);
+	if (n)
+		throw std::runtime_error("Failed to position cursor");
+	data_block b;
+	b.fill(0);
+	n = fwrite(b.data(), b.size(), 1, file_.get());
+	if (n != 1)
+		throw std::runtime_error("Failed to append block");
+	blocks_amount_++;
+	return blocks_amount_ - 1;
+}
+
+const uint8_t* file_backend::view_block(uint32_t /*idx*/)
+{
+	return nullptr;
+}
+
+void file_backend::prefetch_block(uint32_t idx)
+{
+#ifndef WIN32
+	// starts reading the page in the background, the result doesn't matter
+	posix_fadvise(fileno(file_.get()), (off_t)idx * BLOCK_SIZE, BLOCK_SIZE,
+		POSIX_FADV_WILLNEED);
+#endif
+}
+
+void file_backend::flush()
+{
+	if (fflush(file_.get()))
+		throw std::runtime_error("Failed to flush file");
+}
+
+void file_backend::sync()
+{
+	sync_file(file_.get());
+}
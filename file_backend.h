@@ -0,0 +1,30 @@
+#pragma once
+#include <memory>
+#include <cstdio>
+#include <mutex>
+#include "storage_backend.h"
+
+// stdio based backend, every access is a seek plus read or write
+class file_backend : public storage_backend
+{
+public:
+	file_backend();
+
+	void open(const std::string& file_name) override;
+	void create(const std::string& file_name) override;
+
+	uint32_t blocks_amount() const override;
+	void read_block(uint32_t idx, data_block& data) override;
+	void write_block(uint32_t idx, const data_block& data) override;
+	uint32_t append_block() override;
+	const uint8_t* view_block(uint32_t idx) override;
+	void prefetch_block(uint32_t idx) override;
+	void flush() override;
+	void sync() override;
+private:
+	typedef int(*file_closer)(FILE*);
+	std::unique_ptr<FILE, file_closer> file_;
+	// concurrent readers share the file position
+	std::mutex read_mutex_;
+	uint32_t blocks_amount_;
+};
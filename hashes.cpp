@@ -0,0 +1,542 @@
+#include "hashes.h"
+#include "utils.h"
+#include "cpu_features.h"
+#include <atomic>
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+#ifdef CPU_ARM64
+#include <arm_neon.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// message schedule plus round constants of the padding block that
+// follows every 64 byte message
+static const uint32_t sha256_padding_kw[64] = {
+	0xc28a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf374,
+	0x649b69c1, 0xf0fe4786, 0x0fe1edc6, 0x240cf254, 0x4fe9346f, 0x6cc984be, 0x61b9411e, 0x16f988fa,
+	0xf2c65152, 0xa88e5a6d, 0xb019fc65, 0xb9d99ec7, 0x9a1231c3, 0xe70eeaa0, 0xfdb1232b, 0xc7353eb0,
+	0x3069bad5, 0xcb976d5f, 0x5a0f118f, 0xdc1eeefd, 0x0a35b689, 0xde0b7a04, 0x58f4ca9d, 0xe15d5b16,
+	0x007f3e86, 0x37088980, 0xa507ea32, 0x6fab9537, 0x17406110, 0x0d8cd6f1, 0xcdaa3b6d, 0xc0bbbe37,
+	0x83613bda, 0xdb48a363, 0x0b02e931, 0x6fd15ca7, 0x521afaca, 0x31338431, 0x6ed41a95, 0x6d437890,
+	0xc39c91f2, 0x9eccabbd, 0xb5c9a0e6, 0x532fb63c, 0xd2c741c6, 0x07237ea3, 0xa4954b68, 0x4c191d76
+};
+
+#define rotr32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress_portable(uint32_t state[8], const uint8_t block[64])
+{
+	uint32_t w[64];
+	for (unsigned i = 0; i < 16; i++)
+		w[i] = merge4x8to32(block, i * 4);
+	for (unsigned i = 16; i < 64; i++)
+	{
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (unsigned i = 0; i < 64; i++)
+	{
+		uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+#ifdef CPU_X86
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target("sha,sse4.1")
+#endif
+static void sha256_compress_sha_ni(uint32_t state[8], const uint8_t block[64])
+{
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	// state is kept as ABEF and CDGH halves
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+	__m128i abef = state0;
+	__m128i cdgh = state1;
+	__m128i w[16];
+	for (unsigned i = 0; i < 4; i++)
+		w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + i * 16)), byte_swap);
+	for (unsigned i = 4; i < 16; i++)
+		w[i] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[i - 4], w[i - 3]),
+			_mm_alignr_epi8(w[i - 1], w[i - 2], 4)), w[i - 1]);
+	for (unsigned i = 0; i < 16; i++)
+	{
+		__m128i msg = _mm_add_epi32(w[i], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+	}
+	state0 = _mm_add_epi32(state0, abef);
+	state1 = _mm_add_epi32(state1, cdgh);
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+#endif
+
+#ifdef CPU_ARM64
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("crypto"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#endif
+static void sha256_compress_armv8(uint32_t state[8], const uint8_t block[64])
+{
+	uint32x4_t state0 = vld1q_u32(&state[0]);
+	uint32x4_t state1 = vld1q_u32(&state[4]);
+	uint32x4_t abcd = state0;
+	uint32x4_t efgh = state1;
+	uint32x4_t w[16];
+	for (unsigned i = 0; i < 4; i++)
+		w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(block + i * 16)));
+	for (unsigned i = 4; i < 16; i++)
+		w[i] = vsha256su1q_u32(vsha256su0q_u32(w[i - 4], w[i - 3]), w[i - 2], w[i - 1]);
+	for (unsigned i = 0; i < 16; i++)
+	{
+		uint32x4_t msg = vaddq_u32(w[i], vld1q_u32(&sha256_k[i * 4]));
+		uint32x4_t tmp = state0;
+		state0 = vsha256hq_u32(state0, state1, msg);
+		state1 = vsha256h2q_u32(state1, tmp, msg);
+	}
+	vst1q_u32(&state[0], vaddq_u32(state0, abcd));
+	vst1q_u32(&state[4], vaddq_u32(state1, efgh));
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#endif
+
+typedef void(*sha256_compress_func)(uint32_t state[8], const uint8_t block[64]);
+
+static sha256_compress_func get_sha256_compress(sha256_impl impl)
+{
+	switch (impl)
+	{
+#ifdef CPU_X86
+	case sha256_impl::sha_ni:
+		return sha256_compress_sha_ni;
+#endif
+#ifdef CPU_ARM64
+	case sha256_impl::armv8:
+		return sha256_compress_armv8;
+#endif
+	default:
+		return sha256_compress_portable;
+	}
+}
+
+static sha256_impl accelerated_sha256_impl()
+{
+#if defined(CPU_X86)
+	return sha256_impl::sha_ni;
+#elif defined(CPU_ARM64)
+	return sha256_impl::armv8;
+#else
+	return sha256_impl::portable;
+#endif
+}
+
+static bool compare_sha256_compress(sha256_compress_func func, unsigned rounds)
+{
+	uint64_t seed = 0x243f6a8885a308d3ULL;
+	for (unsigned r = 0; r < rounds; r++)
+	{
+		uint32_t expected[8], state[8];
+		uint8_t block[64];
+		for (unsigned i = 0; i < 8; i++)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			expected[i] = state[i] = (uint32_t)seed;
+		}
+		for (unsigned i = 0; i < 64; i++)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			block[i] = (uint8_t)seed;
+		}
+		sha256_compress_portable(expected, block);
+		func(state, block);
+		if (memcmp(expected, state, sizeof(state)) != 0)
+			return false;
+	}
+	return true;
+}
+
+static std::atomic<sha256_impl>& current_sha256_impl()
+{
+	// accelerated code is used only after it agrees with the portable one
+	static std::atomic<sha256_impl> impl(
+		is_sha256_impl_supported(accelerated_sha256_impl()) &&
+		compare_sha256_compress(get_sha256_compress(accelerated_sha256_impl()), 16) ?
+		accelerated_sha256_impl() : sha256_impl::portable);
+	return impl;
+}
+
+sha256_impl get_sha256_impl()
+{
+	return current_sha256_impl().load(std::memory_order_relaxed);
+}
+
+bool is_sha256_impl_supported(sha256_impl impl)
+{
+	if (impl == sha256_impl::portable)
+		return true;
+	return impl == accelerated_sha256_impl() && get_cpu_features().sha_;
+}
+
+void set_sha256_impl(sha256_impl impl)
+{
+	if (!is_sha256_impl_supported(impl))
+		throw std::runtime_error("SHA-256 implementation is not supported by cpu");
+	current_sha256_impl().store(impl, std::memory_order_relaxed);
+}
+
+bool sha256_self_test(unsigned rounds)
+{
+	sha256_impl impl = accelerated_sha256_impl();
+	if (!is_sha256_impl_supported(impl) || impl == sha256_impl::portable)
+		return true;
+	return compare_sha256_compress(get_sha256_compress(impl), rounds);
+}
+
+// padding block that follows every 64 byte message
+static const uint8_t sha256_padding_block[64] = {
+	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0
+};
+
+static bi::uint256_t sha256_digest(const uint32_t state[8])
+{
+	// uint256_t keeps its 64 bit words from the most significant one
+	uint64_t words[4];
+	for (unsigned i = 0; i < 4; i++)
+		words[i] = ((uint64_t)state[i * 2] << 32) | state[i * 2 + 1];
+	bi::uint256_t res;
+	memcpy(&res, words, sizeof(words));
+	return res;
+}
+
+bi::uint256_t hash(const bi::uint256_t& val1,
+	const bi::uint256_t& val2)
+{
+	sha256_compress_func compress = get_sha256_compress(get_sha256_impl());
+	uint8_t block[64];
+	uint256_to_bytes(val1, block);
+	uint256_to_bytes(val2, block + 32);
+	uint32_t state[8];
+	memcpy(state, sha256_init, sizeof(state));
+	compress(state, block);
+	compress(state, sha256_padding_block);
+	return sha256_digest(state);
+}
+
+bi::uint256_t hash(const bi::uint256_t& val)
+{
+	sha256_compress_func compress = get_sha256_compress(get_sha256_impl());
+	uint8_t block[64];
+	uint256_to_bytes(val, block);
+	memset(block + 32, 0, 32);
+	// 256 bit message length
+	block[32] = 0x80;
+	block[62] = 0x01;
+	uint32_t state[8];
+	memcpy(state, sha256_init, sizeof(state));
+	compress(state, block);
+	return sha256_digest(state);
+}
+
+bi::uint256_t hash(const uint8_t* data, size_t size)
+{
+	sha256_compress_func compress = get_sha256_compress(get_sha256_impl());
+	uint32_t state[8];
+	memcpy(state, sha256_init, sizeof(state));
+	size_t full = size - size % 64;
+	for (size_t i = 0; i < full; i += 64)
+		compress(state, data + i);
+	// the tail, 0x80 and the bit length take one or two blocks
+	uint8_t tail[128];
+	size_t tail_size = size - full;
+	memset(tail, 0, sizeof(tail));
+	// data of an empty input may be nullptr
+	if (tail_size)
+		memcpy(tail, data + full, tail_size);
+	tail[tail_size] = 0x80;
+	size_t blocks = tail_size + 9 > 64 ? 2 : 1;
+	uint64_t bits = (uint64_t)size * 8;
+	for (unsigned i = 0; i < 8; i++)
+		tail[blocks * 64 - 1 - i] = (uint8_t)(bits >> (i * 8));
+	for (size_t i = 0; i < blocks; i++)
+		compress(state, tail + i * 64);
+	return sha256_digest(state);
+}
+
+#ifdef CPU_X86
+#define SIMD_KERNEL sha256_sse2
+#define SIMD_VEC __m128i
+#define SIMD_LANES 4
+#define SIMD_LOAD(p) _mm_load_si128((const __m128i*)(p))
+#define SIMD_STORE(p, v) _mm_store_si128((__m128i*)(p), v)
+#define SIMD_SET1(x) _mm_set1_epi32((int)(x))
+#define SIMD_ADD _mm_add_epi32
+#define SIMD_XOR _mm_xor_si128
+#define SIMD_AND _mm_and_si128
+#define SIMD_OR _mm_or_si128
+#define SIMD_ANDNOT _mm_andnot_si128
+#define SIMD_SHR _mm_srli_epi32
+#define SIMD_ROTR(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+#include "hashes_simd.inc"
+#undef SIMD_KERNEL
+#undef SIMD_VEC
+#undef SIMD_LANES
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_SET1
+#undef SIMD_ADD
+#undef SIMD_XOR
+#undef SIMD_AND
+#undef SIMD_OR
+#undef SIMD_ANDNOT
+#undef SIMD_SHR
+#undef SIMD_ROTR
+
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define SIMD_KERNEL sha256_avx2
+#define SIMD_VEC __m256i
+#define SIMD_LANES 8
+#define SIMD_LOAD(p) _mm256_load_si256((const __m256i*)(p))
+#define SIMD_STORE(p, v) _mm256_store_si256((__m256i*)(p), v)
+#define SIMD_SET1(x) _mm256_set1_epi32((int)(x))
+#define SIMD_ADD _mm256_add_epi32
+#define SIMD_XOR _mm256_xor_si256
+#define SIMD_AND _mm256_and_si256
+#define SIMD_OR _mm256_or_si256
+#define SIMD_ANDNOT _mm256_andnot_si256
+#define SIMD_SHR _mm256_srli_epi32
+#define SIMD_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#include "hashes_simd.inc"
+#undef SIMD_KERNEL
+#undef SIMD_VEC
+#undef SIMD_LANES
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_SET1
+#undef SIMD_ADD
+#undef SIMD_XOR
+#undef SIMD_AND
+#undef SIMD_OR
+#undef SIMD_ANDNOT
+#undef SIMD_SHR
+#undef SIMD_ROTR
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+#define SIMD_KERNEL sha256_avx512
+#define SIMD_VEC __m512i
+#define SIMD_LANES 16
+#define SIMD_LOAD(p) _mm512_load_si512((const void*)(p))
+#define SIMD_STORE(p, v) _mm512_store_si512((void*)(p), v)
+#define SIMD_SET1(x) _mm512_set1_epi32((int)(x))
+#define SIMD_ADD _mm512_add_epi32
+#define SIMD_XOR _mm512_xor_si512
+#define SIMD_AND _mm512_and_si512
+#define SIMD_OR _mm512_or_si512
+// zero masked forms with every lane set: the plain ones merge into
+// _mm512_undefined_epi32, which g++ -Wall takes for an uninitialized value
+#define SIMD_ANDNOT(x, y) _mm512_maskz_andnot_epi32((__mmask16)0xffff, x, y)
+#define SIMD_SHR(x, n) _mm512_maskz_srli_epi32((__mmask16)0xffff, x, n)
+#define SIMD_ROTR(x, n) _mm512_maskz_ror_epi32((__mmask16)0xffff, x, n)
+#include "hashes_simd.inc"
+#undef SIMD_KERNEL
+#undef SIMD_VEC
+#undef SIMD_LANES
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_SET1
+#undef SIMD_ADD
+#undef SIMD_XOR
+#undef SIMD_AND
+#undef SIMD_OR
+#undef SIMD_ANDNOT
+#undef SIMD_SHR
+#undef SIMD_ROTR
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+#endif
+
+hash_kernel detect_hash_kernel()
+{
+	const cpu_features& features = get_cpu_features();
+	if (features.avx512f_)
+		return hash_kernel::avx512;
+	if (features.avx2_)
+		return hash_kernel::avx2;
+	if (features.sse2_)
+		return hash_kernel::sse2;
+	return hash_kernel::scalar;
+}
+
+bool is_hash_kernel_supported(hash_kernel kernel)
+{
+	const cpu_features& features = get_cpu_features();
+	switch (kernel)
+	{
+	case hash_kernel::scalar:
+		return true;
+	case hash_kernel::sse2:
+		return features.sse2_;
+	case hash_kernel::avx2:
+		return features.avx2_;
+	case hash_kernel::avx512:
+		return features.avx512f_;
+	}
+	return false;
+}
+
+void hash_many(const bi::uint256_t* val1, const bi::uint256_t* val2,
+	bi::uint256_t* res, size_t count)
+{
+	static const hash_kernel best = detect_hash_kernel();
+	hash_many(val1, val2, res, count, best);
+}
+
+void hash_many(const bi::uint256_t* val1, const bi::uint256_t* val2,
+	bi::uint256_t* res, size_t count, hash_kernel kernel)
+{
+	if (!is_hash_kernel_supported(kernel))
+		throw std::runtime_error("Hash kernel is not supported by cpu");
+	size_t i = 0;
+#ifdef CPU_X86
+	typedef void(*simd_kernel)(const uint8_t*, uint8_t*);
+	simd_kernel func = nullptr;
+	size_t lanes = 1;
+	if (kernel == hash_kernel::avx512)
+	{
+		func = sha256_avx512;
+		lanes = 16;
+	}
+	else if (kernel == hash_kernel::avx2)
+	{
+		func = sha256_avx2;
+		lanes = 8;
+	}
+	else if (kernel == hash_kernel::sse2)
+	{
+		func = sha256_sse2;
+		lanes = 4;
+	}
+	if (func)
+	{
+		uint8_t messages[16 * 64];
+		uint8_t digests[16 * 32];
+		for (; i + lanes <= count; i += lanes)
+		{
+			for (size_t j = 0; j < lanes; j++)
+			{
+				uint256_to_bytes(val1[i + j], messages + j * 64);
+				uint256_to_bytes(val2[i + j], messages + j * 64 + 32);
+			}
+			func(messages, digests);
+			for (size_t j = 0; j < lanes; j++)
+				res[i + j] = uint256_from_bytes(digests + j * 32);
+		}
+	}
+#endif
+	for (; i < count; i++)
+		res[i] = hash(val1[i], val2[i]);
+}
+
+#include "default_hashes.inc"
+
+const bi::uint256_t& default_hash(unsigned depth)
+{
+	// the table is precomputed, nothing is hashed here
+	static const std::array<bi::uint256_t, KEY_LENGTH + 1> defaults = []() {
+		std::array<bi::uint256_t, KEY_LENGTH + 1> res;
+		for (unsigned i = 0; i <= KEY_LENGTH; i++)
+		{
+			const uint64_t* words = default_hash_words[i];
+			res[i] = bi::uint256_t(bi::uint128_t(words[0], words[1]),
+				bi::uint128_t(words[2], words[3]));
+		}
+		return res;
+	}();
+	if (depth > KEY_LENGTH)
+		throw std::runtime_error("Invalid tree depth");
+	return defaults[depth];
+}
+
+bi::uint256_t lift_hash(const bi::uint256_t& key, bi::uint256_t val,
+	unsigned from_depth, unsigned to_depth)
+{
+	if (val == default_hash(from_depth))
+		return default_hash(to_depth);
+	for (unsigned depth = from_depth; depth > to_depth; depth--)
+	{
+		if (key_bit(key, depth - 1))
+			val = hash(default_hash(depth), val);
+		else
+			val = hash(val, default_hash(depth));
+	}
+	return val;
+}
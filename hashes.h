@@ -2,6 +2,52 @@
 
 #include "common.h"
 
+// SHA-256 over the big endian bytes of the arguments
 bi::uint256_t hash(const bi::uint256_t& val1, 
 	const bi::uint256_t& val2);
 bi::uint256_t hash(const bi::uint256_t& val);
+// SHA-256 of a byte string, the same as hash(val) for the big endian
+// bytes of val
+bi::uint256_t hash(const uint8_t* data, size_t size);
+
+enum class sha256_impl
+{
+	portable,
+	sha_ni,
+	armv8
+};
+
+// hash() uses SHA-256 instructions when the cpu has them
+sha256_impl get_sha256_impl();
+bool is_sha256_impl_supported(sha256_impl impl);
+void set_sha256_impl(sha256_impl impl);
+// checks the accelerated implementation against the portable one on
+// random input, true if there is nothing to check
+bool sha256_self_test(unsigned rounds);
+
+enum class hash_kernel
+{
+	scalar,
+	sse2,
+	avx2,
+	avx512
+};
+
+// widest kernel supported by the cpu
+hash_kernel detect_hash_kernel();
+bool is_hash_kernel_supported(hash_kernel kernel);
+
+// res[i] = hash(val1[i], val2[i]) for count independent pairs, several
+// pairs are hashed at once in SIMD lanes
+void hash_many(const bi::uint256_t* val1, const bi::uint256_t* val2,
+	bi::uint256_t* res, size_t count);
+void hash_many(const bi::uint256_t* val1, const bi::uint256_t* val2,
+	bi::uint256_t* res, size_t count, hash_kernel kernel);
+
+// hash of an empty subtree whose root sits at the given depth,
+// depth KEY_LENGTH is an empty leaf
+const bi::uint256_t& default_hash(unsigned depth);
+// hash of a subtree at depth from_depth as seen from the level to_depth,
+// all the siblings on the way are empty subtrees
+bi::uint256_t lift_hash(const bi::uint256_t& key, bi::uint256_t val,
+	unsigned from_depth, unsigned to_depth);
@@ -0,0 +1,193 @@
+#include "merkle_cursor.h"
+#include "merkle_storage.h"
+#include "storage_block_parser.h"
+#include "utils.h"
+#include <stdexcept>
+
+using namespace bi;
+
+merkle_cursor::merkle_cursor(merkle_storage& storage)
+	: merkle_cursor(storage, uint256_0, ~uint256_0)
+{
+}
+
+merkle_cursor::merkle_cursor(merkle_storage& storage, const uint256_t& lower,
+	const uint256_t& upper)
+	: storage_(storage), lower_(lower), upper_(upper), prefetch_(false)
+{
+}
+
+bool merkle_cursor::seek(const uint256_t& key)
+{
+	if (!seek(key < lower_ ? lower_ : key, 0))
+		return false;
+	return check_bounds();
+}
+
+bool merkle_cursor::seek_prev(const uint256_t& key)
+{
+	if (!seek(key > upper_ ? upper_ : key, 1))
+		return false;
+	return check_bounds();
+}
+
+bool merkle_cursor::seek_first()
+{
+	return seek(lower_);
+}
+
+bool merkle_cursor::seek_last()
+{
+	return seek_prev(upper_);
+}
+
+bool merkle_cursor::next()
+{
+	if (!valid() || !advance(0))
+		return false;
+	return check_bounds();
+}
+
+bool merkle_cursor::prev()
+{
+	if (!valid() || !advance(1))
+		return false;
+	return check_bounds();
+}
+
+bool merkle_cursor::valid() const
+{
+	return !stack_.empty();
+}
+
+const uint256_t& merkle_cursor::key() const
+{
+	if (!valid())
+		throw std::runtime_error("Cursor is not positioned");
+	return key_;
+}
+
+void merkle_cursor::value(uint256_t& value)
+{
+	if (!valid())
+		throw std::runtime_error("Cursor is not positioned");
+	storage_.read_leaf_value(stack_.back(), value);
+}
+
+void merkle_cursor::value(std::vector<uint8_t>& value)
+{
+	if (!valid())
+		throw std::runtime_error("Cursor is not positioned");
+	storage_.read_leaf_value(stack_.back(), value);
+}
+
+uint32_t merkle_cursor::value_size()
+{
+	if (!valid())
+		throw std::runtime_error("Cursor is not positioned");
+	return storage_block_parser(stack_.back()).get_value_size();
+}
+
+void merkle_cursor::set_prefetch(bool prefetch)
+{
+	prefetch_ = prefetch;
+}
+
+bool merkle_cursor::seek(const uint256_t& key, unsigned side)
+{
+	stack_.clear();
+	push(MERKLE_ROOT_BLOCK);
+	while (true)
+	{
+		storage_block_parser parser(stack_.back());
+		unsigned depth = parser.get_prefix_length();
+		uint256_t prefix;
+		parser.get_prefix(prefix);
+		unsigned common = common_prefix_length(key, prefix);
+		if (common < depth)
+		{
+			// the whole subtree is on one side of the key
+			if (key_bit(key, common) == side)
+				return descend(side);
+			return advance(side);
+		}
+		if (depth == KEY_LENGTH)
+		{
+			key_ = prefix;
+			return true;
+		}
+		unsigned bit = key_bit(key, depth);
+		uint32_t child_idx = bit ? parser.get_second_child_id() : parser.get_first_child_id();
+		if (child_idx != 0)
+		{
+			push(child_idx);
+			continue;
+		}
+		// only the root can miss a child
+		if (bit == side)
+			return descend(side);
+		return advance(side);
+	}
+}
+
+bool merkle_cursor::descend(unsigned side)
+{
+	while (true)
+	{
+		storage_block_parser parser(stack_.back());
+		if (parser.get_prefix_length() == KEY_LENGTH)
+		{
+			parser.get_prefix(key_);
+			return true;
+		}
+		uint32_t near_idx = side ? parser.get_second_child_id() : parser.get_first_child_id();
+		uint32_t far_idx = side ? parser.get_first_child_id() : parser.get_second_child_id();
+		if (near_idx == 0)
+		{
+			if (far_idx == 0)
+			{
+				// empty root
+				stack_.clear();
+				return false;
+			}
+			push(far_idx);
+			continue;
+		}
+		if (prefetch_ && far_idx != 0)
+			storage_.file_.prefetch_block(far_idx);
+		push(near_idx);
+	}
+}
+
+bool merkle_cursor::advance(unsigned side)
+{
+	while (true)
+	{
+		uint256_t prefix;
+		storage_block_parser(stack_.back()).get_prefix(prefix);
+		stack_.pop_back();
+		if (stack_.empty())
+			return false;
+		storage_block_parser parser(stack_.back());
+		if (key_bit(prefix, parser.get_prefix_length()) != side)
+			continue;
+		uint32_t far_idx = side ? parser.get_first_child_id() : parser.get_second_child_id();
+		if (far_idx == 0)
+			continue;
+		push(far_idx);
+		return descend(side);
+	}
+}
+
+void merkle_cursor::push(uint32_t idx)
+{
+	stack_.emplace_back();
+	storage_.file_.read_block(idx, stack_.back());
+}
+
+bool merkle_cursor::check_bounds()
+{
+	if (key_ < lower_ || key_ > upper_)
+		stack_.clear();
+	return valid();
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include "common.h"
+
+class merkle_storage;
+
+// Walks the keys of a merkle_storage in key order within inclusive
+// bounds. The blocks from the root to the current leaf are kept on a
+// stack, so a step reads only the blocks it hasn't passed yet and a full
+// scan reads every block once. Any write to the storage invalidates the
+// cursor, it has to seek again.
+class merkle_cursor
+{
+public:
+	explicit merkle_cursor(merkle_storage& storage);
+	merkle_cursor(merkle_storage& storage, const bi::uint256_t& lower,
+		const bi::uint256_t& upper);
+
+	// positions at the first key not less than key, or the last key not
+	// greater than key for seek_prev. return valid()
+	bool seek(const bi::uint256_t& key);
+	bool seek_prev(const bi::uint256_t& key);
+	bool seek_first();
+	bool seek_last();
+	bool next();
+	bool prev();
+	bool valid() const;
+
+	const bi::uint256_t& key() const;
+	void value(bi::uint256_t& value);
+	void value(std::vector<uint8_t>& value);
+	// 0 for a 256 bit value, the size with BYTES_VALUE_FLAG for a byte string
+	uint32_t value_size();
+
+	// while descending, asks the storage to start loading the sibling
+	// subtree the scan visits next. pays off for long scans only
+	void set_prefetch(bool prefetch);
+private:
+	// side 0 goes towards greater keys, side 1 towards smaller ones
+	bool seek(const bi::uint256_t& key, unsigned side);
+	// goes down from the top of the stack to its first leaf on side
+	bool descend(unsigned side);
+	// leaves the subtree on the top of the stack for the next one on side
+	bool advance(unsigned side);
+	void push(uint32_t idx);
+	bool check_bounds();
+
+	merkle_storage& storage_;
+	bi::uint256_t lower_;
+	bi::uint256_t upper_;
+	std::vector<data_block> stack_;
+	bi::uint256_t key_;
+	bool prefetch_;
+};
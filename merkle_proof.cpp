@@ -0,0 +1,254 @@
+#include "merkle_proof.h"
+#include "hashes.h"
+#include "utils.h"
+#include <algorithm>
+
+size_t count_proof_siblings(const merkle_proof& proof)
+{
+	size_t count = 0;
+	for (uint64_t word : proof.siblings_map_)
+		for (; word; word &= word - 1)
+			count++;
+	return count;
+}
+
+void clear_proof(merkle_proof& proof)
+{
+	proof.siblings_map_.fill(0);
+	proof.siblings_.clear();
+}
+
+void add_proof_sibling(merkle_proof& proof, unsigned depth, const bi::uint256_t& sibling)
+{
+	if (sibling == default_hash(depth + 1))
+		return;
+	proof.siblings_map_[depth / 64] |= 1ULL << (depth % 64);
+	proof.siblings_.push_back(sibling);
+}
+
+bool has_proof_sibling(const merkle_proof& proof, unsigned depth)
+{
+	return (proof.siblings_map_[depth / 64] >> (depth % 64)) & 1;
+}
+
+void add_multiproof_sibling(merkle_multiproof& proof, unsigned depth,
+	const bi::uint256_t& sibling)
+{
+	bool non_empty = sibling != default_hash(depth + 1);
+	proof.siblings_map_.push_back(non_empty);
+	if (non_empty)
+		proof.siblings_.push_back(sibling);
+}
+
+// hash of the subtree at depth holding the sorted keys, consumes the
+// siblings in the order prove_many adds them
+static bool multiproof_root(const merkle_multiproof& proof, size_t& next_flag,
+	size_t& next_sibling, unsigned depth, const bi::uint256_t* begin,
+	const bi::uint256_t* end, const bi::uint256_t* leaf_hashes, bi::uint256_t& root)
+{
+	if (depth == KEY_LENGTH)
+	{
+		root = *leaf_hashes;
+		return true;
+	}
+	const bi::uint256_t* middle = std::partition_point(begin, end,
+		[depth](const bi::uint256_t& key) { return key_bit(key, depth) == 0; });
+	if (begin != middle && middle != end)
+	{
+		bi::uint256_t first, second;
+		if (!multiproof_root(proof, next_flag, next_sibling, depth + 1,
+				begin, middle, leaf_hashes, first) ||
+			!multiproof_root(proof, next_flag, next_sibling, depth + 1,
+				middle, end, leaf_hashes + (middle - begin), second))
+			return false;
+		root = hash(first, second);
+		return true;
+	}
+	if (next_flag >= proof.siblings_map_.size())
+		return false;
+	bi::uint256_t sibling = default_hash(depth + 1);
+	if (proof.siblings_map_[next_flag++])
+	{
+		if (next_sibling >= proof.siblings_.size())
+			return false;
+		sibling = proof.siblings_[next_sibling++];
+	}
+	bi::uint256_t child;
+	if (!multiproof_root(proof, next_flag, next_sibling, depth + 1,
+			begin, end, leaf_hashes, child))
+		return false;
+	if (child == default_hash(depth + 1) && sibling == child)
+		root = default_hash(depth);
+	else if (begin == middle)
+		root = hash(sibling, child);
+	else
+		root = hash(child, sibling);
+	return true;
+}
+
+bool proof_root(const bi::uint256_t& key, const bi::uint256_t& leaf_hash,
+	const merkle_proof& proof, bi::uint256_t& root)
+{
+	if (count_proof_siblings(proof) != proof.siblings_.size())
+		return false;
+	size_t next = proof.siblings_.size();
+	root = leaf_hash;
+	for (unsigned depth = KEY_LENGTH; depth > 0; depth--)
+	{
+		if (!has_proof_sibling(proof, depth - 1))
+		{
+			// empty subtree stays empty one level up
+			if (root == default_hash(depth))
+			{
+				root = default_hash(depth - 1);
+				continue;
+			}
+			if (key_bit(key, depth - 1))
+				root = hash(default_hash(depth), root);
+			else
+				root = hash(root, default_hash(depth));
+			continue;
+		}
+		const bi::uint256_t& sibling = proof.siblings_[--next];
+		if (key_bit(key, depth - 1))
+			root = hash(sibling, root);
+		else
+			root = hash(root, sibling);
+	}
+	return true;
+}
+
+bool verify_inclusion(const bi::uint256_t& root, const bi::uint256_t& key,
+	const bi::uint256_t& value, const merkle_proof& proof)
+{
+	bi::uint256_t res;
+	return proof_root(key, hash(value), proof, res) && res == root;
+}
+
+bool verify_inclusion(const bi::uint256_t& root, const bi::uint256_t& key,
+	const uint8_t* data, size_t size, const merkle_proof& proof)
+{
+	bi::uint256_t res;
+	return proof_root(key, hash(data, size), proof, res) && res == root;
+}
+
+bool verify_exclusion(const bi::uint256_t& root, const bi::uint256_t& key,
+	const merkle_proof& proof)
+{
+	bi::uint256_t res;
+	return proof_root(key, default_hash(KEY_LENGTH), proof, res) && res == root;
+}
+
+bool verify_multiproof(const bi::uint256_t& root, const std::vector<bi::uint256_t>& keys,
+	const std::vector<bi::uint256_t>& values, const std::vector<bool>& found,
+	const merkle_multiproof& proof)
+{
+	if (keys.size() != values.size() || keys.size() != found.size())
+		return false;
+	if (keys.empty())
+		return proof.siblings_map_.empty() && proof.siblings_.empty();
+	std::vector<std::pair<bi::uint256_t, bi::uint256_t>> leaves;
+	for (size_t i = 0; i < keys.size(); i++)
+		leaves.push_back(std::make_pair(keys[i],
+			found[i] ? hash(values[i]) : default_hash(KEY_LENGTH)));
+	std::sort(leaves.begin(), leaves.end());
+	std::vector<bi::uint256_t> sorted_keys, leaf_hashes;
+	for (auto& leaf : leaves)
+	{
+		if (!sorted_keys.empty() && sorted_keys.back() == leaf.first)
+		{
+			// the same key claimed twice has to be claimed the same way
+			if (leaf_hashes.back() != leaf.second)
+				return false;
+			continue;
+		}
+		sorted_keys.push_back(leaf.first);
+		leaf_hashes.push_back(leaf.second);
+	}
+	size_t next_flag = 0, next_sibling = 0;
+	bi::uint256_t res;
+	if (!multiproof_root(proof, next_flag, next_sibling, 0, sorted_keys.data(),
+			sorted_keys.data() + sorted_keys.size(), leaf_hashes.data(), res))
+		return false;
+	// a valid proof is consumed completely
+	return next_flag == proof.siblings_map_.size() &&
+		next_sibling == proof.siblings_.size() && res == root;
+}
+
+std::vector<uint8_t> serialize_proof(const merkle_proof& proof)
+{
+	std::vector<uint8_t> res(PROOF_MAP_WORDS * 8 + proof.siblings_.size() * 32);
+	uint8_t* p = res.data();
+	for (uint64_t word : proof.siblings_map_)
+		for (unsigned i = 0; i < 8; i++)
+			*p++ = (uint8_t)(word >> (56 - i * 8));
+	for (auto& sibling : proof.siblings_)
+	{
+		uint256_to_bytes(sibling, p);
+		p += 32;
+	}
+	return res;
+}
+
+bool deserialize_proof(const uint8_t* data, size_t size, merkle_proof& proof)
+{
+	clear_proof(proof);
+	if (size < PROOF_MAP_WORDS * 8)
+		return false;
+	for (auto& word : proof.siblings_map_)
+		for (unsigned i = 0; i < 8; i++)
+			word = (word << 8) | *data++;
+	size -= PROOF_MAP_WORDS * 8;
+	if (size != count_proof_siblings(proof) * 32)
+		return false;
+	for (; size; size -= 32, data += 32)
+		proof.siblings_.push_back(uint256_from_bytes(data));
+	return true;
+}
+
+std::vector<uint8_t> serialize_proof(const merkle_multiproof& proof)
+{
+	uint32_t flags = (uint32_t)proof.siblings_map_.size();
+	std::vector<uint8_t> res(4 + (flags + 7) / 8 + proof.siblings_.size() * 32, 0);
+	split32to4x8(res, 0, flags);
+	for (uint32_t i = 0; i < flags; i++)
+		if (proof.siblings_map_[i])
+			res[4 + i / 8] |= (uint8_t)(0x80 >> (i % 8));
+	uint8_t* p = &res[4 + (flags + 7) / 8];
+	for (auto& sibling : proof.siblings_)
+	{
+		uint256_to_bytes(sibling, p);
+		p += 32;
+	}
+	return res;
+}
+
+bool deserialize_proof(const uint8_t* data, size_t size, merkle_multiproof& proof)
+{
+	proof.siblings_map_.clear();
+	proof.siblings_.clear();
+	if (size < 4)
+		return false;
+	uint32_t flags = merge4x8to32(data, 0);
+	data += 4;
+	size -= 4;
+	// in size_t, the flag count can be up to 2^32 - 1
+	size_t bitmap = ((size_t)flags + 7) / 8;
+	if (size < bitmap)
+		return false;
+	size_t non_empty = 0;
+	for (uint32_t i = 0; i < flags; i++)
+	{
+		bool flag = (data[i / 8] & (0x80 >> (i % 8))) != 0;
+		proof.siblings_map_.push_back(flag);
+		if (flag)
+			non_empty++;
+	}
+	data += bitmap;
+	size -= bitmap;
+	if (size != non_empty * 32)
+		return false;
+	for (; size; size -= 32, data += 32)
+		proof.siblings_.push_back(uint256_from_bytes(data));
+	return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <vector>
+#include <array>
+#include "common.h"
+
+#define PROOF_MAP_WORDS (KEY_LENGTH / 64)
+
+// Siblings of the nodes on the path of one key, enough to recompute the
+// root from the key leaf. In a sparse tree almost all of them are empty
+// subtrees, those are only marked in the bitmap.
+struct merkle_proof
+{
+	// bit d of word d / 64 is set if the sibling of the key subtree at
+	// depth d + 1 is not empty
+	std::array<uint64_t, PROOF_MAP_WORDS> siblings_map_;
+	// hashes of the non-empty siblings, from the root side down
+	std::vector<bi::uint256_t> siblings_;
+};
+
+// Siblings of the paths of many keys. Every sibling subtree hanging off
+// the union of the paths appears once, subtrees holding some of the keys
+// are recomputed by the verifier instead.
+struct merkle_multiproof
+{
+	// one flag per sibling in the depth-first order over the sorted keys,
+	// left subtrees first. set if the sibling is not empty
+	std::vector<bool> siblings_map_;
+	// hashes of the non-empty siblings in the same order
+	std::vector<bi::uint256_t> siblings_;
+};
+
+void clear_proof(merkle_proof& proof);
+// hash of the sibling of the key subtree at depth + 1, siblings have to
+// be added from the root side down
+void add_proof_sibling(merkle_proof& proof, unsigned depth, const bi::uint256_t& sibling);
+bool has_proof_sibling(const merkle_proof& proof, unsigned depth);
+// siblings marked in the bitmap, a well formed proof has as many hashes
+size_t count_proof_siblings(const merkle_proof& proof);
+// hash of the next sibling, a subtree with its root at depth + 1
+void add_multiproof_sibling(merkle_multiproof& proof, unsigned depth,
+	const bi::uint256_t& sibling);
+
+// root recomputed from the hash of the key leaf, false if the proof is malformed
+bool proof_root(const bi::uint256_t& key, const bi::uint256_t& leaf_hash,
+	const merkle_proof& proof, bi::uint256_t& root);
+// the key has the value in the tree with the root
+bool verify_inclusion(const bi::uint256_t& root, const bi::uint256_t& key,
+	const bi::uint256_t& value, const merkle_proof& proof);
+// the same for a byte string value
+bool verify_inclusion(const bi::uint256_t& root, const bi::uint256_t& key,
+	const uint8_t* data, size_t size, const merkle_proof& proof);
+// the key is absent in the tree with the root
+bool verify_exclusion(const bi::uint256_t& root, const bi::uint256_t& key,
+	const merkle_proof& proof);
+
+// keys[i] has values[i] if found[i] is set and is absent otherwise in
+// the tree with the root. the keys may come in any order
+bool verify_multiproof(const bi::uint256_t& root, const std::vector<bi::uint256_t>& keys,
+	const std::vector<bi::uint256_t>& values, const std::vector<bool>& found,
+	const merkle_multiproof& proof);
+
+// bitmap followed by the sibling hashes, all big endian
+std::vector<uint8_t> serialize_proof(const merkle_proof& proof);
+// false if the bytes are not a complete proof
+bool deserialize_proof(const uint8_t* data, size_t size, merkle_proof& proof);
+// flags count, flags bitmap and the sibling hashes
+std::vector<uint8_t> serialize_proof(const merkle_multiproof& proof);
+bool deserialize_proof(const uint8_t* data, size_t size, merkle_multiproof& proof);
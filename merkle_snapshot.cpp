@@ -0,0 +1,71 @@
+#include "merkle_snapshot.h"
+#include "merkle_storage.h"
+#include "storage_block_parser.h"
+#include <stdexcept>
+
+merkle_snapshot::merkle_snapshot(merkle_storage& storage, uint64_t version, uint32_t root,
+	const bi::uint256_t& root_hash)
+	: storage_(&storage), version_(version), root_(root), root_hash_(root_hash)
+{
+}
+
+merkle_snapshot::merkle_snapshot(merkle_snapshot&& other)
+	: storage_(other.storage_), version_(other.version_), root_(other.root_),
+	root_hash_(other.root_hash_)
+{
+	other.storage_ = nullptr;
+}
+
+merkle_snapshot::~merkle_snapshot()
+{
+	if (storage_)
+		storage_->release_snapshot(version_);
+}
+
+uint64_t merkle_snapshot::version() const
+{
+	return version_;
+}
+
+const bi::uint256_t& merkle_snapshot::root_hash() const
+{
+	return root_hash_;
+}
+
+bool merkle_snapshot::does_key_exist(const bi::uint256_t& key)
+{
+	data_block leaf;
+	return storage_->find_version_leaf(root_, key, leaf);
+}
+
+void merkle_snapshot::read_value(const bi::uint256_t& key, bi::uint256_t& value)
+{
+	data_block leaf;
+	if (!storage_->find_version_leaf(root_, key, leaf))
+		throw std::runtime_error("Reading nonexisting key");
+	storage_->read_leaf_value(leaf, value);
+}
+
+void merkle_snapshot::read_value(const bi::uint256_t& key, std::vector<uint8_t>& value)
+{
+	data_block leaf;
+	if (!storage_->find_version_leaf(root_, key, leaf))
+		throw std::runtime_error("Reading nonexisting key");
+	storage_->read_leaf_value(leaf, value, true);
+}
+
+bool merkle_snapshot::prove(const bi::uint256_t& key, bi::uint256_t& value, merkle_proof& proof)
+{
+	data_block leaf;
+	value = bi::uint256_0;
+	if (!storage_->prove_key(root_, key, proof, leaf, true))
+		return false;
+	storage_->read_leaf_value(leaf, value);
+	return true;
+}
+
+bool merkle_snapshot::prove(const bi::uint256_t& key, merkle_proof& proof)
+{
+	data_block leaf;
+	return storage_->prove_key(root_, key, proof, leaf, true);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "merkle_proof.h"
+
+class merkle_storage;
+
+// Read only view of a version kept by merkle_storage::set_retained_versions.
+// The nodes of a committed version are never changed and its blocks stay
+// allocated while the snapshot is open, so any number of threads can read
+// and prove through their snapshots while the writer commits new versions.
+// The blocks are read with storage_file::read_block_shared and a snapshot
+// keeps no state of its own, so threads may also share one. All snapshots
+// have to be released before the storage is destroyed.
+class merkle_snapshot
+{
+public:
+	merkle_snapshot(merkle_snapshot&& other);
+	~merkle_snapshot();
+
+	uint64_t version() const;
+	const bi::uint256_t& root_hash() const;
+
+	bool does_key_exist(const bi::uint256_t& key);
+	void read_value(const bi::uint256_t& key, bi::uint256_t& value);
+	void read_value(const bi::uint256_t& key, std::vector<uint8_t>& value);
+	// proofs against root_hash(), as merkle_storage::prove
+	bool prove(const bi::uint256_t& key, bi::uint256_t& value, merkle_proof& proof);
+	bool prove(const bi::uint256_t& key, merkle_proof& proof);
+private:
+	friend class merkle_storage;
+	merkle_snapshot(merkle_storage& storage, uint64_t version, uint32_t root,
+		const bi::uint256_t& root_hash);
+	merkle_snapshot(const merkle_snapshot&) = delete;
+	merkle_snapshot& operator=(const merkle_snapshot&) = delete;
+
+	merkle_storage* storage_;
+	uint64_t version_;
+	// copy of the root node made for the version
+	uint32_t root_;
+	bi::uint256_t root_hash_;
+};
@@ -1,26 +1,141 @@
 #include "merkle_storage.h"
 #include "utils.h"
 #include "storage_block_parser.h"
+#include "hashes.h"
+#include <algorithm>
+#include <cstring>
+
+// value of the key or nullptr. defined before the using directive: with
+// bi in scope its templated comparisons make the iterator ones ambiguous
+template <typename Map>
+static typename Map::mapped_type* find_mapped(Map& map, const typename Map::key_type& key)
+{
+	auto it = map.find(key);
+	return it == map.end() ? nullptr : &it->second;
+}
 
 using namespace bi;
 
-#define MERKLE_ROOT_BLOCK 1
+// leaves upgraded per logged operation
+#define UPGRADE_GROUP_SIZE 1024
+
+static const uint256_t& item_key(const std::pair<uint256_t, uint256_t>& item)
+{
+	return item.first;
+}
+
+static const uint256_t& item_key(const uint256_t& key)
+{
+	return key;
+}
+
+// first of the sorted items sharing depth bits that has the bit depth set
+template <typename T>
+static const T* split_by_bit(const T* begin, const T* end, unsigned depth)
+{
+	return std::partition_point(begin, end,
+		[depth](const T& item) { return key_bit(item_key(item), depth) == 0; });
+}
+
+// siblings of keys falling into an empty subtree are all empty
+static void multiproof_empty(merkle_multiproof& proof, unsigned depth,
+	const uint256_t* begin, const uint256_t* end)
+{
+	for (; depth < KEY_LENGTH; depth++)
+	{
+		const uint256_t* middle = split_by_bit(begin, end, depth);
+		if (begin != middle && middle != end)
+		{
+			multiproof_empty(proof, depth + 1, begin, middle);
+			multiproof_empty(proof, depth + 1, middle, end);
+			return;
+		}
+		add_multiproof_sibling(proof, depth, default_hash(depth + 1));
+	}
+}
+
+// lifts the stored and the computed hash of a node to its slot, once if they agree
+static uint256_t lift_verified(const uint256_t& prefix, const uint256_t& stored,
+	const uint256_t& computed, unsigned depth, unsigned slot_depth, uint256_t& stored_hash)
+{
+	stored_hash = lift_hash(prefix, stored, depth, slot_depth);
+	return stored == computed ? stored_hash : lift_hash(prefix, computed, depth, slot_depth);
+}
+
+// blocks of the overflow extent of a leaf value, 0 if it has none
+static uint32_t value_extent_blocks(data_block& leaf)
+{
+	storage_block_parser parser(leaf);
+	uint32_t size = parser.get_value_size();
+	if (!(size & BYTES_VALUE_FLAG) || (size & ~BYTES_VALUE_FLAG) <= BLOCK_VALUE_SIZE)
+		return 0;
+	return ((size & ~BYTES_VALUE_FLAG) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// 256 bit value of a leaf, a byte string value has to be 32 bytes long
+static void get_leaf_value(data_block& leaf, uint256_t& value)
+{
+	storage_block_parser parser(leaf);
+	uint32_t size = parser.get_value_size();
+	if (size == 0)
+	{
+		parser.get_value(value);
+		return;
+	}
+	if (size != (BYTES_VALUE_FLAG | 32))
+		throw std::runtime_error("Value is not a 256 bit number");
+	uint8_t bytes[32];
+	parser.get_value_bytes(bytes, sizeof(bytes));
+	value = uint256_from_bytes(bytes);
+}
+
+static void clear_path(merkle_path& path)
+{
+	for (auto& level : path)
+	{
+		level.first.block_ = 0;
+		level.first.value_ = uint256_0;
+		level.second.block_ = 0;
+		level.second.value_ = uint256_0;
+	}
+}
 
 merkle_storage::merkle_storage()
+	: in_transaction_(false), transaction_id_(0), retained_versions_(0), last_version_(0),
+	hash_threads_(0), split_depth_(DEFAULT_HASH_SPLIT_DEPTH), deferred_(false)
+{
+	retiring_.block_ = 0;
+}
+
+merkle_storage::~merkle_storage()
 {
+	try
+	{
+		if (!in_transaction_)
+			settle_hashes();
+	}
+	catch (...)
+	{
+	}
 }
 
-std::unique_ptr<merkle_storage> merkle_storage::create(const std::string& file_name)
+std::unique_ptr<merkle_storage> merkle_storage::create(const std::string& file_name,
+	storage_backend_type type)
 {
 	std::unique_ptr<merkle_storage> res(new merkle_storage());
-	res->init_new_db(file_name);
+	res->init_new_db(file_name, type);
 	return res;
 }
 
-std::unique_ptr<merkle_storage> merkle_storage::open(const std::string& file_name)
+std::unique_ptr<merkle_storage> merkle_storage::open(const std::string& file_name,
+	storage_backend_type type)
 {
 	std::unique_ptr<merkle_storage> res(new merkle_storage());
-	res->file_.open(file_name);
+	res->file_.open(file_name, type, true);
+	if (res->file_.get_format_version() < STORAGE_FORMAT_VERSION)
+		res->upgrade_format();
+	res->load_root_hash();
+	res->load_versions();
 	return res;
 }
 
@@ -31,98 +146,307 @@ void merkle_storage::read_value(const uint256_t& key, uint256_t& value)
 
 void merkle_storage::read_value(const uint256_t& key, uint256_t& value, merkle_path& path)
 {
-	if (!does_key_exist(key, path))
-		throw std::runtime_error("Reading nonexisting key");
-	uint32_t value_block_idx = get_value_block_id(key, path);
 	data_block data;
-	file_.read_block(value_block_idx, data);
 	storage_block_parser parser(data);
-	parser.get_value(value);
+	if (find_leaf(key, path, data) == 0)
+		throw std::runtime_error("Reading nonexisting key");
+	get_leaf_value(data, value);
 }
 
-void merkle_storage::write_value(const uint256_t& key, const uint256_t& value)
+void merkle_storage::read_value(const uint256_t& key, std::vector<uint8_t>& value)
 {
-	write_value(key, value, local_path_stub_);
+	data_block leaf;
+	if (find_leaf(key, local_path_stub_, leaf) == 0)
+		throw std::runtime_error("Reading nonexisting key");
+	read_leaf_value(leaf, value);
 }
 
-void merkle_storage::write_value(const uint256_t& key, const uint256_t& value,
-	merkle_path& path)
+void merkle_storage::read_leaf_value(data_block& leaf, uint256_t& value)
 {
-	if (!does_key_exist(key, path))
-		create_key(key, path);
-	uint32_t value_block_idx = get_value_block_id(key, path);
-	uint32_t parent_block_idx = get_value_parent_block_idx(key, path);
-	data_block data;
-	storage_block_parser parser(data);
-	parser.clear();
-	parser.set_type(VALUE_BLOCK_TYPE);
-	parser.set_parent_id(parent_block_idx);
-	parser.set_value(value);
-	file_.write_block(value_block_idx, data);
+	get_leaf_value(leaf, value);
 }
 
-void merkle_storage::delete_value(const uint256_t& key)
+void merkle_storage::read_leaf_value(data_block& leaf, std::vector<uint8_t>& value,
+	bool shared)
 {
-	delete_value(key, local_path_stub_);
+	storage_block_parser parser(leaf);
+	uint32_t size = parser.get_value_size();
+	if (size == 0)
+	{
+		// 256 bit numbers read as their big endian bytes
+		uint256_t number;
+		parser.get_value(number);
+		value.resize(32);
+		uint256_to_bytes(number, value.data());
+		return;
+	}
+	size &= ~BYTES_VALUE_FLAG;
+	value.resize(size);
+	if (size <= BLOCK_VALUE_SIZE)
+	{
+		parser.get_value_bytes(value.data(), size);
+		return;
+	}
+	uint32_t idx = parser.get_first_child_id();
+	data_block block;
+	for (size_t offset = 0; offset < size; offset += BLOCK_SIZE, idx++)
+	{
+		read_tree_block(idx, block, shared);
+		memcpy(&value[offset], block.data(), (std::min)((size_t)BLOCK_SIZE, size - offset));
+	}
 }
 
-void merkle_storage::delete_value(const uint256_t& key, merkle_path& path)
+const uint8_t* merkle_storage::view_value(const uint256_t& key, size_t& size)
 {
-	if (!does_key_exist(key, path))
-		throw std::runtime_error("Deleting nonexisting key");
-	uint32_t value_block_idx = get_value_block_id(key, path);
-	file_.free_block(value_block_idx);
-	uint32_t idx = get_value_parent_block_idx(key, path);
+	data_block leaf;
+	storage_block_parser parser(leaf);
+	uint32_t leaf_idx = find_leaf(key, local_path_stub_, leaf);
+	if (leaf_idx == 0)
+		throw std::runtime_error("Reading nonexisting key");
+	uint32_t value_size = parser.get_value_size();
+	if (value_size == 0)
+		return nullptr;
+	size = value_size & ~BYTES_VALUE_FLAG;
+	uint32_t blocks = value_extent_blocks(leaf);
+	if (blocks != 0)
+		return file_.view_extent(parser.get_first_child_id(), blocks);
+	// the value field follows the block header
+	const uint8_t* block = file_.view_block(leaf_idx);
+	return block ? block + BLOCK_HEADER_SIZE : nullptr;
+}
+
+void merkle_storage::read_values(const std::vector<uint256_t>& keys,
+	std::vector<uint256_t>& values, std::vector<bool>& found)
+{
+	values.assign(keys.size(), uint256_0);
+	found.assign(keys.size(), false);
+	// lookups go in key order, so the ones passing the same node are adjacent
+	std::vector<size_t> order(keys.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(),
+		[&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+	// key index and the block the lookup reads next
+	std::vector<std::pair<size_t, uint32_t>> lookups, next;
+	for (size_t i : order)
+		lookups.push_back(std::make_pair(i, MERKLE_ROOT_BLOCK));
 	data_block data;
 	storage_block_parser parser(data);
-	file_.read_block(idx, data);
-	file_.free_block(idx);
-	uint32_t parent_idx = parser.get_parent_id();
-	while (parent_idx != 0)
+	while (!lookups.empty())
 	{
-		file_.read_block(parent_idx, data);
-		if (parser.get_first_child_id() == idx)
+		uint32_t last_idx = 0;
+		for (auto& lookup : lookups)
 		{
-			if (parser.get_second_child_id() != 0)
-			{
-				parser.set_first_child_id(0);
-				file_.write_block(parent_idx, data);
-				break;
-			}
+			if (lookup.second != last_idx)
+				file_.prefetch_block(lookup.second);
+			last_idx = lookup.second;
 		}
-		else
+		last_idx = 0;
+		next.clear();
+		for (auto& lookup : lookups)
 		{
-			if (parser.get_first_child_id() != 0)
+			if (lookup.second != last_idx)
+				file_.read_block(lookup.second, data);
+			last_idx = lookup.second;
+			const uint256_t& key = keys[lookup.first];
+			unsigned depth = parser.get_prefix_length();
+			uint256_t prefix;
+			parser.get_prefix(prefix);
+			if (common_prefix_length(key, prefix) < depth)
+				continue;
+			if (depth == KEY_LENGTH)
 			{
-				parser.set_second_child_id(0);
-				file_.write_block(parent_idx, data);
-				break;
+				get_leaf_value(data, values[lookup.first]);
+				found[lookup.first] = true;
+				continue;
 			}
+			uint32_t child_idx = key_bit(key, depth) ?
+				parser.get_second_child_id() : parser.get_first_child_id();
+			if (child_idx != 0)
+				next.push_back(std::make_pair(lookup.first, child_idx));
 		}
-		if (parent_idx == MERKLE_ROOT_BLOCK)
+		lookups.swap(next);
+	}
+}
+
+void merkle_storage::write_value(const uint256_t& key, const uint256_t& value)
+{
+	write_value(key, value, local_path_stub_);
+}
+
+void merkle_storage::write_value(const uint256_t& key, const uint256_t& value,
+	merkle_path& path)
+{
+	wait_hashing();
+	data_block data;
+	storage_block_parser parser(data);
+	try
+	{
+		uint32_t leaf_idx = find_leaf(key, path, data);
+		if (leaf_idx == 0)
+			leaf_idx = create_key(key, path, data);
+		free_value_extent(data);
+		uint256_t value_hash = hash(value);
+		parser.set_value_size(0);
+		parser.set_value(value);
+		parser.set_first_child_hash(value_hash);
+		write_node(leaf_idx, data);
+		key_changed(key, path, value_hash, KEY_LENGTH);
+		commit_operation();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::write_value(const uint256_t& key, const uint8_t* data, size_t size)
+{
+	wait_hashing();
+	if (size > MAX_VALUE_SIZE)
+		throw std::runtime_error("Value is too long");
+	data_block leaf;
+	storage_block_parser parser(leaf);
+	try
+	{
+		uint32_t leaf_idx = find_leaf(key, local_path_stub_, leaf);
+		if (leaf_idx == 0)
+			leaf_idx = create_key(key, local_path_stub_, leaf);
+		free_value_extent(leaf);
+		parser.set_value_size(BYTES_VALUE_FLAG | (uint32_t)size);
+		if (size <= BLOCK_VALUE_SIZE)
 		{
-			parser.set_first_child_id(0);
-			parser.set_second_child_id(0);
-			file_.write_block(parent_idx, data);
+			parser.set_value_bytes(data, size);
 		}
 		else
 		{
-			file_.free_block(parent_idx);
+			parser.set_value(uint256_0);
+			uint32_t blocks = value_extent_blocks(leaf);
+			uint32_t idx = allocate_node_extent(blocks);
+			parser.set_first_child_id(idx);
+			data_block block;
+			for (size_t offset = 0; offset < size; offset += BLOCK_SIZE, idx++)
+			{
+				block.fill(0);
+				memcpy(block.data(), data + offset, (std::min)((size_t)BLOCK_SIZE, size - offset));
+				file_.write_block(idx, block);
+			}
 		}
-		idx = parent_idx;
-		parent_idx = parser.get_parent_id();
+		uint256_t value_hash = hash(data, size);
+		parser.set_first_child_hash(value_hash);
+		write_node(leaf_idx, leaf);
+		key_changed(key, local_path_stub_, value_hash, KEY_LENGTH);
+		commit_operation();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::delete_value(const uint256_t& key)
+{
+	delete_value(key, local_path_stub_);
+}
+
+void merkle_storage::delete_value(const uint256_t& key, merkle_path& path)
+{
+	wait_hashing();
+	data_block leaf;
+	uint32_t leaf_idx = find_leaf(key, path, leaf);
+	if (leaf_idx == 0)
+		throw std::runtime_error("Deleting nonexisting key");
+	try
+	{
+		delete_key(key, leaf_idx, leaf, path);
+		commit_operation();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::write_batch(const std::vector<std::pair<uint256_t, uint256_t>>& items)
+{
+	if (items.empty())
+		return;
+	std::vector<key_value> sorted(items);
+	std::stable_sort(sorted.begin(), sorted.end(),
+		[](const key_value& a, const key_value& b) { return a.first < b.first; });
+	size_t count = 0;
+	for (size_t i = 0; i < sorted.size(); i++)
+	{
+		if (count > 0 && sorted[count - 1].first == sorted[i].first)
+			sorted[count - 1].second = sorted[i].second;
+		else
+			sorted[count++] = sorted[i];
+	}
+	sorted.resize(count);
+	batch_blocks blocks;
+	// overflow extents of the replaced values
+	std::vector<uint32_t> freed;
+	try
+	{
+		// batches take the stored hashes of the untouched subtrees
+		rehash_keys();
+		uint256_t root;
+		batch_insert(blocks, freed, MERKLE_ROOT_BLOCK, 0, 0,
+			sorted.data(), sorted.data() + sorted.size(), root);
+		apply_batch(blocks, freed);
+		// the version made by the commit records the new root
+		root_hash_ = root;
+		commit_operation();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::delete_batch(const std::vector<uint256_t>& keys)
+{
+	if (keys.empty())
+		return;
+	std::vector<uint256_t> sorted(keys);
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+	batch_blocks blocks;
+	std::vector<uint32_t> freed;
+	try
+	{
+		// batches take the stored hashes of the untouched subtrees
+		rehash_keys();
+		uint256_t root;
+		batch_delete(blocks, freed, MERKLE_ROOT_BLOCK, 0, 0,
+			sorted.data(), sorted.data() + sorted.size(), root);
+		apply_batch(blocks, freed);
+		// the version made by the commit records the new root
+		root_hash_ = root;
+		commit_operation();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
 	}
 }
 
-void merkle_storage::init_new_db(const std::string & file_name)
+void merkle_storage::init_new_db(const std::string & file_name, storage_backend_type type)
 {
-	file_.create(file_name);
+	file_.create(file_name, type, true);
 	uint32_t root_idx = file_.next_available_block_idx();
 	data_block root;
 	storage_block_parser parser(root);
-	parser.clear();
-	parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+	parser.fill_as_empty_root();
 	file_.write_block(root_idx, root);
+	file_.commit();
+	file_.sync();
+	root_hash_ = default_hash(0);
 }
 
 bool merkle_storage::does_key_exist(const bi::uint256_t & key)
@@ -132,93 +456,1473 @@ bool merkle_storage::does_key_exist(const bi::uint256_t & key)
 
 bool merkle_storage::does_key_exist(const uint256_t& key, merkle_path& path)
 {
-	uint32_t idx = MERKLE_ROOT_BLOCK;
 	data_block data;
+	return find_leaf(key, path, data) != 0;
+}
+
+bool merkle_storage::prove(const uint256_t& key, uint256_t& value, merkle_proof& proof)
+{
+	data_block leaf;
+	value = uint256_0;
+	settle_hashes();
+	if (!prove_key(MERKLE_ROOT_BLOCK, key, proof, leaf, false))
+		return false;
+	get_leaf_value(leaf, value);
+	return true;
+}
+
+bool merkle_storage::prove(const uint256_t& key, merkle_proof& proof)
+{
+	data_block leaf;
+	settle_hashes();
+	return prove_key(MERKLE_ROOT_BLOCK, key, proof, leaf, false);
+}
+
+bool merkle_storage::prove_key(uint32_t root_idx, const uint256_t& key, merkle_proof& proof,
+	data_block& data, bool shared)
+{
+	clear_proof(proof);
 	storage_block_parser parser(data);
-	for (unsigned i = 0; i < KEY_LENGTH; i++)
+	read_tree_block(root_idx, data, shared);
+	while (true)
 	{
-		file_.read_block(idx, data);
-		path[i].first.block_ = parser.get_first_child_id();
-		path[i].second.block_ = parser.get_second_child_id();
-		if ((key >> i) % 2 == 0)
-			idx = path[i].first.block_;
+		unsigned depth = parser.get_prefix_length();
+		if (depth == KEY_LENGTH)
+			return true;
+		uint256_t first, second;
+		parser.get_first_child_hash(first);
+		parser.get_second_child_hash(second);
+		uint32_t idx;
+		if (key_bit(key, depth))
+		{
+			add_proof_sibling(proof, depth, first);
+			idx = parser.get_second_child_id();
+		}
 		else
-			idx = path[i].second.block_;
+		{
+			add_proof_sibling(proof, depth, second);
+			idx = parser.get_first_child_id();
+		}
 		if (idx == 0)
 			return false;
+		read_tree_block(idx, data, shared);
+		uint256_t prefix;
+		parser.get_prefix(prefix);
+		unsigned child_depth = parser.get_prefix_length();
+		unsigned split_depth = common_prefix_length(key, prefix);
+		if (split_depth < child_depth)
+		{
+			// key leaves the compressed edge, the subtree below is the
+			// only non-empty sibling left on the key path
+			add_proof_sibling(proof, split_depth,
+				lift_hash(prefix, get_node_hash(data), child_depth, split_depth + 1));
+			return false;
+		}
 	}
-	return true;
 }
 
-void merkle_storage::create_key(const uint256_t& key, merkle_path& path)
+bool merkle_storage::find_version_leaf(uint32_t root_idx, const uint256_t& key,
+	data_block& leaf)
 {
-	uint32_t idx = MERKLE_ROOT_BLOCK;
-	data_block data;
-	storage_block_parser parser(data);
-	for (unsigned i = 0; i < KEY_LENGTH; i++)
+	storage_block_parser parser(leaf);
+	file_.read_block_shared(root_idx, leaf);
+	while (true)
 	{
+		unsigned depth = parser.get_prefix_length();
+		if (depth == KEY_LENGTH)
+			return true;
+		uint32_t idx = key_bit(key, depth) ?
+			parser.get_second_child_id() : parser.get_first_child_id();
+		if (idx == 0)
+			return false;
+		file_.read_block_shared(idx, leaf);
+		uint256_t prefix;
+		parser.get_prefix(prefix);
+		if (common_prefix_length(key, prefix) < parser.get_prefix_length())
+			return false;
+	}
+}
+
+void merkle_storage::read_tree_block(uint32_t idx, data_block& data, bool shared)
+{
+	if (shared)
+		file_.read_block_shared(idx, data);
+	else
 		file_.read_block(idx, data);
-		path[i].first.block_ = parser.get_first_child_id();
-		path[i].second.block_ = parser.get_second_child_id();
-		uint32_t new_idx;
-		if ((key >> i) % 2 == 0)
-			new_idx = path[i].first.block_;
-		else
-			new_idx = path[i].second.block_;
-		if (new_idx == 0)
+}
+
+void merkle_storage::prove_many(const std::vector<uint256_t>& keys,
+	std::vector<uint256_t>& values, std::vector<bool>& found, merkle_multiproof& proof)
+{
+	settle_hashes();
+	proof.siblings_map_.clear();
+	proof.siblings_.clear();
+	std::vector<uint256_t> sorted(keys);
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+	std::vector<uint256_t> sorted_values(sorted.size(), uint256_0);
+	std::vector<bool> sorted_found(sorted.size(), false);
+	if (!sorted.empty())
+	{
+		data_block root;
+		file_.read_block(MERKLE_ROOT_BLOCK, root);
+		multiproof_node(proof, root, 0, sorted.data(), sorted.data(),
+			sorted.data() + sorted.size(), sorted_values, sorted_found);
+	}
+	values.resize(keys.size());
+	found.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		size_t pos = std::lower_bound(sorted.begin(), sorted.end(), keys[i]) - sorted.begin();
+		values[i] = sorted_values[pos];
+		found[i] = sorted_found[pos];
+	}
+}
+
+merkle_transaction merkle_storage::begin()
+{
+	if (in_transaction_)
+		throw std::runtime_error("Transaction is already open");
+	// a rollback drops only the operations of the transaction
+	settle_hashes();
+	in_transaction_ = true;
+	return merkle_transaction(*this, ++transaction_id_);
+}
+
+void merkle_storage::sync()
+{
+	settle_hashes();
+	file_.sync();
+}
+
+void merkle_storage::set_group_commit_size(unsigned size)
+{
+	file_.set_group_commit_size(size);
+}
+
+void merkle_storage::set_retained_versions(unsigned n)
+{
+	wait_hashing();
+	try
+	{
+		data_block root;
+		storage_block_parser parser(root);
+		file_.read_block(MERKLE_ROOT_BLOCK, root);
+		parser.set_32value(1, n);
+		file_.write_block(MERKLE_ROOT_BLOCK, root);
+		retained_versions_ = n;
+		commit_operation();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+unsigned merkle_storage::get_retained_versions() const
+{
+	return retained_versions_;
+}
+
+merkle_snapshot merkle_storage::open_snapshot()
+{
+	std::lock_guard<std::mutex> lock(versions_mutex_);
+	if (versions_.empty())
+		throw std::runtime_error("No versions are retained");
+	const retained_version& version = versions_.back();
+	pins_[version.number_]++;
+	return merkle_snapshot(*this, version.number_, version.root_, version.root_hash_);
+}
+
+merkle_snapshot merkle_storage::open_snapshot(uint64_t version)
+{
+	std::lock_guard<std::mutex> lock(versions_mutex_);
+	// numbers grow from the oldest version to the newest one
+	auto it = std::lower_bound(versions_.begin(), versions_.end(), version,
+		[](const retained_version& v, uint64_t number) { return v.number_ < number; });
+	if (it == versions_.end() || it->number_ != version)
+		throw std::runtime_error("Version is not retained");
+	pins_[version]++;
+	return merkle_snapshot(*this, version, it->root_, it->root_hash_);
+}
+
+uint64_t merkle_storage::current_version() const
+{
+	return last_version_;
+}
+
+std::vector<uint64_t> merkle_storage::list_versions()
+{
+	std::lock_guard<std::mutex> lock(versions_mutex_);
+	std::vector<uint64_t> res;
+	for (auto& version : versions_)
+		res.push_back(version.number_);
+	return res;
+}
+
+void merkle_storage::read_value(const uint256_t& key, uint256_t& value, uint64_t at_version)
+{
+	open_snapshot(at_version).read_value(key, value);
+}
+
+void merkle_storage::read_value(const uint256_t& key, std::vector<uint8_t>& value,
+	uint64_t at_version)
+{
+	open_snapshot(at_version).read_value(key, value);
+}
+
+bool merkle_storage::prove(const uint256_t& key, uint256_t& value, merkle_proof& proof,
+	uint64_t at_version)
+{
+	return open_snapshot(at_version).prove(key, value, proof);
+}
+
+bool merkle_storage::prove(const uint256_t& key, merkle_proof& proof, uint64_t at_version)
+{
+	return open_snapshot(at_version).prove(key, proof);
+}
+
+uint256_t merkle_storage::root_hash(uint64_t at_version)
+{
+	return open_snapshot(at_version).root_hash();
+}
+
+void merkle_storage::release_snapshot(uint64_t number)
+{
+	std::lock_guard<std::mutex> lock(versions_mutex_);
+	auto it = pins_.find(number);
+	if (it != pins_.end() && --it->second == 0)
+		pins_.erase(it);
+}
+
+void merkle_storage::set_cache_size(size_t size)
+{
+	file_.set_cache_size(size);
+}
+
+const uint256_t& merkle_storage::root_hash()
+{
+	settle_hashes();
+	return root_hash_;
+}
+
+void merkle_storage::set_hash_threads(unsigned threads, unsigned split_depth)
+{
+	settle_hashes();
+	hash_threads_ = threads;
+	split_depth_ = split_depth;
+	// the thread settling the hashes is one of the workers
+	hash_pool_.reset(threads > 1 ? new worker_pool(threads - 1) : nullptr);
+}
+
+verify_report merkle_storage::verify_all(unsigned threads, unsigned split_depth)
+{
+	if (in_transaction_)
+		throw std::runtime_error("Verifying inside a transaction");
+	settle_hashes();
+	verify_report report;
+	report.nodes_ = 0;
+	std::vector<verify_task> tasks;
+	size_t next_task = 0;
+	uint256_t stored;
+	verify_node(MERKLE_ROOT_BLOCK, 0, uint256_0, split_depth, stored, nullptr, &tasks, next_task);
+	worker_pool pool(threads > 1 ? threads - 1 : 0);
+	pool.run(tasks.size(), [this, &tasks](size_t i) {
+		verify_task& task = tasks[i];
+		size_t unused = 0;
+		task.report_.nodes_ = 0;
+		task.slot_hash_ = verify_node(task.idx_, task.slot_depth_, task.slot_prefix_, 0,
+			task.stored_hash_, &task.report_, nullptr, unused);
+	});
+	report.root_hash_ = verify_node(MERKLE_ROOT_BLOCK, 0, uint256_0, split_depth, stored,
+		&report, &tasks, next_task);
+	for (auto& task : tasks)
+	{
+		report.nodes_ += task.report_.nodes_;
+		report.mismatches_.insert(report.mismatches_.end(),
+			task.report_.mismatches_.begin(), task.report_.mismatches_.end());
+	}
+	std::sort(report.mismatches_.begin(), report.mismatches_.end(),
+		[](const hash_mismatch& a, const hash_mismatch& b) {
+			return a.block_ != b.block_ ? a.block_ < b.block_ : a.child_ < b.child_;
+		});
+	return report;
+}
+
+const block_cache_stats& merkle_storage::get_cache_stats() const
+{
+	return file_.get_cache_stats();
+}
+
+void merkle_storage::upgrade_format()
+{
+	// format 4 leaves keep the value in a separate block. leaves are moved
+	// in groups and a moved leaf is skipped, so an interrupted upgrade
+	// resumes on the next open
+	std::vector<uint32_t> nodes;
+	// format 5 only adds the version info to the root node, which is
+	// zeroed there already
+	if (file_.get_format_version() == 4)
+		nodes.push_back(MERKLE_ROOT_BLOCK);
+	data_block node, value_block;
+	storage_block_parser parser(node);
+	storage_block_parser value_parser(value_block);
+	unsigned moved = 0;
+	try
+	{
+		while (!nodes.empty())
 		{
-			new_idx = file_.next_available_block_idx();
-			if ((key >> i) % 2 == 0)
-			{
-				parser.set_first_child_id(new_idx);
-				path[i].first.block_ = new_idx;
-			}
-			else
+			uint32_t idx = nodes.back();
+			nodes.pop_back();
+			file_.read_block(idx, node);
+			if (parser.get_prefix_length() != KEY_LENGTH)
 			{
-				parser.set_second_child_id(new_idx);
-				path[i].second.block_ = new_idx;
+				if (parser.get_first_child_id() != 0)
+					nodes.push_back(parser.get_first_child_id());
+				if (parser.get_second_child_id() != 0)
+					nodes.push_back(parser.get_second_child_id());
+				continue;
 			}
-			file_.write_block(idx, data);
-			parser.clear();
-			parser.set_type(MERKLE_NODE_BLOCK_TYPE);
-			parser.set_parent_id(idx);
-			file_.write_block(new_idx, data);
-		}
-		idx = new_idx;
-	}
-	// create value block
-	uint32_t new_idx = file_.next_available_block_idx();
-	file_.read_block(idx, data);
-	parser.set_first_child_id(new_idx);
-	file_.write_block(idx, data);
-	parser.clear();
-	parser.set_type(VALUE_BLOCK_TYPE);
-	parser.set_parent_id(idx);
-	file_.write_block(new_idx, data);
+			uint32_t value_idx = parser.get_first_child_id();
+			if (value_idx == 0)
+				continue;
+			file_.read_block(value_idx, value_block);
+			uint256_t value;
+			value_parser.get_value(value);
+			parser.set_value(value);
+			parser.set_first_child_id(0);
+			file_.write_block(idx, node);
+			file_.free_block(value_idx);
+			if (++moved % UPGRADE_GROUP_SIZE == 0)
+				file_.commit();
+		}
+		file_.set_format_version(STORAGE_FORMAT_VERSION);
+		file_.commit();
+		file_.sync();
+	}
+	catch (...)
+	{
+		file_.rollback();
+		throw;
+	}
 }
 
-void merkle_storage::delete_key(const uint256_t& key, merkle_path& path)
+void merkle_storage::commit_operation()
 {
-	throw std::runtime_error("Not implemented");
+	// logged with the deferred hashes
+	if (hash_threads_ > 0)
+	{
+		deferred_ = true;
+		if (dirty_keys_.size() >= DEFERRED_HASH_KEYS)
+			start_hashing();
+	}
+	else if (!in_transaction_)
+		commit_version(false);
 }
 
-void merkle_storage::update_key_hashes(const uint256_t& key, merkle_path& path)
+void merkle_storage::abort_operation()
 {
-	throw std::runtime_error("Not implemented");
+	// the job reads the copies and blocks being rolled back
+	if (hashing_.valid())
+		hashing_.wait();
+	hashing_ = std::future<void>();
+	in_transaction_ = false;
+	fresh_blocks_.clear();
+	copies_.clear();
+	replaced_.clear();
+	dirty_keys_.clear();
+	hashing_keys_.clear();
+	hashed_blocks_.clear();
+	deferred_ = false;
+	file_.rollback();
+	load_root_hash();
+	load_versions();
 }
 
-uint32_t merkle_storage::get_value_block_id(const bi::uint256_t & key, const merkle_path & path)
+void merkle_storage::commit_transaction()
 {
-	uint32_t parent = get_value_parent_block_idx(key, path);
-	data_block data;
-	storage_block_parser parser(data);
-	file_.read_block(parent, data);
-	return parser.get_first_child_id();
+	in_transaction_ = false;
+	try
+	{
+		rehash_keys();
+		deferred_ = false;
+		commit_version(true);
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::commit_version(bool sync)
+{
+	retained_version version;
+	bool recorded = versioning();
+	if (recorded)
+		record_version(version);
+	file_.commit();
+	if (sync)
+		file_.sync();
+	fresh_blocks_.clear();
+	copies_.clear();
+	replaced_.clear();
+	// snapshots see the version once its blocks are committed
+	if (recorded)
+	{
+		std::lock_guard<std::mutex> lock(versions_mutex_);
+		versions_.push_back(version);
+	}
+}
+
+bool merkle_storage::versioning() const
+{
+	return retained_versions_ > 0 || !versions_.empty();
+}
+
+void merkle_storage::record_version(retained_version& version)
+{
+	data_block root, data;
+	storage_block_parser root_parser(root);
+	storage_block_parser parser(data);
+	file_.read_block(MERKLE_ROOT_BLOCK, root);
+	// the root node is changed in place, the version gets a copy
+	version.number_ = ++last_version_;
+	version.root_ = file_.allocate_block();
+	file_.write_block(version.root_, root);
+	version.journal_ = write_journal(replaced_);
+	version.root_hash_ = root_hash_;
+	version.block_ = file_.allocate_block();
+	parser.clear();
+	parser.set_type(VERSION_BLOCK_TYPE);
+	parser.set_parent_id(versions_.empty() ? 0 : versions_.back().block_);
+	parser.set_first_child_id(version.root_);
+	parser.set_second_child_id(version.journal_);
+	parser.set_64value(0, version.number_);
+	parser.set_first_child_hash(version.root_hash_);
+	file_.write_block(version.block_, data);
+	root_parser.set_32value(0, version.block_);
+	root_parser.set_32value(1, retained_versions_);
+	root_parser.set_64value(2, last_version_);
+	file_.write_block(MERKLE_ROOT_BLOCK, root);
+}
+
+bool merkle_storage::prune(std::chrono::microseconds budget)
+{
+	if (in_transaction_)
+		throw std::runtime_error("Pruning inside a transaction");
+	settle_hashes();
+	auto deadline = std::chrono::steady_clock::now() + budget;
+	do
+	{
+		if (!prune_step())
+			return true;
+	} while (std::chrono::steady_clock::now() < deadline);
+	return retiring_.block_ == 0 && !can_retire();
+}
+
+bool merkle_storage::can_retire()
+{
+	std::lock_guard<std::mutex> lock(versions_mutex_);
+	return versions_.size() > retained_versions_ && !pins_.count(versions_.front().number_);
+}
+
+bool merkle_storage::prune_step()
+{
+	try
+	{
+		data_block root, data;
+		storage_block_parser root_parser(root);
+		storage_block_parser parser(data);
+		if (retiring_.block_ == 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(versions_mutex_);
+				if (versions_.size() <= retained_versions_ ||
+					pins_.count(versions_.front().number_))
+					return false;
+				retiring_ = versions_.front();
+				versions_.pop_front();
+			}
+			// no snapshot can reach the version from now on
+			file_.read_block(MERKLE_ROOT_BLOCK, root);
+			root_parser.set_32value(4, retiring_.block_);
+			if (versions_.empty())
+			{
+				root_parser.set_32value(0, 0);
+			}
+			else
+			{
+				file_.read_block(versions_.front().block_, data);
+				parser.set_parent_id(0);
+				file_.write_block(versions_.front().block_, data);
+			}
+			file_.write_block(MERKLE_ROOT_BLOCK, root);
+		}
+		else if (!versions_.empty() && versions_.front().journal_ != 0)
+		{
+			// the blocks replaced by the next version were used by the
+			// retiring one only, one journal block per operation
+			retained_version& next = versions_.front();
+			file_.read_block(next.journal_, data);
+			if (parser.get_type() != JOURNAL_BLOCK_TYPE)
+				throw std::runtime_error("Invalid journal block");
+			for (uint32_t i = 0; i < parser.get_first_child_id(); i++)
+				file_.free_block(parser.get_journal_entry(i));
+			file_.free_block(next.journal_);
+			next.journal_ = parser.get_parent_id();
+			file_.read_block(next.block_, data);
+			parser.set_second_child_id(next.journal_);
+			file_.write_block(next.block_, data);
+		}
+		else
+		{
+			file_.free_block(retiring_.root_);
+			file_.free_block(retiring_.block_);
+			file_.read_block(MERKLE_ROOT_BLOCK, root);
+			root_parser.set_32value(4, 0);
+			file_.write_block(MERKLE_ROOT_BLOCK, root);
+			retiring_.block_ = 0;
+		}
+		// a lost step is done again, the log sync is left to the writes
+		file_.commit(true);
+		return true;
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+uint32_t merkle_storage::write_journal(const std::vector<uint32_t>& blocks)
+{
+	data_block data;
+	storage_block_parser parser(data);
+	uint32_t head = 0;
+	for (size_t begin = 0; begin < blocks.size(); begin += JOURNAL_BLOCK_ENTRIES)
+	{
+		uint32_t count = (uint32_t)(std::min)(blocks.size() - begin, (size_t)JOURNAL_BLOCK_ENTRIES);
+		parser.clear();
+		parser.set_type(JOURNAL_BLOCK_TYPE);
+		parser.set_parent_id(head);
+		parser.set_first_child_id(count);
+		for (uint32_t i = 0; i < count; i++)
+			parser.set_journal_entry(i, blocks[begin + i]);
+		head = file_.allocate_block();
+		file_.write_block(head, data);
+	}
+	return head;
+}
+
+void merkle_storage::load_versions()
+{
+	data_block data;
+	storage_block_parser parser(data);
+	file_.read_block(MERKLE_ROOT_BLOCK, data);
+	uint32_t idx = parser.get_32value(0);
+	retained_versions_ = parser.get_32value(1);
+	last_version_ = parser.get_64value(2);
+	retiring_.block_ = parser.get_32value(4);
+	if (retiring_.block_ != 0)
+	{
+		// only its root copy and version block are left to free
+		file_.read_block(retiring_.block_, data);
+		retiring_.root_ = parser.get_first_child_id();
+	}
+	std::deque<retained_version> versions;
+	while (idx != 0)
+	{
+		file_.read_block(idx, data);
+		if (parser.get_type() != VERSION_BLOCK_TYPE)
+			throw std::runtime_error("Invalid version block");
+		retained_version version;
+		version.number_ = parser.get_64value(0);
+		version.block_ = idx;
+		version.root_ = parser.get_first_child_id();
+		version.journal_ = parser.get_second_child_id();
+		parser.get_first_child_hash(version.root_hash_);
+		versions.push_front(version);
+		idx = parser.get_parent_id();
+	}
+	std::lock_guard<std::mutex> lock(versions_mutex_);
+	versions_.swap(versions);
+}
+
+void merkle_storage::load_root_hash()
+{
+	data_block root;
+	storage_block_parser parser(root);
+	file_.read_block(MERKLE_ROOT_BLOCK, root);
+	uint256_t first, second;
+	parser.get_first_child_hash(first);
+	parser.get_second_child_hash(second);
+	root_hash_ = hash(first, second);
+}
+
+uint32_t merkle_storage::find_leaf(const uint256_t& key, merkle_path& path, data_block& leaf)
+{
+	clear_path(path);
+	storage_block_parser parser(leaf);
+	uint32_t idx = MERKLE_ROOT_BLOCK;
+	file_.read_block(idx, leaf);
+	while (true)
+	{
+		unsigned depth = parser.get_prefix_length();
+		if (depth == KEY_LENGTH)
+			return idx;
+		fill_path_level(path[depth], leaf);
+		if (key_bit(key, depth))
+			idx = path[depth].second.block_;
+		else
+			idx = path[depth].first.block_;
+		if (idx == 0)
+			return 0;
+		file_.read_block(idx, leaf);
+		uint256_t prefix;
+		parser.get_prefix(prefix);
+		if (common_prefix_length(key, prefix) < parser.get_prefix_length())
+			return 0;
+	}
+}
+
+uint32_t merkle_storage::create_key(const uint256_t& key, merkle_path& path, data_block& leaf)
+{
+	uint32_t idx = MERKLE_ROOT_BLOCK;
+	data_block data;
+	storage_block_parser parser(data);
+	data_block child;
+	storage_block_parser child_parser(child);
+	read_node(idx, data);
+	while (true)
+	{
+		unsigned depth = parser.get_prefix_length();
+		unsigned bit = key_bit(key, depth);
+		uint32_t child_idx = bit ? parser.get_second_child_id() : parser.get_first_child_id();
+		uint32_t leaf_idx;
+		uint32_t new_idx;
+		if (child_idx == 0)
+		{
+			leaf_idx = create_leaf(key, idx, leaf);
+			new_idx = leaf_idx;
+		}
+		else
+		{
+			read_node(child_idx, child);
+			uint256_t prefix;
+			child_parser.get_prefix(prefix);
+			unsigned child_depth = child_parser.get_prefix_length();
+			unsigned split_depth = common_prefix_length(key, prefix);
+			if (split_depth >= child_depth)
+			{
+				if (child_depth == KEY_LENGTH)
+					throw std::runtime_error("Creating existing key");
+				fill_path_level(path[depth], data);
+				idx = child_idx;
+				data = child;
+				continue;
+			}
+			// key leaves the compressed edge here, split it with a new node
+			new_idx = allocate_node();
+			data_block node;
+			storage_block_parser node_parser(node);
+			node_parser.clear();
+			node_parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+			node_parser.set_parent_id(idx);
+			node_parser.set_prefix_length(split_depth);
+			node_parser.set_prefix(key_prefix(key, split_depth));
+			write_node(new_idx, node);
+			leaf_idx = create_leaf(key, new_idx, leaf);
+			// existing subtree is now seen from the new node level
+			uint256_t child_hash = lift_hash(prefix, get_node_hash(child),
+				child_depth, split_depth + 1);
+			if (key_bit(key, split_depth))
+			{
+				node_parser.set_first_child_id(child_idx);
+				node_parser.set_first_child_hash(child_hash);
+				node_parser.set_second_child_id(leaf_idx);
+				node_parser.set_second_child_hash(default_hash(split_depth + 1));
+			}
+			else
+			{
+				node_parser.set_first_child_id(leaf_idx);
+				node_parser.set_first_child_hash(default_hash(split_depth + 1));
+				node_parser.set_second_child_id(child_idx);
+				node_parser.set_second_child_hash(child_hash);
+			}
+			write_node(new_idx, node);
+			// a frozen node keeps the parent of its version
+			if (!is_frozen(child_idx))
+			{
+				child_parser.set_parent_id(new_idx);
+				write_node(child_idx, child);
+			}
+			fill_path_level(path[split_depth], node);
+		}
+		if (bit)
+			parser.set_second_child_id(new_idx);
+		else
+			parser.set_first_child_id(new_idx);
+		write_node(idx, data);
+		fill_path_level(path[depth], data);
+		return leaf_idx;
+	}
+}
+
+uint32_t merkle_storage::create_leaf(const uint256_t& key, uint32_t parent_idx, data_block& leaf)
+{
+	storage_block_parser parser(leaf);
+	uint32_t leaf_idx = allocate_node();
+	parser.clear();
+	parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+	parser.set_parent_id(parent_idx);
+	parser.set_prefix_length(KEY_LENGTH);
+	parser.set_prefix(key);
+	parser.set_first_child_hash(hash(uint256_0));
+	write_node(leaf_idx, leaf);
+	return leaf_idx;
+}
+
+void merkle_storage::delete_key(const uint256_t& key, uint32_t leaf_idx,
+	data_block& leaf, merkle_path& path)
+{
+	free_value_extent(leaf);
+	free_node(leaf_idx);
+	// parent ids of frozen nodes are those of their version, the
+	// ancestors are taken from the path
+	std::vector<std::pair<unsigned, uint32_t>> nodes;
+	key_path_nodes(key, path, KEY_LENGTH, nodes);
+	uint32_t parent_idx = nodes.back().second;
+	data_block data;
+	storage_block_parser parser(data);
+	read_node(parent_idx, data);
+	unsigned parent_depth = parser.get_prefix_length();
+	uint32_t sibling_idx;
+	uint256_t sibling_hash;
+	if (key_bit(key, parent_depth))
+	{
+		sibling_idx = parser.get_first_child_id();
+		parser.get_first_child_hash(sibling_hash);
+		parser.set_second_child_id(0);
+		parser.set_second_child_hash(default_hash(parent_depth + 1));
+	}
+	else
+	{
+		sibling_idx = parser.get_second_child_id();
+		parser.get_second_child_hash(sibling_hash);
+		parser.set_first_child_id(0);
+		parser.set_first_child_hash(default_hash(parent_depth + 1));
+	}
+	if (parent_idx == MERKLE_ROOT_BLOCK)
+	{
+		write_node(parent_idx, data);
+		fill_path_level(path[parent_depth], data);
+		key_changed(key, path, default_hash(KEY_LENGTH), KEY_LENGTH);
+		return;
+	}
+	// parent is left with a single child, hang the child on the grandparent
+	uint256_t parent_hash = key_bit(key, parent_depth) ?
+		hash(sibling_hash, default_hash(parent_depth + 1)) :
+		hash(default_hash(parent_depth + 1), sibling_hash);
+	free_node(parent_idx);
+	unsigned grand_depth = nodes[nodes.size() - 2].first;
+	uint32_t grand_idx = nodes[nodes.size() - 2].second;
+	read_node(grand_idx, data);
+	if (key_bit(key, grand_depth))
+		parser.set_second_child_id(sibling_idx);
+	else
+		parser.set_first_child_id(sibling_idx);
+	write_node(grand_idx, data);
+	fill_path_level(path[grand_depth], data);
+	path[parent_depth] = std::make_pair(record(), record());
+	if (!is_frozen(sibling_idx))
+	{
+		read_node(sibling_idx, data);
+		parser.set_parent_id(grand_idx);
+		write_node(sibling_idx, data);
+	}
+	key_changed(key, path, parent_hash, parent_depth);
+}
+
+void merkle_storage::key_path_nodes(const uint256_t& key, merkle_path& path,
+	unsigned depth, std::vector<std::pair<unsigned, uint32_t>>& nodes)
+{
+	uint32_t idx = MERKLE_ROOT_BLOCK;
+	for (unsigned level = 0; level < depth && idx != 0; level++)
+	{
+		if (level != 0 && path[level].first.block_ == 0 && path[level].second.block_ == 0)
+			continue;
+		nodes.push_back(std::make_pair(level, idx));
+		idx = key_bit(key, level) ? path[level].second.block_ : path[level].first.block_;
+	}
+}
+
+void merkle_storage::update_key_hashes(const uint256_t& key, merkle_path& path,
+	uint256_t value, unsigned depth)
+{
+	std::vector<std::pair<unsigned, uint32_t>> nodes;
+	key_path_nodes(key, path, depth, nodes);
+	data_block data;
+	storage_block_parser parser(data);
+	for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+	{
+		unsigned level = it->first;
+		value = lift_hash(key, value, depth, level + 1);
+		read_node(it->second, data);
+		if (key_bit(key, level))
+		{
+			parser.set_second_child_hash(value);
+			path[level].second.value_ = value;
+		}
+		else
+		{
+			parser.set_first_child_hash(value);
+			path[level].first.value_ = value;
+		}
+		write_node(it->second, data);
+		value = hash(path[level].first.value_, path[level].second.value_);
+		depth = level;
+	}
+	root_hash_ = value;
+}
+
+void merkle_storage::key_changed(const uint256_t& key, merkle_path& path,
+	const uint256_t& value, unsigned depth)
+{
+	if (hash_threads_ == 0)
+	{
+		update_key_hashes(key, path, value, depth);
+		return;
+	}
+	dirty_keys_.push_back(key);
+	// readers walk from the root, the nodes above a new copy have to
+	// point to it before the hashes do
+	if (copies_.empty())
+		return;
+	std::vector<std::pair<unsigned, uint32_t>> nodes;
+	key_path_nodes(key, path, depth, nodes);
+	data_block data;
+	for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+	{
+		read_node(it->second, data);
+		write_node(it->second, data);
+	}
+}
+
+void merkle_storage::settle_hashes()
+{
+	if (!deferred_ && dirty_keys_.empty())
+		return;
+	try
+	{
+		rehash_keys();
+		if (!in_transaction_)
+		{
+			deferred_ = false;
+			commit_version(false);
+		}
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::start_hashing()
+{
+	hashing_keys_.swap(dirty_keys_);
+	hashing_ = std::async(std::launch::async, [this] { hash_keys(); });
+}
+
+void merkle_storage::wait_hashing()
+{
+	if (!hashing_.valid())
+		return;
+	try
+	{
+		hashing_.get();
+		apply_hashes();
+	}
+	catch (...)
+	{
+		abort_operation();
+		throw;
+	}
+}
+
+void merkle_storage::rehash_keys()
+{
+	wait_hashing();
+	if (dirty_keys_.empty())
+		return;
+	// needed now, no use handing them to another thread
+	hashing_keys_.swap(dirty_keys_);
+	hash_keys();
+	apply_hashes();
+}
+
+void merkle_storage::hash_keys()
+{
+	std::vector<uint256_t>& keys = hashing_keys_;
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	const uint256_t* begin = keys.data();
+	const uint256_t* end = keys.data() + keys.size();
+	batch_blocks& blocks = hashed_blocks_;
+	size_t next_task = 0;
+	if (!hash_pool_)
+	{
+		hashed_root_ = rehash_node(MERKLE_ROOT_BLOCK, 0, begin, end, &blocks, nullptr, next_task);
+	}
+	else
+	{
+		// the subtrees share no nodes, workers only read the file and hash
+		std::vector<hash_task> tasks;
+		rehash_node(MERKLE_ROOT_BLOCK, 0, begin, end, nullptr, &tasks, next_task);
+		hash_pool_->run(tasks.size(), [this, &tasks](size_t i) {
+			hash_task& task = tasks[i];
+			size_t unused = 0;
+			task.slot_hash_ = rehash_node(task.idx_, task.slot_depth_, task.begin_, task.end_,
+				&task.blocks_, nullptr, unused);
+		});
+		hashed_root_ = rehash_node(MERKLE_ROOT_BLOCK, 0, begin, end, &blocks, &tasks, next_task);
+		for (auto& task : tasks)
+			blocks.insert(task.blocks_.begin(), task.blocks_.end());
+	}
+	keys.clear();
+}
+
+void merkle_storage::apply_hashes()
+{
+	batch_blocks blocks;
+	blocks.swap(hashed_blocks_);
+	apply_batch(blocks, std::vector<uint32_t>());
+	root_hash_ = hashed_root_;
+}
+
+uint256_t merkle_storage::rehash_node(uint32_t idx, unsigned slot_depth,
+	const uint256_t* begin, const uint256_t* end, batch_blocks* blocks,
+	std::vector<hash_task>* tasks, size_t& next_task)
+{
+	data_block node;
+	storage_block_parser parser(node);
+	read_node_shared(idx, node);
+	unsigned depth = parser.get_prefix_length();
+	uint256_t prefix;
+	parser.get_prefix(prefix);
+	// keys off the node prefix were deleted, their paths end above it
+	begin = std::partition_point(begin, end,
+		[&](const uint256_t& key) { return key_prefix(key, depth) < prefix; });
+	end = std::partition_point(begin, end,
+		[&](const uint256_t& key) { return key_prefix(key, depth) == prefix; });
+	// a leaf got its value hash when written
+	if (depth == KEY_LENGTH || begin == end)
+		return lift_hash(prefix, get_node_hash(node), depth, slot_depth);
+	const uint256_t* bounds[3] = { begin, split_by_bit(begin, end, depth), end };
+	uint32_t child_ids[2] = { parser.get_first_child_id(), parser.get_second_child_id() };
+	uint256_t hashes[2];
+	parser.get_first_child_hash(hashes[0]);
+	parser.get_second_child_hash(hashes[1]);
+	for (int side = 0; side < 2; side++)
+	{
+		if (bounds[side] == bounds[side + 1])
+			continue;
+		if (child_ids[side] == 0)
+			hashes[side] = default_hash(depth + 1);
+		else if (!tasks || depth + 1 < split_depth_)
+			hashes[side] = rehash_node(child_ids[side], depth + 1, bounds[side],
+				bounds[side + 1], blocks, tasks, next_task);
+		else if (!blocks)
+			tasks->push_back({ child_ids[side], depth + 1, bounds[side], bounds[side + 1],
+				uint256_0, batch_blocks() });
+		else
+			hashes[side] = (*tasks)[next_task++].slot_hash_;
+	}
+	parser.set_first_child_hash(hashes[0]);
+	parser.set_second_child_hash(hashes[1]);
+	if (blocks)
+		(*blocks)[idx] = node;
+	return lift_hash(prefix, hash(hashes[0], hashes[1]), depth, slot_depth);
+}
+
+uint256_t merkle_storage::verify_node(uint32_t idx, unsigned slot_depth,
+	const uint256_t& slot_prefix, unsigned split_depth, uint256_t& stored_hash,
+	verify_report* report, std::vector<verify_task>* tasks, size_t& next_task)
+{
+	data_block node;
+	storage_block_parser parser(node);
+	stored_hash = uint256_0;
+	// a dangling child doesn't fit the slot either
+	if (!file_.is_block_used(idx))
+		return uint256_0;
+	// shared reads leave the cache to the working set
+	file_.read_block_shared(idx, node);
+	unsigned depth = parser.get_prefix_length();
+	uint256_t prefix;
+	parser.get_prefix(prefix);
+	if (depth < slot_depth || depth > KEY_LENGTH || key_prefix(prefix, slot_depth) != slot_prefix)
+		return uint256_0;
+	if (report)
+		report->nodes_++;
+	uint256_t hashes[2];
+	parser.get_first_child_hash(hashes[0]);
+	parser.get_second_child_hash(hashes[1]);
+	if (depth == KEY_LENGTH)
+	{
+		uint256_t computed;
+		if (parser.get_value_size() == 0)
+		{
+			uint256_t value;
+			parser.get_value(value);
+			computed = hash(value);
+		}
+		else
+		{
+			std::vector<uint8_t> value;
+			read_leaf_value(node, value, true);
+			computed = hash(value.data(), value.size());
+		}
+		if (report && computed != hashes[0])
+			report->mismatches_.push_back({ idx, 0, hashes[0], computed });
+		return lift_verified(prefix, hashes[0], computed, depth, slot_depth, stored_hash);
+	}
+	uint32_t child_ids[2] = { parser.get_first_child_id(), parser.get_second_child_id() };
+	uint256_t computed[2];
+	for (unsigned side = 0; side < 2; side++)
+	{
+		uint256_t child_prefix = side ? prefix | (uint256_1 << (KEY_LENGTH - 1 - depth)) : prefix;
+		uint256_t expected;
+		if (child_ids[side] == 0)
+		{
+			computed[side] = default_hash(depth + 1);
+			expected = computed[side];
+		}
+		else if (!tasks || depth + 1 < split_depth)
+		{
+			computed[side] = verify_node(child_ids[side], depth + 1, child_prefix, split_depth,
+				expected, report, tasks, next_task);
+		}
+		else if (!report)
+		{
+			tasks->push_back({ child_ids[side], depth + 1, child_prefix, uint256_0, uint256_0,
+				verify_report() });
+			continue;
+		}
+		else
+		{
+			verify_task& task = (*tasks)[next_task++];
+			computed[side] = task.slot_hash_;
+			expected = task.stored_hash_;
+		}
+		if (report && expected != hashes[side])
+			report->mismatches_.push_back({ idx, side, hashes[side], expected });
+	}
+	return lift_verified(prefix, hash(hashes[0], hashes[1]), hash(computed[0], computed[1]),
+		depth, slot_depth, stored_hash);
+}
+
+uint32_t merkle_storage::batch_insert(batch_blocks& blocks, std::vector<uint32_t>& freed,
+	uint32_t idx, uint32_t parent_idx, unsigned slot_depth,
+	const key_value* begin, const key_value* end, uint256_t& slot_hash)
+{
+	data_block node;
+	storage_block_parser parser(node);
+	read_batch_block(blocks, idx, node);
+	unsigned depth = parser.get_prefix_length();
+	uint256_t prefix;
+	parser.get_prefix(prefix);
+	if (begin == end)
+	{
+		// untouched subtree moved under a new node
+		if (!is_frozen(idx))
+		{
+			parser.set_parent_id(parent_idx);
+			blocks[idx] = node;
+		}
+		slot_hash = lift_hash(prefix, get_node_hash(node), depth, slot_depth);
+		return idx;
+	}
+	unsigned split_depth = (std::min)(common_prefix_length(begin->first, prefix),
+		common_prefix_length((end - 1)->first, prefix));
+	if (split_depth < depth)
+	{
+		// some keys leave the compressed edge, split it with a new node
+		uint32_t new_idx = allocate_node();
+		const key_value* middle = split_by_bit(begin, end, split_depth);
+		uint256_t first_hash, second_hash;
+		uint32_t first_idx, second_idx;
+		if (key_bit(prefix, split_depth))
+		{
+			first_idx = batch_build(blocks, new_idx, split_depth + 1, begin, middle, first_hash);
+			second_idx = batch_insert(blocks, freed, idx, new_idx, split_depth + 1,
+				middle, end, second_hash);
+		}
+		else
+		{
+			first_idx = batch_insert(blocks, freed, idx, new_idx, split_depth + 1,
+				begin, middle, first_hash);
+			second_idx = batch_build(blocks, new_idx, split_depth + 1, middle, end, second_hash);
+		}
+		parser.clear();
+		parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+		parser.set_parent_id(parent_idx);
+		parser.set_prefix_length(split_depth);
+		parser.set_prefix(key_prefix(prefix, split_depth));
+		parser.set_first_child_id(first_idx);
+		parser.set_first_child_hash(first_hash);
+		parser.set_second_child_id(second_idx);
+		parser.set_second_child_hash(second_hash);
+		blocks[new_idx] = node;
+		slot_hash = lift_hash(prefix, hash(first_hash, second_hash), split_depth, slot_depth);
+		return new_idx;
+	}
+	parser.set_parent_id(parent_idx);
+	if (depth == KEY_LENGTH)
+	{
+		// keys are unique, the range is the leaf key only
+		uint32_t extent = parser.get_first_child_id();
+		for (uint32_t i = 0; i < value_extent_blocks(node); i++)
+			freed.push_back(extent + i);
+		parser.set_first_child_id(0);
+		parser.set_value_size(0);
+		parser.set_value(begin->second);
+		uint256_t value_hash = hash(begin->second);
+		parser.set_first_child_hash(value_hash);
+		blocks[idx] = node;
+		slot_hash = lift_hash(prefix, value_hash, KEY_LENGTH, slot_depth);
+		return idx;
+	}
+	const key_value* middle = split_by_bit(begin, end, depth);
+	uint32_t first_idx = parser.get_first_child_id();
+	uint32_t second_idx = parser.get_second_child_id();
+	uint256_t first_hash, second_hash;
+	parser.get_first_child_hash(first_hash);
+	parser.get_second_child_hash(second_hash);
+	if (begin != middle)
+		first_idx = first_idx ?
+			batch_insert(blocks, freed, first_idx, idx, depth + 1, begin, middle, first_hash) :
+			batch_build(blocks, idx, depth + 1, begin, middle, first_hash);
+	if (middle != end)
+		second_idx = second_idx ?
+			batch_insert(blocks, freed, second_idx, idx, depth + 1, middle, end, second_hash) :
+			batch_build(blocks, idx, depth + 1, middle, end, second_hash);
+	parser.set_first_child_id(first_idx);
+	parser.set_first_child_hash(first_hash);
+	parser.set_second_child_id(second_idx);
+	parser.set_second_child_hash(second_hash);
+	blocks[idx] = node;
+	slot_hash = lift_hash(prefix, hash(first_hash, second_hash), depth, slot_depth);
+	return idx;
+}
+
+uint32_t merkle_storage::batch_build(batch_blocks& blocks, uint32_t parent_idx,
+	unsigned slot_depth, const key_value* begin, const key_value* end, uint256_t& slot_hash)
+{
+	data_block node;
+	storage_block_parser parser(node);
+	uint32_t idx = allocate_node();
+	parser.clear();
+	parser.set_type(MERKLE_NODE_BLOCK_TYPE);
+	parser.set_parent_id(parent_idx);
+	if (end - begin == 1)
+	{
+		uint256_t value_hash = hash(begin->second);
+		parser.set_prefix_length(KEY_LENGTH);
+		parser.set_prefix(begin->first);
+		parser.set_value(begin->second);
+		parser.set_first_child_hash(value_hash);
+		blocks[idx] = node;
+		slot_hash = lift_hash(begin->first, value_hash, KEY_LENGTH, slot_depth);
+		return idx;
+	}
+	unsigned depth = common_prefix_length(begin->first, (end - 1)->first);
+	const key_value* middle = split_by_bit(begin, end, depth);
+	uint256_t first_hash, second_hash;
+	parser.set_prefix_length(depth);
+	parser.set_prefix(key_prefix(begin->first, depth));
+	parser.set_first_child_id(batch_build(blocks, idx, depth + 1, begin, middle, first_hash));
+	parser.set_first_child_hash(first_hash);
+	parser.set_second_child_id(batch_build(blocks, idx, depth + 1, middle, end, second_hash));
+	parser.set_second_child_hash(second_hash);
+	blocks[idx] = node;
+	slot_hash = lift_hash(begin->first, hash(first_hash, second_hash), depth, slot_depth);
+	return idx;
+}
+
+uint32_t merkle_storage::batch_delete(batch_blocks& blocks, std::vector<uint32_t>& freed,
+	uint32_t idx, uint32_t parent_idx, unsigned slot_depth,
+	const uint256_t* begin, const uint256_t* end, uint256_t& slot_hash)
+{
+	data_block node;
+	storage_block_parser parser(node);
+	read_batch_block(blocks, idx, node);
+	unsigned depth = parser.get_prefix_length();
+	uint256_t prefix;
+	parser.get_prefix(prefix);
+	if ((std::min)(common_prefix_length(*begin, prefix),
+		common_prefix_length(*(end - 1), prefix)) < depth)
+		throw std::runtime_error("Deleting nonexisting key");
+	if (depth == KEY_LENGTH)
+	{
+		uint32_t extent = parser.get_first_child_id();
+		for (uint32_t i = 0; i < value_extent_blocks(node); i++)
+			freed.push_back(extent + i);
+		freed.push_back(idx);
+		slot_hash = default_hash(slot_depth);
+		return 0;
+	}
+	const uint256_t* middle = split_by_bit(begin, end, depth);
+	uint32_t first_idx = parser.get_first_child_id();
+	uint32_t second_idx = parser.get_second_child_id();
+	uint256_t first_hash, second_hash;
+	parser.get_first_child_hash(first_hash);
+	parser.get_second_child_hash(second_hash);
+	if ((begin != middle && first_idx == 0) || (middle != end && second_idx == 0))
+		throw std::runtime_error("Deleting nonexisting key");
+	if (begin != middle)
+		first_idx = batch_delete(blocks, freed, first_idx, idx, depth + 1,
+			begin, middle, first_hash);
+	if (middle != end)
+		second_idx = batch_delete(blocks, freed, second_idx, idx, depth + 1,
+			middle, end, second_hash);
+	if (idx != MERKLE_ROOT_BLOCK && (first_idx == 0 || second_idx == 0))
+	{
+		// node is left with a single child or none, hang the child on the parent
+		freed.push_back(idx);
+		uint32_t child_idx = first_idx ? first_idx : second_idx;
+		if (child_idx == 0)
+		{
+			slot_hash = default_hash(slot_depth);
+			return 0;
+		}
+		data_block child;
+		storage_block_parser child_parser(child);
+		read_batch_block(blocks, child_idx, child);
+		if (!is_frozen(child_idx))
+		{
+			child_parser.set_parent_id(parent_idx);
+			blocks[child_idx] = child;
+		}
+		uint256_t child_key = first_idx ? prefix : prefix | (uint256_1 << (KEY_LENGTH - 1 - depth));
+		slot_hash = lift_hash(child_key, first_idx ? first_hash : second_hash,
+			depth + 1, slot_depth);
+		return child_idx;
+	}
+	parser.set_first_child_id(first_idx);
+	parser.set_first_child_hash(first_hash);
+	parser.set_second_child_id(second_idx);
+	parser.set_second_child_hash(second_hash);
+	blocks[idx] = node;
+	slot_hash = lift_hash(prefix, hash(first_hash, second_hash), depth, slot_depth);
+	return idx;
+}
+
+void merkle_storage::read_batch_block(batch_blocks& blocks, uint32_t idx, data_block& data)
+{
+	const data_block* block = find_mapped(blocks, idx);
+	if (block)
+		data = *block;
+	else
+		read_node(idx, data);
+}
+
+void merkle_storage::apply_batch(batch_blocks& blocks, const std::vector<uint32_t>& freed)
+{
+	for (uint32_t idx : freed)
+	{
+		blocks.erase(idx);
+		free_node(idx);
+	}
+	// all the copies first, the parents get them as children when written
+	std::for_each(blocks.begin(), blocks.end(),
+		[this](batch_blocks::value_type& block) { node_target(block.first); });
+	std::for_each(blocks.begin(), blocks.end(),
+		[this](batch_blocks::value_type& block) { write_node(block.first, block.second); });
+}
+
+void merkle_storage::multiproof_node(merkle_multiproof& proof, data_block& node,
+	unsigned depth, const uint256_t* keys, const uint256_t* begin, const uint256_t* end,
+	std::vector<uint256_t>& values, std::vector<bool>& found)
+{
+	storage_block_parser parser(node);
+	unsigned node_depth = parser.get_prefix_length();
+	uint256_t prefix;
+	parser.get_prefix(prefix);
+	// levels of the compressed edge leading to the node
+	for (; depth < node_depth; depth++)
+	{
+		const uint256_t* middle = split_by_bit(begin, end, depth);
+		bool edge_bit = key_bit(prefix, depth) != 0;
+		const uint256_t* off_begin = edge_bit ? begin : middle;
+		const uint256_t* off_end = edge_bit ? middle : end;
+		if (off_begin == off_end)
+		{
+			add_multiproof_sibling(proof, depth, default_hash(depth + 1));
+			continue;
+		}
+		if (off_end - off_begin == end - begin)
+		{
+			// all the keys leave the edge, the node subtree is their sibling
+			add_multiproof_sibling(proof, depth,
+				lift_hash(prefix, get_node_hash(node), node_depth, depth + 1));
+			multiproof_empty(proof, depth + 1, begin, end);
+			return;
+		}
+		if (edge_bit)
+		{
+			multiproof_empty(proof, depth + 1, begin, middle);
+			multiproof_node(proof, node, depth + 1, keys, middle, end, values, found);
+		}
+		else
+		{
+			multiproof_node(proof, node, depth + 1, keys, begin, middle, values, found);
+			multiproof_empty(proof, depth + 1, middle, end);
+		}
+		return;
+	}
+	if (node_depth == KEY_LENGTH)
+	{
+		// keys are unique and match the whole leaf prefix
+		get_leaf_value(node, values[begin - keys]);
+		found[begin - keys] = true;
+		return;
+	}
+	const uint256_t* bounds[3] = { begin, split_by_bit(begin, end, node_depth), end };
+	uint32_t child_ids[2] = { parser.get_first_child_id(), parser.get_second_child_id() };
+	uint256_t child_hashes[2];
+	parser.get_first_child_hash(child_hashes[0]);
+	parser.get_second_child_hash(child_hashes[1]);
+	// the sibling goes before the subtree holding the keys
+	for (unsigned side = 0; side < 2; side++)
+		if (bounds[side] == bounds[side + 1])
+			add_multiproof_sibling(proof, node_depth, child_hashes[side]);
+	for (unsigned side = 0; side < 2; side++)
+	{
+		if (bounds[side] == bounds[side + 1])
+			continue;
+		if (child_ids[side] == 0)
+		{
+			multiproof_empty(proof, node_depth + 1, bounds[side], bounds[side + 1]);
+			continue;
+		}
+		data_block child;
+		file_.read_block(child_ids[side], child);
+		multiproof_node(proof, child, node_depth + 1, keys, bounds[side], bounds[side + 1],
+			values, found);
+	}
+}
+
+void merkle_storage::free_value_extent(data_block& leaf)
+{
+	storage_block_parser parser(leaf);
+	uint32_t blocks = value_extent_blocks(leaf);
+	for (uint32_t i = 0; i < blocks; i++)
+		free_node(parser.get_first_child_id() + i);
+	parser.set_first_child_id(0);
+}
+
+bool merkle_storage::is_frozen(uint32_t idx) const
+{
+	return !versions_.empty() && idx != MERKLE_ROOT_BLOCK && fresh_blocks_.count(idx) == 0;
+}
+
+uint32_t merkle_storage::node_target(uint32_t idx)
+{
+	if (!is_frozen(idx))
+		return idx;
+	const uint32_t* existing = find_mapped(copies_, idx);
+	if (existing)
+		return *existing;
+	uint32_t copy = allocate_node();
+	copies_[idx] = copy;
+	replaced_.push_back(idx);
+	return copy;
+}
+
+void merkle_storage::read_node(uint32_t idx, data_block& data)
+{
+	const uint32_t* copy = find_mapped(copies_, idx);
+	file_.read_block(copy ? *copy : idx, data);
+}
+
+void merkle_storage::read_node_shared(uint32_t idx, data_block& data)
+{
+	const uint32_t* copy = find_mapped(copies_, idx);
+	file_.read_block_shared(copy ? *copy : idx, data);
+}
+
+void merkle_storage::write_node(uint32_t idx, data_block& data)
+{
+	storage_block_parser parser(data);
+	if (!copies_.empty() && parser.get_prefix_length() != KEY_LENGTH)
+	{
+		const uint32_t* copy = find_mapped(copies_, parser.get_first_child_id());
+		if (copy)
+			parser.set_first_child_id(*copy);
+		copy = find_mapped(copies_, parser.get_second_child_id());
+		if (copy)
+			parser.set_second_child_id(*copy);
+	}
+	file_.write_block(node_target(idx), data);
+}
+
+void merkle_storage::free_node(uint32_t idx)
+{
+	const uint32_t* copy = find_mapped(copies_, idx);
+	if (copy)
+	{
+		// the frozen node itself is replaced already
+		uint32_t copy_idx = *copy;
+		copies_.erase(idx);
+		file_.free_block(copy_idx);
+		fresh_blocks_.erase(copy_idx);
+	}
+	else if (is_frozen(idx))
+	{
+		replaced_.push_back(idx);
+	}
+	else
+	{
+		file_.free_block(idx);
+		fresh_blocks_.erase(idx);
+	}
+}
+
+uint32_t merkle_storage::allocate_node()
+{
+	uint32_t idx = file_.allocate_block();
+	if (!versions_.empty())
+		fresh_blocks_.insert(idx);
+	return idx;
+}
+
+uint32_t merkle_storage::allocate_node_extent(uint32_t count)
+{
+	uint32_t idx = file_.allocate_extent(count);
+	if (!versions_.empty())
+		for (uint32_t i = 0; i < count; i++)
+			fresh_blocks_.insert(idx + i);
+	return idx;
+}
+
+void merkle_storage::fill_path_level(std::pair<record, record>& level, data_block& node)
+{
+	storage_block_parser parser(node);
+	level.first.block_ = parser.get_first_child_id();
+	parser.get_first_child_hash(level.first.value_);
+	level.second.block_ = parser.get_second_child_id();
+	parser.get_second_child_hash(level.second.value_);
 }
 
-uint32_t merkle_storage::get_value_parent_block_idx(const bi::uint256_t & key, const merkle_path & path)
+uint256_t merkle_storage::get_node_hash(data_block& node)
 {
-	if (key >> (KEY_LENGTH - 1))
-		return path[KEY_LENGTH - 1].second.block_;
-	return path[KEY_LENGTH - 1].first.block_;
+	storage_block_parser parser(node);
+	uint256_t first, second;
+	parser.get_first_child_hash(first);
+	if (parser.get_prefix_length() == KEY_LENGTH)
+		return first;
+	parser.get_second_child_hash(second);
+	return hash(first, second);
 }
@@ -2,8 +2,21 @@
 #include <memory>
 #include <string>
 #include <array>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
 #include "common.h"
 #include "storage_file.h"
+#include "merkle_proof.h"
+#include "bulk_loader.h"
+#include "merkle_transaction.h"
+#include "merkle_snapshot.h"
+#include "worker_pool.h"
 
 struct record
 {
@@ -11,38 +24,365 @@ struct record
 	bi::uint256_t value_;
 };
 
+// stored hash of a node that differs from the one computed from the
+// blocks below it. child_ is 0 or 1 for the first or second child hash,
+// the value hash of a leaf is its first one
+struct hash_mismatch
+{
+	uint32_t block_;
+	unsigned child_;
+	bi::uint256_t stored_;
+	bi::uint256_t computed_;
+};
+
+struct verify_report
+{
+	// root hash recomputed from the leaf values
+	bi::uint256_t root_hash_;
+	uint64_t nodes_;
+	// by block index
+	std::vector<hash_mismatch> mismatches_;
+};
+
+// children blocks and subtree hashes of the nodes passed on the way to
+// a key, indexed by the bit depth of the node. levels skipped by path
+// compression stay zeroed
 typedef std::array<std::pair<record, record>, KEY_LENGTH> merkle_path;
 
 
 class merkle_storage
 {
+	friend class merkle_cursor;
+	friend class merkle_transaction;
+	friend class merkle_snapshot;
 public:
-	static std::unique_ptr<merkle_storage> create(const std::string& file_name);
-	static std::unique_ptr<merkle_storage> open(const std::string& file_name);
+	static std::unique_ptr<merkle_storage> create(const std::string& file_name,
+		storage_backend_type type = storage_backend_type::stdio);
+	static std::unique_ptr<merkle_storage> open(const std::string& file_name,
+		storage_backend_type type = storage_backend_type::stdio);
+	// new database of the key value pairs in increasing key order,
+	// built by bulk_loader
+	template <typename Iterator>
+	static std::unique_ptr<merkle_storage> bulk_load(const std::string& file_name,
+		Iterator begin, Iterator end,
+		storage_backend_type type = storage_backend_type::stdio);
 
 	void read_value(const bi::uint256_t& key, bi::uint256_t& value);
 	void read_value(const bi::uint256_t& key, bi::uint256_t& value, merkle_path& path);
+	// looks all the keys up together, one trie level per round with the
+	// blocks of the round prefetched before any of them is read.
+	// found[i] tells if keys[i] exists, values[i] is its value then
+	void read_values(const std::vector<bi::uint256_t>& keys,
+		std::vector<bi::uint256_t>& values, std::vector<bool>& found);
 	void write_value(const bi::uint256_t& key, const bi::uint256_t& value);
 	void write_value(const bi::uint256_t& key, const bi::uint256_t& value,
 		merkle_path& path);
+	// byte string values up to MAX_VALUE_SIZE. short ones are kept in the
+	// leaf, longer ones in an overflow extent of consecutive blocks. the
+	// leaf hash is the hash of the bytes, a 256 bit value reads as its
+	// 32 big endian bytes and vice versa. reading other byte strings as
+	// 256 bit values throws
+	void write_value(const bi::uint256_t& key, const uint8_t* data, size_t size);
+	void read_value(const bi::uint256_t& key, std::vector<uint8_t>& value);
+	// value bytes right in the mapped file or nullptr if the backend can't
+	// provide them or the value is a 256 bit number. valid until the next write
+	const uint8_t* view_value(const bi::uint256_t& key, size_t& size);
 	void delete_value(const bi::uint256_t& key);
 	void delete_value(const bi::uint256_t& key, merkle_path& path);
 
+	// applies all the writes as one operation with a single trie walk,
+	// a key given more than once gets its last value
+	void write_batch(const std::vector<std::pair<bi::uint256_t, bi::uint256_t>>& items);
+	// deletes all the keys as one operation, nothing is deleted
+	// if any of the keys doesn't exist
+	void delete_batch(const std::vector<bi::uint256_t>& keys);
+
+	// proof of the key value or of its absence against root_hash(), built
+	// from the blocks read by the lookup. returns if the key exists,
+	// value is zero otherwise
+	bool prove(const bi::uint256_t& key, bi::uint256_t& value, merkle_proof& proof);
+	// the same without reading the value, for byte string values
+	bool prove(const bi::uint256_t& key, merkle_proof& proof);
+	// one proof for all the keys from a single walk over the sorted keys,
+	// values and found are filled as by read_values
+	void prove_many(const std::vector<bi::uint256_t>& keys, std::vector<bi::uint256_t>& values,
+		std::vector<bool>& found, merkle_multiproof& proof);
+
 	bool does_key_exist(const bi::uint256_t& key);
 	bool does_key_exist(const bi::uint256_t& key, merkle_path& path);
+
+	// hash of the sparse merkle tree over all KEY_LENGTH bit keys,
+	// absent keys are empty leaves. waits for the deferred hashing
+	const bi::uint256_t& root_hash();
+
+	// with threads > 0 writes and deletes skip hashing the key path and
+	// only note the key, the paths of a path argument keep the old hashes.
+	// once DEFERRED_HASH_KEYS keys are noted a background job hashes their
+	// paths while the write returns, the next write or delete waits for it.
+	// the rest are hashed the next time the root hash is needed: by
+	// root_hash, sync, a proof, a batch, a transaction or pruning. threads
+	// workers take the subtrees below split_depth, and the operations
+	// since the last logged one are logged together when the root hash is
+	// needed. 0 hashes every write at once, the default. as in a
+	// transaction a failed operation drops the deferred ones with it
+	void set_hash_threads(unsigned threads, unsigned split_depth = DEFAULT_HASH_SPLIT_DEPTH);
+
+	// the operations until the transaction commit are one atomic
+	// operation, including the ones called on the storage itself.
+	// only one transaction can be open
+	merkle_transaction begin();
+
+	// every write or delete is logged as one atomic operation, the log is
+	// synced once per group of operations. sync makes all the previous
+	// operations durable
+	void sync();
+	void set_group_commit_size(unsigned size);
+
+	// with n > 0 every committed operation or transaction becomes a new
+	// version, and the newest n versions stay readable through snapshots.
+	// a node of a committed version is never changed, the write goes to
+	// a copy and the unchanged subtrees are shared. versions older than
+	// the newest n are dropped by prune. 0 stops making versions, the
+	// default
+	void set_retained_versions(unsigned n);
+	unsigned get_retained_versions() const;
+	// snapshot of the newest version, throws if no version is kept.
+	// safe to call from any thread while the writer works
+	merkle_snapshot open_snapshot();
+	// versions are numbered from 1 across reopening, throws if the
+	// version isn't kept anymore
+	merkle_snapshot open_snapshot(uint64_t version);
+	// number of the last committed version, 0 if none was made
+	uint64_t current_version() const;
+	// numbers of the kept versions, oldest first
+	std::vector<uint64_t> list_versions();
+	// retires the versions beyond the retained ones, oldest first, while
+	// the oldest has no open snapshot. every version keeps a journal of
+	// the blocks it replaced, and retiring a version frees the journal of
+	// the next one: the blocks no newer version uses. works in small
+	// logged steps until the budget runs out, at least one step per call.
+	// returns if nothing is left to retire
+	bool prune(std::chrono::microseconds budget);
+
+	// queries against a kept version, through a snapshot held for the call
+	void read_value(const bi::uint256_t& key, bi::uint256_t& value, uint64_t at_version);
+	void read_value(const bi::uint256_t& key, std::vector<uint8_t>& value,
+		uint64_t at_version);
+	bool prove(const bi::uint256_t& key, bi::uint256_t& value, merkle_proof& proof,
+		uint64_t at_version);
+	bool prove(const bi::uint256_t& key, merkle_proof& proof, uint64_t at_version);
+	bi::uint256_t root_hash(uint64_t at_version);
+
+	// checks every stored hash against the blocks below it and computes
+	// the root hash again from the leaf values. threads workers take the
+	// subtrees below split_depth. a child that doesn't belong under its
+	// node, a free or missing block too, is reported with a zero computed
+	// hash and not read further
+	verify_report verify_all(unsigned threads, unsigned split_depth = DEFAULT_HASH_SPLIT_DEPTH);
+
+	void set_cache_size(size_t size);
+	const block_cache_stats& get_cache_stats() const;
+
+	// logs the deferred operations
+	~merkle_storage();
 private:
-	void init_new_db(const std::string& file_name);
-	void create_key(const bi::uint256_t& key, merkle_path& path);
-	void delete_key(const bi::uint256_t& key, merkle_path& path);
-	void update_key_hashes(const bi::uint256_t& key, merkle_path& path);
+	// blocks of a committed version kept for snapshots
+	struct retained_version
+	{
+		uint64_t number_;
+		// the version block, root node copy and journal of the blocks
+		// replaced by the version
+		uint32_t block_;
+		uint32_t root_;
+		uint32_t journal_;
+		bi::uint256_t root_hash_;
+	};
+
+	// ends an operation, it stays pending while a transaction is open
+	void commit_operation();
+	// logs the pending changes as one record, as a new version if
+	// versions are kept
+	void commit_version(bool sync);
+	// writes the version of the pending changes
+	void record_version(retained_version& version);
+	uint32_t write_journal(const std::vector<uint32_t>& blocks);
+	// one logged step of retiring the oldest version, returns false if
+	// there is nothing to do
+	bool prune_step();
+	bool can_retire();
+	void load_versions();
+	void release_snapshot(uint64_t number);
+	bool versioning() const;
+	// drops the pending changes with the whole transaction if one is open
+	void abort_operation();
+	void commit_transaction();
+	// brings a file of an older format to STORAGE_FORMAT_VERSION
+	void upgrade_format();
+	// returns if the key exists, leaf gets the last block read. shared
+	// reads are for a tree of a retained version, the working tree
+	// under root_idx is read by the writer thread only
+	bool prove_key(uint32_t root_idx, const bi::uint256_t& key, merkle_proof& proof,
+		data_block& leaf, bool shared);
+	bool find_version_leaf(uint32_t root_idx, const bi::uint256_t& key, data_block& leaf);
+	void read_tree_block(uint32_t idx, data_block& data, bool shared);
+	void load_root_hash();
+	void init_new_db(const std::string& file_name, storage_backend_type type);
+	// returns leaf block idx or 0 if key doesn't exist, leaf gets leaf block
+	uint32_t find_leaf(const bi::uint256_t& key, merkle_path& path, data_block& leaf);
+	uint32_t create_key(const bi::uint256_t& key, merkle_path& path, data_block& leaf);
+	uint32_t create_leaf(const bi::uint256_t& key, uint32_t parent_idx, data_block& leaf);
+	void delete_key(const bi::uint256_t& key, uint32_t leaf_idx, data_block& leaf,
+		merkle_path& path);
+	// nodes on the key path above depth from the root down, with their levels
+	void key_path_nodes(const bi::uint256_t& key, merkle_path& path, unsigned depth,
+		std::vector<std::pair<unsigned, uint32_t>>& nodes);
+	// sets hash of the key subtree at depth and rehashes nodes above it
+	void update_key_hashes(const bi::uint256_t& key, merkle_path& path,
+		bi::uint256_t value, unsigned depth);
+	// blocks changed by a batch, written to the file once at the end
+	typedef std::unordered_map<uint32_t, data_block> batch_blocks;
+	typedef std::pair<bi::uint256_t, bi::uint256_t> key_value;
+	// merges sorted keys into the subtree of the node idx hanging in the
+	// slot at slot_depth, returns the new subtree root and its slot hash
+	uint32_t batch_insert(batch_blocks& blocks, std::vector<uint32_t>& freed,
+		uint32_t idx, uint32_t parent_idx, unsigned slot_depth,
+		const key_value* begin, const key_value* end, bi::uint256_t& slot_hash);
+	// new subtree of the sorted keys
+	uint32_t batch_build(batch_blocks& blocks, uint32_t parent_idx,
+		unsigned slot_depth, const key_value* begin, const key_value* end,
+		bi::uint256_t& slot_hash);
+	// returns the new subtree root, 0 if the subtree became empty
+	uint32_t batch_delete(batch_blocks& blocks, std::vector<uint32_t>& freed,
+		uint32_t idx, uint32_t parent_idx, unsigned slot_depth,
+		const bi::uint256_t* begin, const bi::uint256_t* end, bi::uint256_t& slot_hash);
+	void read_batch_block(batch_blocks& blocks, uint32_t idx, data_block& data);
+	void apply_batch(batch_blocks& blocks, const std::vector<uint32_t>& freed);
+
+	// subtree below the split depth hashed by a worker
+	struct hash_task
+	{
+		uint32_t idx_;
+		unsigned slot_depth_;
+		const bi::uint256_t* begin_;
+		const bi::uint256_t* end_;
+		bi::uint256_t slot_hash_;
+		batch_blocks blocks_;
+	};
+	// subtree below the split depth checked by a worker
+	struct verify_task
+	{
+		uint32_t idx_;
+		unsigned slot_depth_;
+		bi::uint256_t slot_prefix_;
+		bi::uint256_t slot_hash_;
+		bi::uint256_t stored_hash_;
+		verify_report report_;
+	};
+	// checks the subtree of the node idx hanging in the slot at
+	// slot_depth, whose keys start with slot_prefix. returns its computed
+	// slot hash and stored_hash gets the one from the stored hashes of the
+	// node, both are zero if the node doesn't fit the slot. tasks are
+	// used as by rehash_node, the first pass goes without a report
+	bi::uint256_t verify_node(uint32_t idx, unsigned slot_depth,
+		const bi::uint256_t& slot_prefix, unsigned split_depth,
+		bi::uint256_t& stored_hash, verify_report* report,
+		std::vector<verify_task>* tasks, size_t& next_task);
+	// notes the key for the deferred hashing or hashes its path now
+	void key_changed(const bi::uint256_t& key, merkle_path& path,
+		const bi::uint256_t& value, unsigned depth);
+	// hashes the noted keys and logs the deferred operations
+	void settle_hashes();
+	// hashes the noted keys in the background, the job only reads the
+	// file until its blocks are applied by wait_hashing
+	void start_hashing();
+	void wait_hashing();
+	// applies the running job and hashes the keys noted since then
+	void rehash_keys();
+	// hashes hashing_keys_ into hashed_blocks_ and hashed_root_
+	void hash_keys();
+	void apply_hashes();
+	// rehashes the sorted noted keys under the node idx hanging in the
+	// slot at slot_depth, returns its slot hash. with tasks the subtrees
+	// below split_depth_ are left to them: the first pass without blocks
+	// collects the tasks, the second one takes their results in order
+	bi::uint256_t rehash_node(uint32_t idx, unsigned slot_depth,
+		const bi::uint256_t* begin, const bi::uint256_t* end, batch_blocks* blocks,
+		std::vector<hash_task>* tasks, size_t& next_task);
+
+	// adds siblings of the sorted unique keys under the node, depth is
+	// the first level not covered by the proof yet. results go to values
+	// and found at the key positions from keys
+	void multiproof_node(merkle_multiproof& proof, data_block& node, unsigned depth,
+		const bi::uint256_t* keys, const bi::uint256_t* begin, const bi::uint256_t* end,
+		std::vector<bi::uint256_t>& values, std::vector<bool>& found);
 
-	uint32_t get_value_block_id(const bi::uint256_t& key, const merkle_path& path);
-	uint32_t get_value_parent_block_idx(const bi::uint256_t& key, const merkle_path& path);
+	// node access of the write operations. while versions are kept a node
+	// of a committed version is frozen: its first write goes to a copy,
+	// reads and writes of it go to the copy after that and written nodes
+	// get the copies as children. freeing it is delayed until no kept
+	// version uses it
+	bool is_frozen(uint32_t idx) const;
+	uint32_t node_target(uint32_t idx);
+	void read_node(uint32_t idx, data_block& data);
+	// the same under the shared lock of the file, for the hashing workers
+	void read_node_shared(uint32_t idx, data_block& data);
+	void write_node(uint32_t idx, data_block& data);
+	void free_node(uint32_t idx);
+	uint32_t allocate_node();
+	uint32_t allocate_node_extent(uint32_t count);
 
+	void read_leaf_value(data_block& leaf, bi::uint256_t& value);
+	void read_leaf_value(data_block& leaf, std::vector<uint8_t>& value,
+		bool shared = false);
+	// frees the overflow extent of a byte string leaf value
+	void free_value_extent(data_block& leaf);
+	void fill_path_level(std::pair<record, record>& level, data_block& node);
+	bi::uint256_t get_node_hash(data_block& node);
 
 	merkle_storage();
 
 	merkle_path local_path_stub_;
 	storage_file file_;
+	bi::uint256_t root_hash_;
+	bool in_transaction_;
+	// tells the open transaction from the finished ones
+	uint64_t transaction_id_;
+
+	unsigned retained_versions_;
+	uint64_t last_version_;
+	// oldest first, changed by the writer under versions_mutex_
+	std::deque<retained_version> versions_;
+	// open snapshots per version number
+	std::map<uint64_t, unsigned> pins_;
+	// version being retired, block_ is 0 if none
+	retained_version retiring_;
+	std::mutex versions_mutex_;
+	// blocks allocated since the last version, frozen blocks replaced
+	// by their copies and the ones replaced or freed
+	std::unordered_set<uint32_t> fresh_blocks_;
+	std::unordered_map<uint32_t, uint32_t> copies_;
+	std::vector<uint32_t> replaced_;
+
+	unsigned hash_threads_;
+	unsigned split_depth_;
+	std::unique_ptr<worker_pool> hash_pool_;
+	// keys waiting for the deferred hashing, and if there are operations
+	// waiting to be logged
+	std::vector<bi::uint256_t> dirty_keys_;
+	bool deferred_;
+	// background hashing job, its keys and results
+	std::future<void> hashing_;
+	std::vector<bi::uint256_t> hashing_keys_;
+	batch_blocks hashed_blocks_;
+	bi::uint256_t hashed_root_;
 };
 
+template <typename Iterator>
+std::unique_ptr<merkle_storage> merkle_storage::bulk_load(const std::string& file_name,
+	Iterator begin, Iterator end, storage_backend_type type)
+{
+	bulk_loader loader(file_name, type);
+	for (; begin != end; ++begin)
+		loader.add(begin->first, begin->second);
+	return loader.finish();
+}
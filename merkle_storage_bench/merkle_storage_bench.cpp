@@ -0,0 +1,558 @@
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <atomic>
+
+#include "../hashes.h"
+#include "../merkle_storage.h"
+#include "../proof_verifier.h"
+#include "../merkle_cursor.h"
+#include "../snapshot.h"
+#include "../utils.h"
+
+using namespace std;
+
+typedef chrono::high_resolution_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+	return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void bench_sha256_impls()
+{
+	const unsigned count = 1 << 20;
+	const pair<sha256_impl, const char*> impls[] = {
+		make_pair(sha256_impl::portable, "portable"),
+		make_pair(sha256_impl::sha_ni, "sha-ni"),
+		make_pair(sha256_impl::armv8, "armv8")
+	};
+	sha256_impl current = get_sha256_impl();
+	for (auto& impl : impls)
+	{
+		if (!is_sha256_impl_supported(impl.first))
+			continue;
+		set_sha256_impl(impl.first);
+		bi::uint256_t val1(12345), val2(67890);
+		auto start = bench_clock::now();
+		for (unsigned i = 0; i < count; i++)
+			val1 = ::hash(val1, val2);
+		double t = seconds_since(start);
+		printf("hash pair %-14s %8.1f ns/hash\n", impl.second, t / count * 1e9);
+	}
+	set_sha256_impl(current);
+}
+
+static void bench_hash_pairs()
+{
+	const size_t count = 1 << 16;
+	const unsigned rounds = 8;
+	vector<bi::uint256_t> val1(count), val2(count), res(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		val1[i] = bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i);
+		val2[i] = bi::uint256_t(i, ~i);
+	}
+
+	auto start = bench_clock::now();
+	for (unsigned r = 0; r < rounds; r++)
+		for (size_t i = 0; i < count; i++)
+			res[i] = ::hash(val1[i], val2[i]);
+	double scalar = seconds_since(start);
+	printf("hash pair, one at a time: %8.2f Mhash/s\n", count * rounds / scalar / 1e6);
+
+	const pair<hash_kernel, const char*> kernels[] = {
+		make_pair(hash_kernel::scalar, "scalar"),
+		make_pair(hash_kernel::sse2, "sse2"),
+		make_pair(hash_kernel::avx2, "avx2"),
+		make_pair(hash_kernel::avx512, "avx512")
+	};
+	for (auto& kernel : kernels)
+	{
+		if (!is_hash_kernel_supported(kernel.first))
+		{
+			printf("hash_many %-14s not supported\n", kernel.second);
+			continue;
+		}
+		start = bench_clock::now();
+		for (unsigned r = 0; r < rounds; r++)
+			hash_many(val1.data(), val2.data(), res.data(), count, kernel.first);
+		double t = seconds_since(start);
+		printf("hash_many %-14s %8.2f Mhash/s, x%.2f\n", kernel.second,
+			count * rounds / t / 1e6, scalar / t);
+	}
+}
+
+static void bench_durable_writes()
+{
+	const char* name = "bench.db";
+	const unsigned group_sizes[] = { 1, 64, 1024 };
+	for (unsigned group_size : group_sizes)
+	{
+		if (is_file_exists(name))
+			delete_file(name);
+		const unsigned count = group_size == 1 ? 500 : 20000;
+		{
+			auto ms = merkle_storage::create(name);
+			ms->set_group_commit_size(group_size);
+			auto start = bench_clock::now();
+			for (unsigned i = 0; i < count; i++)
+				ms->write_value(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), i);
+			ms->sync();
+			double t = seconds_since(start);
+			printf("durable writes, group commit %-5u %8.0f ops/s\n", group_size, count / t);
+		}
+		delete_file(name);
+	}
+}
+
+static void bench_batch_writes()
+{
+	const char* name = "bench.db";
+	const unsigned count = 10000;
+	vector<pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < count; i++)
+		items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+	for (int batched = 0; batched < 2; batched++)
+	{
+		if (is_file_exists(name))
+			delete_file(name);
+		{
+			auto ms = merkle_storage::create(name);
+			ms->write_batch(items);
+			for (auto& item : items)
+				item.second += 1;
+			auto start = bench_clock::now();
+			if (batched)
+				ms->write_batch(items);
+			else
+				for (auto& item : items)
+					ms->write_value(item.first, item.second);
+			ms->sync();
+			double t = seconds_since(start);
+			printf("update %u keys, %-10s %8.0f ops/s\n", count,
+				batched ? "batch" : "one by one", count / t);
+		}
+		delete_file(name);
+	}
+}
+
+static void bench_multi_get()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		vector<bi::uint256_t> keys, values;
+		vector<bool> found;
+		for (unsigned i = 0; i < count; i++)
+		{
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+			keys.push_back(items.back().first);
+		}
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		ms->sync();
+		// small cache, most of the blocks come from the file
+		ms->set_cache_size(64 * 1024);
+		auto start = bench_clock::now();
+		bi::uint256_t value;
+		for (auto& key : keys)
+			ms->read_value(key, value);
+		double t = seconds_since(start);
+		printf("read %u keys, one by one %8.0f ops/s\n", count, count / t);
+		start = bench_clock::now();
+		ms->read_values(keys, values, found);
+		t = seconds_since(start);
+		printf("read %u keys, read_values %8.0f ops/s\n", count, count / t);
+	}
+	delete_file(name);
+}
+
+static void bench_proof_verifier()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	const unsigned proofs_count = 10000;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		vector<bi::uint256_t> keys, values;
+		vector<bool> found, valid;
+		vector<merkle_proof> proofs(proofs_count);
+		for (unsigned i = 0; i < proofs_count; i++)
+		{
+			bi::uint256_t value;
+			keys.push_back(items[i * (count / proofs_count)].first);
+			found.push_back(ms->prove(keys.back(), value, proofs[i]));
+			values.push_back(value);
+		}
+		auto start = bench_clock::now();
+		for (unsigned i = 0; i < proofs_count; i++)
+			verify_inclusion(ms->root_hash(), keys[i], values[i], proofs[i]);
+		double t = seconds_since(start);
+		printf("verify proofs, one by one %8.0f proofs/s\n", proofs_count / t);
+		proof_verifier verifier;
+		start = bench_clock::now();
+		verifier.verify(ms->root_hash(), keys, values, found, proofs, valid);
+		t = seconds_since(start);
+		printf("verify proofs, batched    %8.0f proofs/s\n", proofs_count / t);
+	}
+	delete_file(name);
+}
+
+static void bench_cursor_scan()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		ms->sync();
+		ms->set_cache_size(64 * 1024);
+		for (int prefetch = 0; prefetch < 2; prefetch++)
+		{
+			merkle_cursor cursor(*ms);
+			cursor.set_prefetch(prefetch != 0);
+			auto start = bench_clock::now();
+			unsigned keys = 0;
+			bi::uint256_t value;
+			for (bool ok = cursor.seek_first(); ok; ok = cursor.next(), keys++)
+				cursor.value(value);
+			double t = seconds_since(start);
+			printf("scan %u keys, %-11s %8.0f keys/s\n", keys,
+				prefetch ? "prefetch" : "no prefetch", keys / t);
+		}
+	}
+	delete_file(name);
+}
+
+static void bench_bulk_load()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	vector<pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < count; i++)
+		items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+	sort(items.begin(), items.end());
+	for (int bulk = 0; bulk < 2; bulk++)
+	{
+		if (is_file_exists(name))
+			delete_file(name);
+		{
+			auto start = bench_clock::now();
+			if (bulk)
+			{
+				merkle_storage::bulk_load(name, items.begin(), items.end());
+			}
+			else
+			{
+				auto ms = merkle_storage::create(name);
+				ms->write_batch(items);
+				ms->sync();
+			}
+			double t = seconds_since(start);
+			printf("build %u keys, %-10s %8.0f keys/s\n", count,
+				bulk ? "bulk load" : "batch", count / t);
+		}
+		delete_file(name);
+	}
+}
+
+static void bench_snapshot()
+{
+	const char* name = "bench.db";
+	const char* import_name = "bench_import.db";
+	const unsigned count = 100000;
+	for (auto file : { name, import_name })
+		if (is_file_exists(file))
+			delete_file(file);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		stringstream stream;
+		auto start = bench_clock::now();
+		export_snapshot(*ms, stream);
+		double t = seconds_since(start);
+		printf("export %u keys %8.0f keys/s, %zu bytes\n", count, count / t, stream.str().size());
+		start = bench_clock::now();
+		import_snapshot(import_name, stream);
+		t = seconds_since(start);
+		printf("import %u keys %8.0f keys/s\n", count, count / t);
+	}
+	delete_file(name);
+	delete_file(import_name);
+}
+
+static void bench_transaction()
+{
+	const char* name = "bench.db";
+	const unsigned count = 10000;
+	vector<pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < count; i++)
+		items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+	for (int transaction = 0; transaction < 2; transaction++)
+	{
+		if (is_file_exists(name))
+			delete_file(name);
+		{
+			auto ms = merkle_storage::create(name);
+			ms->write_batch(items);
+			ms->sync();
+			auto start = bench_clock::now();
+			if (transaction)
+			{
+				auto tx = ms->begin();
+				for (auto& item : items)
+					tx.write_value(item.first, item.second + 1);
+				tx.commit();
+			}
+			else
+			{
+				for (auto& item : items)
+					ms->write_value(item.first, item.second + 1);
+				ms->sync();
+			}
+			double t = seconds_since(start);
+			printf("update %u keys, %-11s %8.0f ops/s\n", count,
+				transaction ? "transaction" : "one by one", count / t);
+		}
+		delete_file(name);
+	}
+}
+
+static void bench_snapshot_reads()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name, storage_backend_type::mmap);
+		ms->write_batch(items);
+		ms->set_retained_versions(2);
+		unsigned most = (std::max)(thread::hardware_concurrency(), 2u) - 1;
+		for (unsigned threads = 1; threads <= most; threads = (std::min)(threads * 2, most + 1))
+		{
+			// readers take a snapshot of the newest version per 1000 reads,
+			// the writer keeps committing meanwhile
+			atomic<bool> done(false);
+			atomic<uint64_t> reads(0);
+			vector<thread> readers;
+			auto start = bench_clock::now();
+			for (unsigned t = 0; t < threads; t++)
+				readers.emplace_back([&, t]()
+				{
+					bi::uint256_t value;
+					for (unsigned i = t; !done; )
+					{
+						auto snapshot = ms->open_snapshot();
+						for (unsigned end = i + 1000; i < end; i++)
+							snapshot.read_value(items[i % count].first, value);
+						reads += 1000;
+					}
+				});
+			unsigned writes = 0;
+			while (seconds_since(start) < 1)
+			{
+				auto& item = items[(writes++ * 7919) % count];
+				ms->write_value(item.first, item.second + writes);
+				ms->prune(chrono::microseconds(100));
+			}
+			done = true;
+			for (auto& reader : readers)
+				reader.join();
+			double t = seconds_since(start);
+			printf("snapshot reads, %2u threads %9.0f reads/s, %6.0f writes/s\n", threads,
+				reads / t, writes / t);
+		}
+	}
+	delete_file(name);
+}
+
+static long file_size(const char* name)
+{
+	FILE* f = fopen(name, "rb");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+static void bench_versions()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	const unsigned versions = 200;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		ms->sync();
+		long base_size = file_size(name);
+		ms->set_retained_versions(versions);
+		// versions of 100 changed keys each
+		auto start = bench_clock::now();
+		for (unsigned v = 0; v < versions; v++)
+		{
+			vector<pair<bi::uint256_t, bi::uint256_t>> batch;
+			for (unsigned i = 0; i < 100; i++)
+				batch.push_back(make_pair(items[(v * 100 + i) * 7919 % count].first, bi::uint256_t(v)));
+			ms->write_batch(batch);
+		}
+		ms->sync();
+		double t = seconds_since(start);
+		ms.reset();
+		long size = file_size(name);
+		printf("%u versions of 100 keys %6.0f versions/s, file %.2fx of one version\n",
+			versions, versions / t, (double)size / base_size);
+		ms = merkle_storage::open(name);
+		uint64_t oldest = ms->list_versions().front();
+		start = bench_clock::now();
+		bi::uint256_t value;
+		for (unsigned i = 0; i < 10000; i++)
+			ms->read_value(items[i * 7919 % count].first, value, oldest + i % versions);
+		t = seconds_since(start);
+		printf("historical reads            %8.0f reads/s\n", 10000 / t);
+	}
+	delete_file(name);
+}
+
+static void bench_prune()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		ms->set_retained_versions(5);
+		// every version replaces about 10k blocks
+		const unsigned batches = 50;
+		double longest = 0;
+		auto start = bench_clock::now();
+		for (unsigned b = 0; b < batches; b++)
+		{
+			vector<pair<bi::uint256_t, bi::uint256_t>> batch;
+			for (unsigned i = 0; i < 1000; i++)
+				batch.push_back(make_pair(items[(b * 1000 + i) * 7919 % count].first, bi::uint256_t(b)));
+			ms->write_batch(batch);
+			auto prune_start = bench_clock::now();
+			ms->prune(chrono::microseconds(500));
+			longest = (std::max)(longest, seconds_since(prune_start));
+		}
+		double t = seconds_since(start);
+		start = bench_clock::now();
+		while (!ms->prune(chrono::milliseconds(10)))
+			;
+		printf("%u batches of 1000 keys, prune 500us %5.0f batches/s, longest prune %.2f ms, rest %.0f ms\n",
+			batches, batches / t, longest * 1000, seconds_since(start) * 1000);
+	}
+	delete_file(name);
+}
+
+static void bench_deferred_hashing()
+{
+	const char* name = "bench.db";
+	const unsigned count = 100000;
+	vector<pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < count; i++)
+		items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+	unsigned most = (std::max)(1u, thread::hardware_concurrency());
+	for (unsigned threads = 0; threads <= most; threads = threads ? threads * 2 : 1)
+	{
+		if (is_file_exists(name))
+			delete_file(name);
+		auto ms = merkle_storage::create(name);
+		ms->write_batch(items);
+		ms->set_hash_threads(threads);
+		// the root hash is asked for once per 1000 single writes
+		const unsigned writes = 20000;
+		auto start = bench_clock::now();
+		for (unsigned i = 0; i < writes; i++)
+		{
+			ms->write_value(items[i * 7919 % count].first, bi::uint256_t(i));
+			if (i % 1000 == 999)
+				ms->root_hash();
+		}
+		double t = seconds_since(start);
+		printf("hash threads %2u: %u writes, root every 1000 %8.0f writes/s\n",
+			threads, writes, writes / t);
+	}
+	delete_file(name);
+}
+
+static void bench_verify_all()
+{
+	const char* name = "bench.db";
+	const unsigned count = 200000;
+	if (is_file_exists(name))
+		delete_file(name);
+	{
+		vector<pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), bi::uint256_t(i)));
+		auto ms = merkle_storage::create(name, storage_backend_type::mmap);
+		ms->write_batch(items);
+		unsigned most = (std::max)(1u, thread::hardware_concurrency());
+		for (unsigned threads = 1; threads <= most; threads *= 2)
+		{
+			auto start = bench_clock::now();
+			verify_report report = ms->verify_all(threads);
+			double t = seconds_since(start);
+			printf("verify all, %2u threads: %llu nodes %8.0f nodes/s, %zu mismatches\n",
+				threads, (unsigned long long)report.nodes_, report.nodes_ / t,
+				report.mismatches_.size());
+		}
+	}
+	delete_file(name);
+}
+
+int main()
+{
+	bench_sha256_impls();
+	bench_hash_pairs();
+	bench_durable_writes();
+	bench_batch_writes();
+	bench_multi_get();
+	bench_proof_verifier();
+	bench_cursor_scan();
+	bench_bulk_load();
+	bench_snapshot();
+	bench_transaction();
+	bench_snapshot_reads();
+	bench_versions();
+	bench_prune();
+	bench_deferred_hashing();
+	bench_verify_all();
+	return 0;
+}
@@ -5,20 +5,62 @@
 #include "../merkle_storage.h"
 #include "../storage_file.h"
 #include "../utils.h"
+#include "../mmap_backend.h"
+#include "../hashes.h"
+#include "../merkle_proof.h"
+#include "../proof_verifier.h"
+#include "../merkle_cursor.h"
+#include "../bulk_loader.h"
+#include "../snapshot.h"
+#include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
 
 using namespace std;
 
+static bi::uint256_t reference_root_hash(
+	std::map<bi::uint256_t, bi::uint256_t>::const_iterator begin,
+	std::map<bi::uint256_t, bi::uint256_t>::const_iterator end,
+	unsigned depth)
+{
+	if (begin == end)
+		return default_hash(depth);
+	if (depth == KEY_LENGTH)
+		return ::hash(begin->second);
+	auto middle = begin;
+	while (middle != end && !((middle->first >> (KEY_LENGTH - 1 - depth)) & 1))
+		++middle;
+	return ::hash(reference_root_hash(begin, middle, depth + 1),
+		reference_root_hash(middle, end, depth + 1));
+}
+
+static void copy_file(const std::string& from, const std::string& to)
+{
+	std::ifstream in(from, std::ios::binary);
+	std::ofstream out(to, std::ios::binary);
+	out << in.rdbuf();
+}
+
 struct NoTestDBFixture
 {
 	NoTestDBFixture()
 	{
-		if (is_file_exists("test.db"))
-			delete_file("test.db");
+		remove_files();
 	}
 	~NoTestDBFixture()
 	{
-		if (is_file_exists("test.db"))
-			delete_file("test.db");
+		remove_files();
+	}
+	static void remove_files()
+	{
+		const char* names[] = { "test.db", "test.db.wal", "crash.db", "crash.db.wal",
+			"bulk.db", "bulk.db.wal" };
+		for (auto name : names)
+			if (is_file_exists(name))
+				delete_file(name);
 	}
 };
 
@@ -41,6 +83,13 @@ BOOST_AUTO_TEST_CASE(storage_block_parser_test)
 	bi::uint256_t val2(0);
 	parser.get_value(val2);
 	BOOST_REQUIRE_EQUAL(val1, val2);
+	parser.set_prefix_length(KEY_LENGTH);
+	parser.set_prefix(val1 - 5);
+	BOOST_REQUIRE_EQUAL(parser.get_prefix_length(), KEY_LENGTH);
+	parser.get_prefix(val2);
+	BOOST_REQUIRE_EQUAL(val1 - 5, val2);
+	parser.get_value(val2);
+	BOOST_REQUIRE_EQUAL(val1, val2);
 }
 
 BOOST_FIXTURE_TEST_CASE(storage_file_create_open, NoTestDBFixture)
@@ -119,6 +168,91 @@ BOOST_FIXTURE_TEST_CASE(storage_file_free_blocks, NoTestDBFixture)
 	}
 }
 
+BOOST_FIXTURE_TEST_CASE(storage_file_free_map, NoTestDBFixture)
+{
+	const unsigned count = FREE_MAP_PAGE_BLOCKS * 3;
+	std::vector<uint32_t> idxs;
+	{
+		storage_file storage;
+		storage.create("test.db");
+		data_block b;
+		b.fill(7);
+		for (unsigned i = 0; i < count; i++)
+		{
+			uint32_t idx = storage.next_available_block_idx();
+			BOOST_REQUIRE(idx % FREE_MAP_PAGE_BLOCKS != 0);
+			storage.write_block(idx, b);
+			idxs.push_back(idx);
+		}
+		BOOST_REQUIRE_THROW(storage.free_block(FREE_MAP_PAGE_BLOCKS), std::exception);
+		BOOST_REQUIRE_THROW(storage.write_block(FREE_MAP_PAGE_BLOCKS * 2, b), std::exception);
+		for (unsigned i = 0; i < count; i += 3)
+			storage.free_block(idxs[i]);
+	}
+	storage_file storage;
+	storage.open("test.db");
+	data_block b;
+	b.fill(8);
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (i % 3 == 0)
+		{
+			BOOST_REQUIRE_THROW(storage.read_block(idxs[i], b), std::exception);
+			// freed blocks are reused lowest first
+			BOOST_REQUIRE_EQUAL(storage.next_available_block_idx(), idxs[i]);
+			storage.write_block(idxs[i], b);
+		}
+		else
+		{
+			storage.read_block(idxs[i], b);
+			BOOST_REQUIRE_EQUAL(b[0], 7);
+		}
+	}
+	BOOST_REQUIRE_EQUAL(storage.next_available_block_idx(), idxs.back() + 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(storage_file_cache, NoTestDBFixture)
+{
+	std::vector<uint32_t> idxs;
+	{
+		storage_file storage;
+		storage.create("test.db");
+		storage.set_cache_size(16 * sizeof(data_block));
+		data_block b;
+		for (unsigned i = 0; i < 100; i++)
+		{
+			b.fill((uint8_t)i);
+			uint32_t idx = storage.next_available_block_idx();
+			storage.write_block(idx, b);
+			idxs.push_back(idx);
+		}
+		for (unsigned i = 0; i < 100; i++)
+		{
+			storage.read_block(idxs[i], b);
+			BOOST_REQUIRE_EQUAL(b[0], (uint8_t)i);
+			BOOST_REQUIRE_EQUAL(b[BLOCK_SIZE - 1], (uint8_t)i);
+		}
+		storage.read_block(idxs[99], b);
+		BOOST_REQUIRE(storage.get_cache_stats().hits_ > 0);
+		BOOST_REQUIRE(storage.get_cache_stats().misses_ > 0);
+		BOOST_REQUIRE(storage.get_cache_stats().evictions_ > 0);
+	}
+	storage_file storage;
+	storage.open("test.db");
+	data_block b;
+	for (unsigned i = 0; i < 100; i++)
+	{
+		storage.read_block(idxs[i], b);
+		BOOST_REQUIRE_EQUAL(b[0], (uint8_t)i);
+	}
+	// without a cache every write goes straight through and is counted
+	storage.set_cache_size(0);
+	uint64_t write_backs = storage.get_cache_stats().write_backs_;
+	for (unsigned i = 0; i < 3; i++)
+		storage.write_block(idxs[i], b);
+	BOOST_REQUIRE_EQUAL(storage.get_cache_stats().write_backs_, write_backs + 3);
+}
+
 BOOST_FIXTURE_TEST_CASE(merkle_storage_create_open, NoTestDBFixture)
 {
 	{
@@ -170,3 +304,1793 @@ BOOST_FIXTURE_TEST_CASE(merkle_storage_read_write_delete, NoTestDBFixture)
 	BOOST_REQUIRE_NO_THROW(ms->write_value(key1, value1));
 }
 
+
+BOOST_FIXTURE_TEST_CASE(storage_file_mmap_backend, NoTestDBFixture)
+{
+	const unsigned count = MMAP_MIN_MAPPING_SIZE / BLOCK_SIZE + 100;
+	std::vector<uint32_t> idxs;
+	{
+		storage_file storage;
+		storage.create("test.db", storage_backend_type::mmap);
+		data_block b;
+		uint32_t expected = 0;
+		for (unsigned i = 0; i < count; i++)
+		{
+			// free map blocks are skipped
+			expected++;
+			if (expected % FREE_MAP_PAGE_BLOCKS == 0)
+				expected++;
+			uint32_t idx = storage.next_available_block_idx();
+			BOOST_REQUIRE_EQUAL(idx, expected);
+			b.fill((uint8_t)i);
+			storage.write_block(idx, b);
+			idxs.push_back(idx);
+		}
+		const uint8_t* view = storage.view_block(idxs.back());
+		BOOST_REQUIRE(view != nullptr);
+		BOOST_REQUIRE_EQUAL(view[0], (uint8_t)(count - 1));
+		storage.flush();
+	}
+	FILE* f = fopen("test.db", "rb");
+	fseek(f, 0, SEEK_END);
+	BOOST_REQUIRE_EQUAL(ftell(f), (long)(idxs.back() + 1) * BLOCK_SIZE);
+	fclose(f);
+	storage_file storage;
+	storage.open("test.db");
+	BOOST_REQUIRE(storage.view_block(1) == nullptr);
+	data_block b;
+	for (unsigned i = 0; i < count; i++)
+	{
+		storage.read_block(idxs[i], b);
+		BOOST_REQUIRE_EQUAL(b[0], (uint8_t)i);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_mmap_read_write, NoTestDBFixture)
+{
+	bi::uint256_t key1(100500);
+	bi::uint256_t key2(123456);
+	{
+		auto ms = merkle_storage::create("test.db", storage_backend_type::mmap);
+		ms->write_value(key1, 1);
+		ms->write_value(key2, 2);
+		ms->delete_value(key1);
+	}
+	auto ms = merkle_storage::open("test.db", storage_backend_type::mmap);
+	bi::uint256_t value;
+	BOOST_REQUIRE_EQUAL(ms->does_key_exist(key1), false);
+	ms->read_value(key2, value);
+	BOOST_REQUIRE_EQUAL(value, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_many_keys, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	uint64_t seed = 12345;
+	auto next_random = [&seed]() {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		return seed;
+	};
+	{
+		auto ms = merkle_storage::create("test.db");
+		for (unsigned i = 0; i < 500; i++)
+		{
+			bi::uint256_t key(next_random(), next_random());
+			if (i % 5 == 0)
+				key = bi::uint256_t(i);
+			model[key] = i;
+			ms->write_value(key, i);
+		}
+		unsigned n = 0;
+		for (auto it = model.begin(); it != model.end(); n++)
+		{
+			if (n % 3 == 0)
+			{
+				ms->delete_value(it->first);
+				it = model.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+	auto ms = merkle_storage::open("test.db");
+	for (auto& kv : model)
+	{
+		bi::uint256_t value;
+		BOOST_REQUIRE_NO_THROW(ms->read_value(kv.first, value));
+		BOOST_REQUIRE_EQUAL(value, kv.second);
+	}
+	for (unsigned i = 0; i < 500; i += 5)
+	{
+		if (model.find(i) == model.end())
+			BOOST_REQUIRE_EQUAL(ms->does_key_exist(i), false);
+	}
+	BOOST_REQUIRE_EQUAL(ms->does_key_exist(bi::uint256_t(1) << 200), false);
+	// path compression: a key costs a leaf with its value and at most one node
+	FILE* f = fopen("test.db", "rb");
+	fseek(f, 0, SEEK_END);
+	BOOST_REQUIRE(ftell(f) < (long)(500 * 2 + 64) * BLOCK_SIZE);
+	fclose(f);
+}
+
+BOOST_AUTO_TEST_CASE(hashes_test)
+{
+	BOOST_REQUIRE_EQUAL(::hash(bi::uint256_0).str(16),
+		"66687aadf862bd776c8fc18b8e9f8e20089714856ee233b3902a591d0d5f2925");
+	BOOST_REQUIRE_EQUAL(::hash(bi::uint256_0, bi::uint256_0).str(16),
+		"f5a5fd42d16a20302798ef6ed309979b43003d2320d9f0e8ea9831a92759fb4b");
+	BOOST_REQUIRE_EQUAL(default_hash(KEY_LENGTH), bi::uint256_0);
+	BOOST_REQUIRE_EQUAL(default_hash(KEY_LENGTH - 1), ::hash(bi::uint256_0, bi::uint256_0));
+	const uint8_t abc[] = { 'a', 'b', 'c' };
+	BOOST_REQUIRE_EQUAL(::hash(abc, sizeof(abc)).str(16),
+		"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	std::vector<uint8_t> bytes(200);
+	for (size_t i = 0; i < bytes.size(); i++)
+		bytes[i] = (uint8_t)(i * 7);
+	uint256_to_bytes(bi::uint256_t(12345) << 100, bytes.data());
+	BOOST_REQUIRE_EQUAL(::hash(bytes.data(), 32), ::hash(bi::uint256_t(12345) << 100));
+	// the message tail doesn't fit the last block with the length
+	BOOST_REQUIRE_EQUAL(::hash(bytes.data(), 56).str(16),
+		"52c27fe11a1359b52dc4febfac486843023119be6257d402b595967126a7a929");
+	BOOST_REQUIRE_EQUAL(::hash(bytes.data(), bytes.size()).str(16),
+		"e7f10450b7fa75e26c8bfe503d1594d6008c28ec7d268f74ba527b299452d24d");
+	// the generated table matches the hash chain
+	for (unsigned depth = 0; depth < KEY_LENGTH; depth++)
+		BOOST_REQUIRE_EQUAL(default_hash(depth),
+			::hash(default_hash(depth + 1), default_hash(depth + 1)));
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_root_hash, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	bi::uint256_t root;
+	{
+		auto ms = merkle_storage::create("test.db");
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+		for (unsigned i = 0; i < 40; i++)
+		{
+			bi::uint256_t key = (bi::uint256_t(i * 7919) << 200) + i;
+			model[key] = i + 1;
+			ms->write_value(key, i + 1);
+			BOOST_REQUIRE_EQUAL(ms->root_hash(),
+				reference_root_hash(model.begin(), model.end(), 0));
+		}
+		for (unsigned i = 0; i < 40; i += 3)
+		{
+			bi::uint256_t key = (bi::uint256_t(i * 7919) << 200) + i;
+			model.erase(key);
+			ms->delete_value(key);
+			BOOST_REQUIRE_EQUAL(ms->root_hash(),
+				reference_root_hash(model.begin(), model.end(), 0));
+		}
+		root = ms->root_hash();
+	}
+	{
+		auto ms = merkle_storage::open("test.db");
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+		for (auto& kv : model)
+			ms->delete_value(kv.first);
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_wal_recovery, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	bi::uint256_t root;
+	{
+		auto ms = merkle_storage::create("test.db");
+		// evicted blocks reach the data file between log syncs
+		ms->set_cache_size(16 * sizeof(data_block));
+		ms->set_group_commit_size(1000);
+		for (unsigned i = 0; i < 300; i++)
+		{
+			bi::uint256_t key = (bi::uint256_t(i * 104729) << 180) + i;
+			model[key] = i + 1;
+			ms->write_value(key, i + 1);
+		}
+		for (unsigned i = 0; i < 300; i += 4)
+		{
+			bi::uint256_t key = (bi::uint256_t(i * 104729) << 180) + i;
+			model.erase(key);
+			ms->delete_value(key);
+		}
+		ms->sync();
+		root = ms->root_hash();
+		// not synced, lost with the crash
+		for (unsigned i = 0; i < 50; i++)
+			ms->write_value(bi::uint256_t(i) << 100, i);
+		// the files as a crash would leave them
+		copy_file("test.db", "crash.db");
+		copy_file("test.db.wal", "crash.db.wal");
+	}
+	BOOST_REQUIRE(!is_file_exists("test.db.wal"));
+	{
+		// torn record at the log end
+		std::ofstream wal("crash.db.wal", std::ios::binary | std::ios::app);
+		wal << "WAL1" << std::string(200, 'x');
+	}
+	{
+		auto ms = merkle_storage::open("crash.db");
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+		BOOST_REQUIRE_EQUAL(root, reference_root_hash(model.begin(), model.end(), 0));
+		bi::uint256_t value;
+		for (auto& kv : model)
+		{
+			ms->read_value(kv.first, value);
+			BOOST_REQUIRE_EQUAL(value, kv.second);
+		}
+		for (unsigned i = 0; i < 50; i++)
+			BOOST_REQUIRE(!ms->does_key_exist(bi::uint256_t(i) << 100));
+		// the allocator state is recovered too
+		for (auto& kv : model)
+			ms->delete_value(kv.first);
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+	}
+	BOOST_REQUIRE(!is_file_exists("crash.db.wal"));
+	auto ms = merkle_storage::open("crash.db");
+	BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_batch, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	bi::uint256_t root;
+	uint64_t seed = 4242;
+	{
+		auto ms = merkle_storage::create("test.db");
+		for (unsigned i = 0; i < 20; i++)
+		{
+			bi::uint256_t key = (bi::uint256_t(i * 31) << 240) + i;
+			model[key] = i;
+			ms->write_value(key, i);
+		}
+		for (unsigned round = 0; round < 5; round++)
+		{
+			std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+			for (unsigned i = 0; i < 300; i++)
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				// clustered keys share long prefixes, some hit existing keys
+				bi::uint256_t key = (bi::uint256_t(seed >> 60) << 240) + (seed % 40);
+				if (i % 7 == 0)
+					key = bi::uint256_t(seed, ~seed) << (seed % 128);
+				items.push_back(std::make_pair(key, bi::uint256_t(seed)));
+				model[key] = seed;
+			}
+			ms->write_batch(items);
+			BOOST_REQUIRE_EQUAL(ms->root_hash(),
+				reference_root_hash(model.begin(), model.end(), 0));
+			std::vector<bi::uint256_t> keys;
+			unsigned i = 0;
+			for (auto it = model.begin(); it != model.end(); i++)
+			{
+				if (i % 3 == round % 3)
+				{
+					keys.push_back(it->first);
+					it = model.erase(it);
+				}
+				else
+					++it;
+			}
+			keys.push_back(keys.front());
+			ms->delete_batch(keys);
+			BOOST_REQUIRE_EQUAL(ms->root_hash(),
+				reference_root_hash(model.begin(), model.end(), 0));
+		}
+		root = ms->root_hash();
+		// nothing is deleted if any key is missing
+		std::vector<bi::uint256_t> keys;
+		keys.push_back(model.begin()->first);
+		keys.push_back(bi::uint256_t(12345) << 128);
+		BOOST_REQUIRE_THROW(ms->delete_batch(keys), std::exception);
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+		BOOST_REQUIRE(ms->does_key_exist(model.begin()->first));
+	}
+	auto ms = merkle_storage::open("test.db");
+	BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+	bi::uint256_t value;
+	for (auto& kv : model)
+	{
+		ms->read_value(kv.first, value);
+		BOOST_REQUIRE_EQUAL(value, kv.second);
+	}
+	// single deletes rely on parent links set by the batches
+	std::vector<bi::uint256_t> keys;
+	unsigned i = 0;
+	for (auto& kv : model)
+		if (i++ % 2)
+			keys.push_back(kv.first);
+		else
+			ms->delete_value(kv.first);
+	ms->delete_batch(keys);
+	BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+	ms->write_value(1, 2);
+	ms->read_value(1, value);
+	BOOST_REQUIRE_EQUAL(value, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_read_values, NoTestDBFixture)
+{
+	const storage_backend_type types[] = { storage_backend_type::stdio, storage_backend_type::mmap };
+	for (auto type : types)
+	{
+		NoTestDBFixture::remove_files();
+		auto ms = merkle_storage::create("test.db", type);
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < 500; i++)
+			items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i * 7), i + 1));
+		ms->write_batch(items);
+		std::vector<bi::uint256_t> keys, values;
+		std::vector<bool> found;
+		for (unsigned i = 0; i < 1000; i++)
+		{
+			// every other key is missing, either off the path or next to a leaf
+			if (i % 2 == 0)
+				keys.push_back(items[(i * 13) % items.size()].first);
+			else if (i % 4 == 1)
+				keys.push_back(items[i % items.size()].first + 1);
+			else
+				keys.push_back(bi::uint256_t(i) << 200);
+		}
+		keys.push_back(keys.front());
+		ms->read_values(keys, values, found);
+		BOOST_REQUIRE_EQUAL(values.size(), keys.size());
+		BOOST_REQUIRE_EQUAL(found.size(), keys.size());
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			BOOST_REQUIRE_EQUAL(found[i], ms->does_key_exist(keys[i]));
+			if (found[i])
+			{
+				bi::uint256_t value;
+				ms->read_value(keys[i], value);
+				BOOST_REQUIRE_EQUAL(values[i], value);
+			}
+		}
+		BOOST_REQUIRE(found.back());
+		BOOST_REQUIRE(!found[1]);
+		keys.clear();
+		ms->read_values(keys, values, found);
+		BOOST_REQUIRE(values.empty() && found.empty());
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_prove, NoTestDBFixture)
+{
+	auto ms = merkle_storage::create("test.db");
+	bi::uint256_t value;
+	merkle_proof proof;
+	BOOST_REQUIRE(!ms->prove(5, value, proof));
+	BOOST_REQUIRE(proof.siblings_.empty());
+	BOOST_REQUIRE(verify_exclusion(ms->root_hash(), 5, proof));
+	std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+	std::set<bi::uint256_t> used;
+	for (unsigned i = 0; i < 300; i++)
+	{
+		bi::uint256_t key = bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i) << (i % 64);
+		if (used.insert(key).second)
+			items.push_back(std::make_pair(key, i + 1));
+	}
+	ms->write_batch(items);
+	for (unsigned i = 0; i < items.size(); i++)
+	{
+		auto& item = items[i];
+		BOOST_REQUIRE(ms->prove(item.first, value, proof));
+		BOOST_REQUIRE_EQUAL(value, item.second);
+		BOOST_REQUIRE(verify_inclusion(ms->root_hash(), item.first, item.second, proof));
+		BOOST_REQUIRE(!verify_inclusion(ms->root_hash(), item.first, item.second + 1, proof));
+		BOOST_REQUIRE(!verify_exclusion(ms->root_hash(), item.first, proof));
+		// only the levels where other keys branch off carry a hash
+		std::set<unsigned> branches;
+		for (auto& other : items)
+			if (other.first != item.first)
+				branches.insert((other.first ^ item.first).bits());
+		BOOST_REQUIRE_EQUAL(proof.siblings_.size(), branches.size());
+		auto bytes = serialize_proof(proof);
+		merkle_proof copy;
+		BOOST_REQUIRE(deserialize_proof(bytes.data(), bytes.size(), copy));
+		BOOST_REQUIRE(verify_inclusion(ms->root_hash(), item.first, item.second, copy));
+		BOOST_REQUIRE(!deserialize_proof(bytes.data(), bytes.size() - 1, copy));
+		if (!proof.siblings_.empty())
+		{
+			proof.siblings_[i % proof.siblings_.size()] += 1;
+			BOOST_REQUIRE(!verify_inclusion(ms->root_hash(), item.first, item.second, proof));
+			proof.siblings_.pop_back();
+			BOOST_REQUIRE(!verify_inclusion(ms->root_hash(), item.first, item.second, proof));
+		}
+		// absent keys next to the leaf, inside a compressed edge and off the tree
+		const bi::uint256_t absent[] = { item.first ^ 1, item.first ^ (bi::uint256_1 << 200),
+			item.first + (bi::uint256_1 << 255) };
+		for (auto& key : absent)
+		{
+			if (ms->does_key_exist(key))
+				continue;
+			BOOST_REQUIRE(!ms->prove(key, value, proof));
+			BOOST_REQUIRE_EQUAL(value, 0);
+			BOOST_REQUIRE(verify_exclusion(ms->root_hash(), key, proof));
+			BOOST_REQUIRE(!verify_inclusion(ms->root_hash(), key, 0, proof));
+		}
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_prove_many, NoTestDBFixture)
+{
+	auto ms = merkle_storage::create("test.db");
+	std::vector<bi::uint256_t> keys, values;
+	std::vector<bool> found;
+	merkle_multiproof proof;
+	keys.push_back(7);
+	ms->prove_many(keys, values, found, proof);
+	BOOST_REQUIRE(!found[0]);
+	BOOST_REQUIRE(verify_multiproof(ms->root_hash(), keys, values, found, proof));
+	std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < 2000; i++)
+		items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i * 3) << 64, i + 1));
+	ms->write_batch(items);
+	for (unsigned round = 0; round < 4; round++)
+	{
+		keys.clear();
+		for (unsigned i = round; i < items.size(); i += 7 + round * 5)
+		{
+			keys.push_back(items[i].first);
+			// absent neighbours and far away keys
+			if (i % 3 == 0)
+				keys.push_back(items[i].first + 1);
+			if (i % 5 == 0)
+				keys.push_back(bi::uint256_t(i) << (100 + round));
+		}
+		keys.push_back(keys[keys.size() / 2]);
+		ms->prove_many(keys, values, found, proof);
+		BOOST_REQUIRE(verify_multiproof(ms->root_hash(), keys, values, found, proof));
+		size_t single_siblings = 0;
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			bi::uint256_t value;
+			merkle_proof single;
+			BOOST_REQUIRE_EQUAL(found[i], ms->prove(keys[i], value, single));
+			BOOST_REQUIRE_EQUAL(values[i], value);
+			single_siblings += single.siblings_.size();
+		}
+		// upper level siblings are shared by the keys
+		BOOST_REQUIRE_LT(proof.siblings_.size() * 2, single_siblings);
+		auto bytes = serialize_proof(proof);
+		merkle_multiproof copy;
+		BOOST_REQUIRE(deserialize_proof(bytes.data(), bytes.size(), copy));
+		BOOST_REQUIRE(verify_multiproof(ms->root_hash(), keys, values, found, copy));
+		BOOST_REQUIRE(!deserialize_proof(bytes.data(), bytes.size() - 1, copy));
+		// flag counts beyond the bitmap given, up to the largest one
+		const uint8_t huge[] = { 0xff, 0xff, 0xff, 0xff };
+		BOOST_REQUIRE(!deserialize_proof(huge, sizeof(huge), copy));
+		const uint8_t truncated[] = { 0, 0, 0, 9, 0xff };
+		BOOST_REQUIRE(!deserialize_proof(truncated, sizeof(truncated), copy));
+		// wrong claims and damaged proofs are rejected
+		size_t pos = round * 3 % keys.size();
+		values[pos] += 1;
+		found[pos] = true;
+		BOOST_REQUIRE(!verify_multiproof(ms->root_hash(), keys, values, found, proof));
+		values[pos] -= 1;
+		found[pos] = !found[pos];
+		ms->prove_many(keys, values, found, proof);
+		std::vector<bool> claimed(found);
+		claimed[pos] = !claimed[pos];
+		BOOST_REQUIRE(!verify_multiproof(ms->root_hash(), keys, values, claimed, proof));
+		keys.pop_back();
+		values.pop_back();
+		found.pop_back();
+		BOOST_REQUIRE(verify_multiproof(ms->root_hash(), keys, values, found, proof));
+		keys.pop_back();
+		values.pop_back();
+		found.pop_back();
+		BOOST_REQUIRE(!verify_multiproof(ms->root_hash(), keys, values, found, proof));
+		copy = proof;
+		copy.siblings_[round] += 1;
+		BOOST_REQUIRE(!verify_multiproof(ms->root_hash(), keys, values, found, copy));
+		copy = proof;
+		copy.siblings_map_.push_back(false);
+		BOOST_REQUIRE(!verify_multiproof(ms->root_hash(), keys, values, found, copy));
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(proof_verifier_test, NoTestDBFixture)
+{
+	auto ms = merkle_storage::create("test.db");
+	std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < 1000; i++)
+		items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i) << 32, i + 1));
+	ms->write_batch(items);
+	std::vector<bi::uint256_t> keys, values, roots;
+	std::vector<bool> found, valid;
+	std::vector<merkle_proof> proofs;
+	for (unsigned i = 0; i < 300; i++)
+	{
+		bi::uint256_t key = i % 4 == 3 ? items[i].first + 1 : items[i].first;
+		bi::uint256_t value;
+		proofs.push_back(merkle_proof());
+		found.push_back(ms->prove(key, value, proofs.back()));
+		keys.push_back(key);
+		values.push_back(value);
+		roots.push_back(ms->root_hash());
+		// some claims are wrong, some proofs are damaged
+		switch (i % 7)
+		{
+		case 1:
+			values.back() += 1;
+			break;
+		case 2:
+			found.back() = !found.back();
+			break;
+		case 3:
+			if (!proofs.back().siblings_.empty())
+				proofs.back().siblings_.pop_back();
+			break;
+		case 4:
+			roots.back() += 1;
+			break;
+		}
+	}
+	proof_verifier verifier;
+	verifier.verify(roots, keys, values, found, proofs, valid);
+	BOOST_REQUIRE_EQUAL(valid.size(), keys.size());
+	size_t valid_count = 0;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		bool expected = found[i] ?
+			verify_inclusion(roots[i], keys[i], values[i], proofs[i]) :
+			verify_exclusion(roots[i], keys[i], proofs[i]);
+		BOOST_REQUIRE_EQUAL(valid[i], expected);
+		valid_count += valid[i];
+	}
+	BOOST_REQUIRE(valid_count > keys.size() / 3 && valid_count < keys.size());
+	roots.resize(1);
+	BOOST_REQUIRE_THROW(verifier.verify(roots, keys, values, found, proofs, valid), std::exception);
+	verifier.verify(ms->root_hash(), keys, values, found, proofs, valid);
+	// the damaged roots are not used now
+	BOOST_REQUIRE(valid[0] && !valid[1] && valid[4]);
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_bytes_values, NoTestDBFixture)
+{
+	const storage_backend_type types[] = { storage_backend_type::stdio, storage_backend_type::mmap };
+	for (auto type : types)
+	{
+		NoTestDBFixture::remove_files();
+		std::map<bi::uint256_t, std::vector<uint8_t>> model;
+		const size_t sizes[] = { 0, 1, 31, 32, 33, BLOCK_SIZE, BLOCK_SIZE + 1, 1000, 5000, MAX_VALUE_SIZE };
+		{
+			auto ms = merkle_storage::create("test.db", type);
+			for (unsigned round = 0; round < 3; round++)
+			{
+				for (unsigned i = 0; i < 40; i++)
+				{
+					bi::uint256_t key = bi::uint256_t(i * 0x9e3779b97f4a7c15ULL) << 128;
+					// values grow, shrink and turn into numbers on overwrite
+					std::vector<uint8_t> value(sizes[(i + round * 3) % 10]);
+					for (size_t j = 0; j < value.size(); j++)
+						value[j] = (uint8_t)(i + j * round);
+					if (round == 2 && i % 4 == 0)
+					{
+						ms->write_value(key, i);
+						value.assign(32, 0);
+						uint256_to_bytes(i, value.data());
+					}
+					else
+						ms->write_value(key, value.data(), value.size());
+					model[key] = value;
+				}
+				for (auto& kv : model)
+				{
+					std::vector<uint8_t> value;
+					ms->read_value(kv.first, value);
+					BOOST_REQUIRE(value == kv.second);
+					merkle_proof proof;
+					BOOST_REQUIRE(ms->prove(kv.first, proof));
+					BOOST_REQUIRE(verify_inclusion(ms->root_hash(), kv.first,
+						kv.second.data(), kv.second.size(), proof));
+					size_t size = 0;
+					const uint8_t* view = ms->view_value(kv.first, size);
+					if (view)
+					{
+						BOOST_REQUIRE_EQUAL(size, kv.second.size());
+						BOOST_REQUIRE(std::equal(view, view + size, kv.second.begin()));
+					}
+				}
+			}
+			std::vector<uint8_t> too_long(MAX_VALUE_SIZE + 1);
+			BOOST_REQUIRE_THROW(ms->write_value(1, too_long.data(), too_long.size()), std::exception);
+			// 32 byte strings read as numbers
+			bi::uint256_t number;
+			std::vector<uint8_t> bytes(32);
+			uint256_to_bytes(bi::uint256_t(777) << 128, bytes.data());
+			ms->write_value(5, bytes.data(), bytes.size());
+			ms->read_value(5, number);
+			BOOST_REQUIRE_EQUAL(number, bi::uint256_t(777) << 128);
+			auto it = model.begin();
+			while (it->second.size() == 32)
+				++it;
+			BOOST_REQUIRE_THROW(ms->read_value(it->first, number), std::exception);
+			ms->delete_value(5);
+		}
+		auto ms = merkle_storage::open("test.db", type);
+		for (auto& kv : model)
+		{
+			std::vector<uint8_t> value;
+			ms->read_value(kv.first, value);
+			BOOST_REQUIRE(value == kv.second);
+		}
+		if (type == storage_backend_type::mmap)
+		{
+			// after the sync the extents are served from the mapping
+			ms->sync();
+			size_t size = 0;
+			auto it = model.begin();
+			while (it->second.size() <= BLOCK_SIZE)
+				++it;
+			const uint8_t* view = ms->view_value(it->first, size);
+			BOOST_REQUIRE(view != nullptr);
+			BOOST_REQUIRE(std::equal(view, view + size, it->second.begin()));
+		}
+		std::vector<bi::uint256_t> keys;
+		for (auto& kv : model)
+			keys.push_back(kv.first);
+		ms->delete_batch(keys);
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+	}
+	// extents are freed with their values
+	FILE* f = fopen("test.db", "rb");
+	fseek(f, 0, SEEK_END);
+	BOOST_REQUIRE(ftell(f) < (long)(40 * (MAX_VALUE_SIZE / BLOCK_SIZE + 3) * 2) * BLOCK_SIZE);
+	fclose(f);
+}
+
+// leaves of the subtree, the first child of a leaf is its value block
+// in format 4 files
+static void collect_leaves(storage_file& storage, uint32_t idx, std::vector<uint32_t>& leaves)
+{
+	data_block data;
+	storage_block_parser parser(data);
+	storage.read_block(idx, data);
+	if (parser.get_prefix_length() == KEY_LENGTH)
+	{
+		leaves.push_back(idx);
+		return;
+	}
+	if (parser.get_first_child_id())
+		collect_leaves(storage, parser.get_first_child_id(), leaves);
+	if (parser.get_second_child_id())
+		collect_leaves(storage, parser.get_second_child_id(), leaves);
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_format_upgrade, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	bi::uint256_t root;
+	{
+		auto ms = merkle_storage::create("test.db");
+		for (unsigned i = 0; i < 2500; i++)
+		{
+			bi::uint256_t key = bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i) << 40;
+			model[key] = i + 1;
+			ms->write_value(key, i + 1);
+		}
+		root = ms->root_hash();
+	}
+	{
+		// move the values out of the leaves as format 4 kept them
+		storage_file storage;
+		storage.open("test.db");
+		BOOST_REQUIRE_EQUAL(storage.get_format_version(), STORAGE_FORMAT_VERSION);
+		std::vector<uint32_t> leaves;
+		collect_leaves(storage, 1, leaves);
+		BOOST_REQUIRE_EQUAL(leaves.size(), model.size());
+		data_block data, value_block;
+		storage_block_parser parser(data), value_parser(value_block);
+		for (uint32_t idx : leaves)
+		{
+			storage.read_block(idx, data);
+			bi::uint256_t value;
+			parser.get_value(value);
+			uint32_t value_idx = storage.next_available_block_idx();
+			value_parser.clear();
+			value_parser.set_type(VALUE_BLOCK_TYPE);
+			value_parser.set_parent_id(idx);
+			value_parser.set_value(value);
+			storage.write_block(value_idx, value_block);
+			parser.set_value(bi::uint256_0);
+			parser.set_first_child_id(value_idx);
+			storage.write_block(idx, data);
+		}
+		storage.set_format_version(4);
+	}
+	{
+		storage_file storage;
+		storage.open("test.db");
+		BOOST_REQUIRE_EQUAL(storage.get_format_version(), 4);
+	}
+	{
+		auto ms = merkle_storage::open("test.db");
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+		for (auto& kv : model)
+		{
+			bi::uint256_t value;
+			ms->read_value(kv.first, value);
+			BOOST_REQUIRE_EQUAL(value, kv.second);
+		}
+		ms->delete_value(model.begin()->first);
+		model.erase(model.begin());
+	}
+	storage_file storage;
+	storage.open("test.db");
+	BOOST_REQUIRE_EQUAL(storage.get_format_version(), STORAGE_FORMAT_VERSION);
+	std::vector<uint32_t> leaves;
+	collect_leaves(storage, 1, leaves);
+	BOOST_REQUIRE_EQUAL(leaves.size(), model.size());
+	data_block data;
+	storage_block_parser parser(data);
+	for (uint32_t idx : leaves)
+	{
+		storage.read_block(idx, data);
+		BOOST_REQUIRE_EQUAL(parser.get_first_child_id(), 0);
+	}
+	// the value blocks are free again
+	BOOST_REQUIRE_LT(storage.next_available_block_idx(), leaves.size() * 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_cursor_test, NoTestDBFixture)
+{
+	auto ms = merkle_storage::create("test.db");
+	{
+		merkle_cursor cursor(*ms);
+		BOOST_REQUIRE(!cursor.seek_first());
+		BOOST_REQUIRE(!cursor.seek_last());
+		BOOST_REQUIRE(!cursor.next());
+		BOOST_REQUIRE_THROW(cursor.key(), std::runtime_error);
+	}
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	// keys sharing long prefixes, at both ends of the key space and spread
+	model[bi::uint256_0] = 1;
+	model[~bi::uint256_0] = 2;
+	for (unsigned i = 0; i < 300; i++)
+		model[bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i * 7)] = i + 3;
+	for (unsigned i = 0; i < 20; i++)
+		model[(bi::uint256_t(5) << 250) + i] = i;
+	for (auto& kv : model)
+		ms->write_value(kv.first, kv.second);
+	const uint8_t bytes[100] = { 1, 2, 3 };
+	ms->write_value(bi::uint256_t(77), bytes, sizeof(bytes));
+
+	merkle_cursor cursor(*ms);
+	cursor.set_prefetch(true);
+	std::vector<bi::uint256_t> keys;
+	for (bool ok = cursor.seek_first(); ok; ok = cursor.next())
+		keys.push_back(cursor.key());
+	BOOST_REQUIRE_EQUAL(keys.size(), model.size() + 1);
+	model.erase(bi::uint256_t(77));
+	auto key_it = keys.begin();
+	for (auto& kv : model)
+	{
+		if (*key_it == 77)
+			++key_it;
+		BOOST_REQUIRE_EQUAL(*key_it++, kv.first);
+	}
+	std::vector<bi::uint256_t> reversed;
+	for (bool ok = cursor.seek_last(); ok; ok = cursor.prev())
+		reversed.push_back(cursor.key());
+	std::reverse(reversed.begin(), reversed.end());
+	BOOST_REQUIRE(reversed == keys);
+	BOOST_REQUIRE(!cursor.valid());
+
+	BOOST_REQUIRE(cursor.seek(bi::uint256_t(77)));
+	std::vector<uint8_t> value;
+	cursor.value(value);
+	BOOST_REQUIRE(value == std::vector<uint8_t>(bytes, bytes + sizeof(bytes)));
+	bi::uint256_t number;
+	BOOST_REQUIRE_THROW(cursor.value(number), std::runtime_error);
+	ms->delete_value(bi::uint256_t(77));
+
+	for (unsigned i = 0; i < 200; i++)
+	{
+		bi::uint256_t key = bi::uint256_t(i * 0x7f4a7c159e3779b9ULL, i * 0x3779b97f4a7c15ULL) ^
+			(bi::uint256_t(i % 3) << 250);
+		if (i % 4 == 0)
+			key = std::next(model.begin(), i % model.size())->first;
+		auto it = model.lower_bound(key);
+		BOOST_REQUIRE_EQUAL(cursor.seek(key), it != model.end());
+		if (it != model.end())
+		{
+			BOOST_REQUIRE_EQUAL(cursor.key(), it->first);
+			cursor.value(number);
+			BOOST_REQUIRE_EQUAL(number, it->second);
+			// steps go on from the sought key
+			BOOST_REQUIRE_EQUAL(cursor.next(), std::next(it) != model.end());
+			if (std::next(it) != model.end())
+			{
+				BOOST_REQUIRE_EQUAL(cursor.key(), std::next(it)->first);
+				BOOST_REQUIRE(cursor.prev());
+				BOOST_REQUIRE_EQUAL(cursor.key(), it->first);
+			}
+		}
+		it = model.upper_bound(key);
+		BOOST_REQUIRE_EQUAL(cursor.seek_prev(key), it != model.begin());
+		if (it != model.begin())
+			BOOST_REQUIRE_EQUAL(cursor.key(), std::prev(it)->first);
+	}
+
+	// range scans see only the keys within the bounds
+	auto lower = std::next(model.begin(), 10)->first + 1;
+	auto upper = std::next(model.begin(), 40)->first;
+	merkle_cursor range(*ms, lower, upper);
+	keys.clear();
+	for (bool ok = range.seek_first(); ok; ok = range.next())
+		keys.push_back(range.key());
+	BOOST_REQUIRE_EQUAL(keys.size(), 30);
+	BOOST_REQUIRE_EQUAL(keys.front(), std::next(model.begin(), 11)->first);
+	BOOST_REQUIRE_EQUAL(keys.back(), upper);
+	BOOST_REQUIRE(range.seek_last());
+	BOOST_REQUIRE_EQUAL(range.key(), upper);
+	BOOST_REQUIRE(!range.seek(upper + 1));
+	BOOST_REQUIRE(range.seek(bi::uint256_0));
+	BOOST_REQUIRE_EQUAL(range.key(), keys.front());
+	BOOST_REQUIRE(!range.prev());
+}
+
+// same trie nodes and values, the block indices may differ
+static void compare_subtrees(storage_file& a, uint32_t a_idx, storage_file& b, uint32_t b_idx)
+{
+	data_block a_data, b_data;
+	storage_block_parser a_parser(a_data), b_parser(b_data);
+	a.read_block(a_idx, a_data);
+	b.read_block(b_idx, b_data);
+	BOOST_REQUIRE_EQUAL(a_parser.get_type(), b_parser.get_type());
+	BOOST_REQUIRE_EQUAL(a_parser.get_prefix_length(), b_parser.get_prefix_length());
+	// the value field follows the header
+	BOOST_REQUIRE(std::equal(a_data.begin() + BLOCK_HEADER_SIZE, a_data.end(),
+		b_data.begin() + BLOCK_HEADER_SIZE));
+	if (a_parser.get_prefix_length() == KEY_LENGTH)
+	{
+		BOOST_REQUIRE_EQUAL(a_parser.get_value_size(), b_parser.get_value_size());
+		uint32_t size = a_parser.get_value_size() & ~BYTES_VALUE_FLAG;
+		uint32_t a_extent = a_parser.get_first_child_id();
+		uint32_t b_extent = b_parser.get_first_child_id();
+		for (uint32_t i = 0; size > BLOCK_VALUE_SIZE && i * BLOCK_SIZE < size; i++)
+		{
+			a.read_block(a_extent + i, a_data);
+			b.read_block(b_extent + i, b_data);
+			BOOST_REQUIRE(a_data == b_data);
+		}
+		return;
+	}
+	uint32_t a_children[] = { a_parser.get_first_child_id(), a_parser.get_second_child_id() };
+	uint32_t b_children[] = { b_parser.get_first_child_id(), b_parser.get_second_child_id() };
+	for (unsigned side = 0; side < 2; side++)
+	{
+		BOOST_REQUIRE_EQUAL(a_children[side] == 0, b_children[side] == 0);
+		if (a_children[side] == 0)
+			continue;
+		a.read_block(a_children[side], a_data);
+		b.read_block(b_children[side], b_data);
+		BOOST_REQUIRE_EQUAL(a_parser.get_parent_id(), a_idx);
+		BOOST_REQUIRE_EQUAL(b_parser.get_parent_id(), b_idx);
+		compare_subtrees(a, a_children[side], b, b_children[side]);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_bulk_load, NoTestDBFixture)
+{
+	{
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		auto ms = merkle_storage::bulk_load("bulk.db", items.begin(), items.end());
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), default_hash(0));
+		merkle_cursor cursor(*ms);
+		BOOST_REQUIRE(!cursor.seek_first());
+	}
+	NoTestDBFixture::remove_files();
+
+	// the log of a crashed database at the same path isn't replayed
+	{
+		auto crashed = merkle_storage::create("crash.db");
+		for (unsigned i = 0; i < 100; i++)
+			crashed->write_value(bi::uint256_t(i) << 100, bi::uint256_t(i));
+		crashed->sync();
+		copy_file("crash.db.wal", "bulk.db.wal");
+	}
+	{
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 1; i <= 4; i++)
+			items.push_back(std::make_pair(bi::uint256_t(i) << 200, bi::uint256_t(i)));
+		auto ms = merkle_storage::bulk_load("bulk.db", items.begin(), items.end());
+		auto expected = merkle_storage::create("test.db");
+		expected->write_batch(items);
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+		for (auto& item : items)
+			BOOST_REQUIRE(ms->does_key_exist(item.first));
+		BOOST_REQUIRE(!ms->does_key_exist(bi::uint256_t(1) << 100));
+	}
+	NoTestDBFixture::remove_files();
+
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	model[bi::uint256_0] = 1;
+	model[~bi::uint256_0] = 2;
+	for (unsigned i = 1; i < 3000; i++)
+		model[bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i * 7)] = i;
+	for (unsigned i = 0; i < 50; i++)
+		model[(bi::uint256_t(3) << 253) + i * 5] = i;
+	// byte string values, inline and in extents
+	std::vector<uint8_t> bytes(1000);
+	for (size_t i = 0; i < bytes.size(); i++)
+		bytes[i] = (uint8_t)(i * 31);
+	std::map<bi::uint256_t, size_t> byte_values;
+	for (unsigned i = 0; i < 40; i++)
+		byte_values[bi::uint256_t(i * 0x7f4a7c159e3779b9ULL, i) + 1] = i * 25;
+	for (auto& kv : byte_values)
+		model.erase(kv.first);
+
+	{
+		auto ms = merkle_storage::create("test.db");
+		for (auto& kv : model)
+			ms->write_value(kv.first, kv.second);
+		for (auto& kv : byte_values)
+			ms->write_value(kv.first, bytes.data(), kv.second);
+	}
+	bulk_loader loader("bulk.db");
+	auto byte_it = byte_values.begin();
+	for (auto& kv : model)
+	{
+		for (; byte_it != byte_values.end() && byte_it->first < kv.first; ++byte_it)
+			loader.add(byte_it->first, bytes.data(), byte_it->second);
+		loader.add(kv.first, kv.second);
+	}
+	for (; byte_it != byte_values.end(); ++byte_it)
+		loader.add(byte_it->first, bytes.data(), byte_it->second);
+	BOOST_REQUIRE_THROW(loader.add(bi::uint256_t(5), bi::uint256_t(5)), std::runtime_error);
+	auto ms = loader.finish();
+	{
+		auto incremental = merkle_storage::open("test.db");
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), incremental->root_hash());
+	}
+	{
+		storage_file a, b;
+		a.open("test.db");
+		b.open("bulk.db");
+		compare_subtrees(a, 1, b, 1);
+		BOOST_REQUIRE_LE(b.next_available_block_idx(), a.next_available_block_idx());
+	}
+	// the loaded database takes writes as usual
+	ms->write_value(bi::uint256_t(5), bi::uint256_t(6));
+	model[bi::uint256_t(5)] = 6;
+	ms->delete_value(bi::uint256_0);
+	model.erase(bi::uint256_0);
+	bi::uint256_t value;
+	for (auto& kv : model)
+	{
+		ms->read_value(kv.first, value);
+		BOOST_REQUIRE_EQUAL(value, kv.second);
+	}
+	std::vector<uint8_t> read;
+	for (auto& kv : byte_values)
+	{
+		ms->read_value(kv.first, read);
+		BOOST_REQUIRE(read == std::vector<uint8_t>(bytes.begin(), bytes.begin() + kv.second));
+	}
+	ms.reset();
+
+	// an abandoned load leaves no file behind
+	{
+		bulk_loader abandoned("crash.db");
+		abandoned.add(bi::uint256_t(1), bi::uint256_t(1));
+	}
+	BOOST_REQUIRE(!is_file_exists("crash.db"));
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_snapshot, NoTestDBFixture)
+{
+	{
+		auto ms = merkle_storage::create("test.db");
+		std::stringstream stream;
+		export_snapshot(*ms, stream);
+		auto imported = import_snapshot("bulk.db", stream);
+		BOOST_REQUIRE_EQUAL(imported->root_hash(), default_hash(0));
+	}
+	NoTestDBFixture::remove_files();
+
+	std::vector<uint8_t> bytes(2000);
+	for (size_t i = 0; i < bytes.size(); i++)
+		bytes[i] = (uint8_t)(i * 7);
+	std::string snapshot;
+	{
+		auto ms = merkle_storage::create("test.db");
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < 5000; i++)
+			items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), i));
+		ms->write_batch(items);
+		for (unsigned i = 0; i < 100; i++)
+			ms->write_value(bi::uint256_t(i) << 128, bytes.data(), i * 20);
+		std::stringstream stream;
+		export_snapshot(*ms, stream);
+		snapshot = stream.str();
+		std::stringstream in(snapshot);
+		auto imported = import_snapshot("bulk.db", in);
+		BOOST_REQUIRE_EQUAL(imported->root_hash(), ms->root_hash());
+	}
+	{
+		storage_file a, b;
+		a.open("test.db");
+		b.open("bulk.db");
+		compare_subtrees(a, 1, b, 1);
+	}
+	delete_file("bulk.db");
+
+	// damaged streams are refused and leave no file behind
+	std::vector<std::string> damaged;
+	damaged.push_back(snapshot.substr(0, snapshot.size() / 2));
+	damaged.push_back(snapshot.substr(0, snapshot.size() - 1));
+	damaged.push_back(snapshot);
+	damaged.back()[snapshot.size() / 3] ^= 1;
+	damaged.push_back(snapshot);
+	damaged.back()[0] = 'X';
+	for (auto& data : damaged)
+	{
+		std::stringstream in(data);
+		BOOST_REQUIRE_THROW(import_snapshot("bulk.db", in), std::runtime_error);
+		BOOST_REQUIRE(!is_file_exists("bulk.db"));
+	}
+
+	// a wrong root hash under a valid trailer checksum is found after the
+	// file is built, the file is removed then
+	std::string wrong_root = snapshot;
+	// trailer payload of the entry count and the root hash, then its checksum
+	uint8_t* trailer = (uint8_t*)&wrong_root[wrong_root.size() - 32 - 40];
+	trailer[8] ^= 1;
+	uint256_to_bytes(::hash(trailer, 40), trailer + 40);
+	std::stringstream in(wrong_root);
+	BOOST_REQUIRE_EXCEPTION(import_snapshot("bulk.db", in), std::runtime_error,
+		[](const std::runtime_error& e) { return std::string(e.what()) == "Snapshot root hash mismatch"; });
+	BOOST_REQUIRE(!is_file_exists("bulk.db"));
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_transaction, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	auto ms = merkle_storage::create("test.db");
+	for (unsigned i = 0; i < 200; i++)
+	{
+		bi::uint256_t key(i * 0x9e3779b97f4a7c15ULL, i);
+		model[key] = i;
+		ms->write_value(key, i);
+	}
+	bi::uint256_t root = ms->root_hash();
+	{
+		auto tx = ms->begin();
+		BOOST_REQUIRE_THROW(ms->begin(), std::runtime_error);
+		for (unsigned i = 0; i < 100; i++)
+			tx.write_value(bi::uint256_t(i) << 200, i + 1);
+		for (auto it = model.begin(); it != model.end(); std::advance(it, 2))
+			tx.delete_value(it->first);
+		// the transaction reads its own writes
+		bi::uint256_t value;
+		tx.read_value(bi::uint256_t(7) << 200, value);
+		BOOST_REQUIRE_EQUAL(value, 8);
+		BOOST_REQUIRE(!tx.does_key_exist(model.begin()->first));
+		BOOST_REQUIRE(tx.root_hash() != root);
+		tx.rollback();
+		BOOST_REQUIRE(!tx.is_active());
+		BOOST_REQUIRE_THROW(tx.commit(), std::runtime_error);
+	}
+	BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+	BOOST_REQUIRE(!ms->does_key_exist(bi::uint256_t(7) << 200));
+	for (auto& kv : model)
+	{
+		bi::uint256_t value;
+		ms->read_value(kv.first, value);
+		BOOST_REQUIRE_EQUAL(value, kv.second);
+	}
+	{
+		// dropped without commit
+		auto tx = ms->begin();
+		tx.write_value(bi::uint256_t(1), bi::uint256_t(1));
+	}
+	BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+
+	const uint8_t bytes[300] = { 9 };
+	{
+		// ends before the storage does
+		auto tx = ms->begin();
+		for (unsigned i = 0; i < 100; i++)
+		{
+			// repeated writes of the same keys
+			tx.write_value(bi::uint256_t(i % 10) << 200, i);
+			model[bi::uint256_t(i % 10) << 200] = i;
+		}
+		tx.write_value(bi::uint256_t(3), bytes, sizeof(bytes));
+		for (unsigned i = 0; i < 200; i += 3)
+		{
+			bi::uint256_t key(i * 0x9e3779b97f4a7c15ULL, i);
+			tx.delete_value(key);
+			model.erase(key);
+		}
+		// a missing key fails before changing anything, the transaction goes on
+		BOOST_REQUIRE_THROW(tx.delete_value(bi::uint256_t(12345)), std::runtime_error);
+		BOOST_REQUIRE(tx.is_active());
+		tx.commit();
+		BOOST_REQUIRE(!tx.is_active());
+	}
+	root = ms->root_hash();
+	{
+		auto expected = merkle_storage::create("bulk.db");
+		for (auto& kv : model)
+			expected->write_value(kv.first, kv.second);
+		expected->write_value(bi::uint256_t(3), bytes, sizeof(bytes));
+		BOOST_REQUIRE_EQUAL(root, expected->root_hash());
+	}
+	// committed transactions are durable right away
+	copy_file("test.db", "crash.db");
+	copy_file("test.db.wal", "crash.db.wal");
+	ms.reset();
+	ms = merkle_storage::open("crash.db");
+	BOOST_REQUIRE_EQUAL(ms->root_hash(), root);
+	for (auto& kv : model)
+	{
+		bi::uint256_t value;
+		ms->read_value(kv.first, value);
+		BOOST_REQUIRE_EQUAL(value, kv.second);
+	}
+	std::vector<uint8_t> read;
+	ms->read_value(bi::uint256_t(3), read);
+	BOOST_REQUIRE(read == std::vector<uint8_t>(bytes, bytes + sizeof(bytes)));
+}
+
+// blocks of a closed file in use, not counting free info blocks
+static size_t count_used_blocks(const std::string& file_name)
+{
+	storage_file file;
+	file.open(file_name);
+	data_block data;
+	size_t used = 0;
+	for (uint32_t idx = 0; ; idx++)
+	{
+		try
+		{
+			file.read_block(idx, data);
+			if (idx % FREE_MAP_PAGE_BLOCKS != 0)
+				used++;
+		}
+		catch (const std::runtime_error& e)
+		{
+			if (std::string(e.what()) == "Invalid block index")
+				return used;
+		}
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_mvcc, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	auto ms = merkle_storage::create("test.db");
+	BOOST_REQUIRE_THROW(ms->open_snapshot(), std::runtime_error);
+	for (unsigned i = 0; i < 300; i++)
+	{
+		bi::uint256_t key(i * 0x9e3779b97f4a7c15ULL, i);
+		model[key] = i;
+		ms->write_value(key, i);
+	}
+	ms->set_retained_versions(3);
+	auto first = ms->open_snapshot();
+	BOOST_REQUIRE_EQUAL(first.root_hash(), ms->root_hash());
+	const auto first_model = model;
+
+	// readers check the first version while the writer changes every key
+	std::atomic<bool> done(false);
+	std::atomic<unsigned> errors(0);
+	std::vector<std::thread> readers;
+	for (unsigned t = 0; t < 4; t++)
+		readers.emplace_back([&]()
+		{
+			do
+			{
+				for (auto& kv : first_model)
+				{
+					bi::uint256_t value;
+					merkle_proof proof;
+					first.read_value(kv.first, value);
+					if (value != kv.second || !first.prove(kv.first, value, proof) ||
+						!verify_inclusion(first.root_hash(), kv.first, value, proof))
+						errors++;
+				}
+			} while (!done);
+		});
+	const uint8_t bytes[400] = { 7 };
+	for (unsigned round = 0; round < 20; round++)
+	{
+		for (unsigned i = round; i < 300; i += 20)
+		{
+			bi::uint256_t key(i * 0x9e3779b97f4a7c15ULL, i);
+			if (round % 2)
+			{
+				ms->delete_value(key);
+				model.erase(key);
+			}
+			else
+			{
+				ms->write_value(key, i + 1000);
+				model[key] = i + 1000;
+			}
+		}
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < 10; i++)
+			items.push_back(std::make_pair(bi::uint256_t(round * 10 + i) << 100, round));
+		ms->write_batch(items);
+		for (auto& item : items)
+			model[item.first] = item.second;
+		auto tx = ms->begin();
+		tx.write_value(bi::uint256_t(round), bytes, sizeof(bytes));
+		tx.delete_value(items[round % 10].first);
+		model.erase(items[round % 10].first);
+		tx.commit();
+	}
+	done = true;
+	for (auto& reader : readers)
+		reader.join();
+	BOOST_REQUIRE_EQUAL(errors, 0);
+
+	auto last = ms->open_snapshot();
+	BOOST_REQUIRE_EQUAL(last.root_hash(), ms->root_hash());
+	BOOST_REQUIRE(last.version() > first.version());
+	for (auto& kv : model)
+	{
+		bi::uint256_t value;
+		last.read_value(kv.first, value);
+		BOOST_REQUIRE_EQUAL(value, kv.second);
+	}
+	std::vector<uint8_t> read;
+	last.read_value(bi::uint256_t(5), read);
+	BOOST_REQUIRE(read == std::vector<uint8_t>(bytes, bytes + sizeof(bytes)));
+	BOOST_REQUIRE(!last.does_key_exist(bi::uint256_t(11) << 100));
+	BOOST_REQUIRE(first.does_key_exist(first_model.begin()->first));
+
+	// versions survive reopening, the first one is kept while it is open
+	bi::uint256_t root = ms->root_hash();
+	uint64_t last_version = last.version();
+	{
+		merkle_snapshot moved(std::move(last));
+	}
+	copy_file("test.db", "crash.db");
+	copy_file("test.db.wal", "crash.db.wal");
+	auto reopened = merkle_storage::open("crash.db");
+	BOOST_REQUIRE_EQUAL(reopened->get_retained_versions(), 3);
+	auto snapshot = reopened->open_snapshot();
+	BOOST_REQUIRE_EQUAL(snapshot.version(), last_version);
+	BOOST_REQUIRE_EQUAL(snapshot.root_hash(), root);
+	bi::uint256_t value;
+	snapshot.read_value(model.rbegin()->first, value);
+	BOOST_REQUIRE_EQUAL(value, model.rbegin()->second);
+	{
+		merkle_snapshot dropped(std::move(snapshot));
+	}
+	reopened.reset();
+
+	// without versions only the blocks of the current tree stay in use
+	{
+		merkle_snapshot dropped(std::move(first));
+	}
+	ms->set_retained_versions(0);
+	BOOST_REQUIRE(ms->prune(std::chrono::seconds(10)));
+	BOOST_REQUIRE_THROW(ms->open_snapshot(), std::runtime_error);
+	ms->write_value(bi::uint256_t(1), bi::uint256_t(1));
+	model[bi::uint256_t(1)] = 1;
+	ms.reset();
+	{
+		auto expected = merkle_storage::create("bulk.db");
+		for (auto& kv : model)
+			expected->write_value(kv.first, kv.second);
+		for (unsigned round = 2; round < 20; round++)
+			expected->write_value(bi::uint256_t(round), bytes, sizeof(bytes));
+		BOOST_REQUIRE_EQUAL(expected->root_hash(), merkle_storage::open("test.db")->root_hash());
+	}
+	BOOST_REQUIRE_EQUAL(count_used_blocks("test.db"), count_used_blocks("bulk.db"));
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_versions, NoTestDBFixture)
+{
+	std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < 1000; i++)
+		items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), i));
+	auto ms = merkle_storage::create("test.db");
+	ms->write_batch(items);
+	BOOST_REQUIRE_EQUAL(ms->current_version(), 0);
+	ms->set_retained_versions(100);
+	BOOST_REQUIRE_EQUAL(ms->current_version(), 1);
+	size_t base_blocks;
+	{
+		auto copy = merkle_storage::create("bulk.db");
+		copy->write_batch(items);
+	}
+	base_blocks = count_used_blocks("bulk.db");
+
+	// one changed key per version, key i % 1000 gets value i at version i + 2
+	std::vector<bi::uint256_t> roots(1, ms->root_hash());
+	for (unsigned i = 0; i < 150; i++)
+	{
+		ms->write_value(items[i % 1000].first, 1000 + i);
+		BOOST_REQUIRE_EQUAL(ms->current_version(), i + 2);
+		roots.push_back(ms->root_hash());
+	}
+	ms->delete_value(items[999].first);
+	BOOST_REQUIRE(ms->prune(std::chrono::seconds(10)));
+	auto versions = ms->list_versions();
+	BOOST_REQUIRE_EQUAL(versions.size(), 100);
+	BOOST_REQUIRE_EQUAL(versions.front(), 53);
+	BOOST_REQUIRE_EQUAL(versions.back(), 152);
+	BOOST_REQUIRE_THROW(ms->root_hash(52), std::runtime_error);
+	BOOST_REQUIRE_THROW(ms->read_value(items[0].first, roots[0], 153), std::runtime_error);
+	for (uint64_t version = 53; version < 152; version++)
+	{
+		BOOST_REQUIRE_EQUAL(ms->root_hash(version), roots[version - 1]);
+		// the key changed by the version, the one changed next and an unchanged one
+		unsigned changed = (unsigned)(version - 2);
+		const unsigned keys[] = { changed, changed + 1, 500 };
+		for (unsigned i : keys)
+		{
+			bi::uint256_t value, expected = i <= changed ? 1000 + i : i;
+			merkle_proof proof;
+			ms->read_value(items[i].first, value, version);
+			BOOST_REQUIRE_EQUAL(value, expected);
+			BOOST_REQUIRE(ms->prove(items[i].first, value, proof, version));
+			BOOST_REQUIRE(verify_inclusion(roots[version - 1], items[i].first, expected, proof));
+		}
+		merkle_proof proof;
+		BOOST_REQUIRE(ms->prove(items[999].first, proof, version));
+	}
+	merkle_proof proof;
+	BOOST_REQUIRE(!ms->prove(items[999].first, proof, 152));
+	BOOST_REQUIRE(verify_exclusion(ms->root_hash(), items[999].first, proof));
+
+	// versions share the unchanged subtrees, a version costs its path only
+	ms.reset();
+	size_t blocks = count_used_blocks("test.db");
+	BOOST_REQUIRE(blocks < base_blocks * 2);
+	ms = merkle_storage::open("test.db");
+	BOOST_REQUIRE_EQUAL(ms->current_version(), 152);
+	BOOST_REQUIRE(ms->list_versions() == versions);
+	bi::uint256_t value;
+	ms->read_value(items[60].first, value, 60);
+	BOOST_REQUIRE_EQUAL(value, 60);
+	ms->read_value(items[60].first, value, 62);
+	BOOST_REQUIRE_EQUAL(value, 1060);
+	auto snapshot = ms->open_snapshot(70);
+	BOOST_REQUIRE_EQUAL(snapshot.version(), 70);
+	BOOST_REQUIRE_EQUAL(snapshot.root_hash(), roots[69]);
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_batch_versions, NoTestDBFixture)
+{
+	std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+	for (unsigned i = 0; i < 500; i++)
+		items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i), i));
+	auto ms = merkle_storage::create("test.db");
+	ms->set_retained_versions(10);
+	// the version of a batch has the root after the batch
+	ms->write_batch(items);
+	{
+		auto snapshot = ms->open_snapshot();
+		BOOST_REQUIRE_EQUAL(snapshot.root_hash(), ms->root_hash());
+		BOOST_REQUIRE_EQUAL(ms->root_hash(snapshot.version()), ms->root_hash());
+		bi::uint256_t value;
+		merkle_proof proof;
+		BOOST_REQUIRE(snapshot.prove(items[7].first, value, proof));
+		BOOST_REQUIRE(verify_inclusion(ms->root_hash(), items[7].first, items[7].second, proof));
+	}
+	std::vector<bi::uint256_t> keys;
+	for (unsigned i = 0; i < 100; i++)
+		keys.push_back(items[i].first);
+	ms->delete_batch(keys);
+	{
+		auto snapshot = ms->open_snapshot();
+		BOOST_REQUIRE_EQUAL(snapshot.root_hash(), ms->root_hash());
+		BOOST_REQUIRE_EQUAL(ms->root_hash(snapshot.version()), ms->root_hash());
+		bi::uint256_t value;
+		merkle_proof proof;
+		BOOST_REQUIRE(snapshot.prove(items[200].first, value, proof));
+		BOOST_REQUIRE(verify_inclusion(ms->root_hash(), items[200].first, items[200].second, proof));
+		BOOST_REQUIRE(!ms->prove(items[7].first, proof, snapshot.version()));
+		BOOST_REQUIRE(verify_exclusion(ms->root_hash(), items[7].first, proof));
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_prune, NoTestDBFixture)
+{
+	std::map<bi::uint256_t, bi::uint256_t> model;
+	auto ms = merkle_storage::create("test.db");
+	ms->set_retained_versions(2);
+	// versions replacing hundreds of blocks each
+	for (unsigned round = 0; round < 10; round++)
+	{
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < 500; i++)
+		{
+			bi::uint256_t key(i * 0x9e3779b97f4a7c15ULL, i % (round + 1));
+			items.push_back(std::make_pair(key, round));
+			model[key] = round;
+		}
+		ms->write_batch(items);
+	}
+	BOOST_REQUIRE_EQUAL(ms->list_versions().size(), 11);
+	{
+		auto tx = ms->begin();
+		BOOST_REQUIRE_THROW(ms->prune(std::chrono::seconds(1)), std::runtime_error);
+	}
+
+	// the oldest open snapshot holds the newer versions back
+	uint64_t pinned = ms->list_versions()[3];
+	{
+		auto snapshot = ms->open_snapshot(pinned);
+		BOOST_REQUIRE(ms->prune(std::chrono::seconds(10)));
+		BOOST_REQUIRE_EQUAL(ms->list_versions().front(), pinned);
+		bi::uint256_t value;
+		snapshot.read_value(bi::uint256_t(0), value);
+		BOOST_REQUIRE_EQUAL(value, pinned - 2);
+	}
+
+	// one logged step per call with no time left, the synced steps
+	// before a crash stay done
+	unsigned steps = 0;
+	while (!ms->prune(std::chrono::microseconds(0)))
+	{
+		if (++steps == 5)
+		{
+			ms->sync();
+			copy_file("test.db", "crash.db");
+			copy_file("test.db.wal", "crash.db.wal");
+		}
+	}
+	BOOST_REQUIRE(steps > 10);
+	BOOST_REQUIRE_EQUAL(ms->list_versions().size(), 2);
+	BOOST_REQUIRE_EQUAL(ms->list_versions().back(), ms->current_version());
+	bi::uint256_t root = ms->root_hash();
+	ms.reset();
+	auto crashed = merkle_storage::open("crash.db");
+	BOOST_REQUIRE(crashed->list_versions().size() > 2);
+	BOOST_REQUIRE(crashed->prune(std::chrono::seconds(10)));
+	BOOST_REQUIRE_EQUAL(crashed->list_versions().size(), 2);
+	BOOST_REQUIRE_EQUAL(crashed->root_hash(), root);
+	crashed.reset();
+
+	// a retired version leaves exactly the blocks of the kept ones
+	BOOST_REQUIRE_EQUAL(count_used_blocks("test.db"), count_used_blocks("crash.db"));
+	ms = merkle_storage::open("test.db");
+	ms->set_retained_versions(0);
+	BOOST_REQUIRE(ms->prune(std::chrono::seconds(10)));
+	BOOST_REQUIRE(ms->list_versions().empty());
+	ms.reset();
+	{
+		auto expected = merkle_storage::create("bulk.db");
+		for (auto& kv : model)
+			expected->write_value(kv.first, kv.second);
+		BOOST_REQUIRE_EQUAL(expected->root_hash(), root);
+	}
+	BOOST_REQUIRE_EQUAL(count_used_blocks("test.db"), count_used_blocks("bulk.db"));
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_deferred_hashing, NoTestDBFixture)
+{
+	// threads and split depth, 1 thread hashes without the pool
+	const std::pair<unsigned, unsigned> configs[] = { { 1, 8 }, { 4, 4 }, { 3, 0 } };
+	for (auto& config : configs)
+	{
+		remove_files();
+		auto ms = merkle_storage::create("test.db");
+		auto expected = merkle_storage::create("bulk.db");
+		ms->set_hash_threads(config.first, config.second);
+		std::map<bi::uint256_t, bi::uint256_t> model;
+		uint64_t seed = config.first;
+		std::vector<uint8_t> bytes(300, 7);
+		for (unsigned round = 0; round < 20; round++)
+		{
+			if (round == 10)
+			{
+				ms->set_retained_versions(2);
+				expected->set_retained_versions(2);
+			}
+			for (unsigned i = 0; i < 100; i++)
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				bi::uint256_t key = bi::uint256_t(seed % 300, seed) << 120;
+				if (model.count(key) && seed % 3 == 0)
+				{
+					ms->delete_value(key);
+					expected->delete_value(key);
+					model.erase(key);
+				}
+				else if (seed % 7 == 0)
+				{
+					// byte strings leave the model, short and overflowing ones
+					ms->write_value(key, bytes.data(), seed % 2 ? 20 : bytes.size());
+					expected->write_value(key, bytes.data(), seed % 2 ? 20 : bytes.size());
+					model.erase(key);
+				}
+				else
+				{
+					ms->write_value(key, seed);
+					expected->write_value(key, seed);
+					model[key] = seed;
+				}
+				// reads see the writes waiting for their hashes
+				bi::uint256_t value;
+				if (model.count(key))
+				{
+					ms->read_value(key, value);
+					BOOST_REQUIRE_EQUAL(value, model[key]);
+				}
+			}
+			if (round % 5 == 4)
+			{
+				// a batch takes the subtree hashes of the noted keys
+				std::vector<bi::uint256_t> keys;
+				for (auto& kv : model)
+					if (keys.size() < 10)
+						keys.push_back(kv.first);
+				ms->delete_batch(keys);
+				expected->delete_batch(keys);
+				for (auto& key : keys)
+					model.erase(key);
+			}
+			BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+			auto it = model.begin();
+			std::advance(it, round % model.size());
+			bi::uint256_t value;
+			merkle_proof proof;
+			BOOST_REQUIRE(ms->prove(it->first, value, proof));
+			BOOST_REQUIRE(verify_inclusion(ms->root_hash(), it->first, it->second, proof));
+			if (round >= 10)
+				BOOST_REQUIRE_EQUAL(ms->open_snapshot().root_hash(), ms->root_hash());
+		}
+
+		// a rollback drops the transaction only, the deferred writes before it stay
+		bi::uint256_t key = model.begin()->first;
+		ms->write_value(key, 1);
+		expected->write_value(key, 1);
+		{
+			auto tx = ms->begin();
+			tx.write_value(key, 2);
+			tx.delete_value(std::next(model.begin())->first);
+			tx.rollback();
+		}
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+		expected->write_value(key, 3);
+		{
+			auto tx = ms->begin();
+			tx.write_value(key, 3);
+			BOOST_REQUIRE_EQUAL(tx.root_hash(), expected->root_hash());
+			tx.commit();
+		}
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+
+		// enough noted keys start a background job, reads run beside it
+		// and the next write waits for it
+		for (unsigned i = 0; i < 3 * DEFERRED_HASH_KEYS; i++)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			bi::uint256_t next = bi::uint256_t(seed % 300, seed) << 120;
+			ms->write_value(next, seed);
+			expected->write_value(next, seed);
+			model[next] = seed;
+			bi::uint256_t value;
+			ms->read_value(next, value);
+			BOOST_REQUIRE_EQUAL(value, seed);
+			if (i % 100 == 0)
+			{
+				ms->delete_value(model.begin()->first);
+				expected->delete_value(model.begin()->first);
+				model.erase(model.begin());
+			}
+		}
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+		// a rollback drops a running job of the transaction
+		{
+			auto tx = ms->begin();
+			for (unsigned i = 0; i < DEFERRED_HASH_KEYS; i++)
+				tx.write_value(bi::uint256_t(i + 1), i);
+			tx.rollback();
+		}
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+
+		// dropping the storage logs the deferred writes
+		ms->write_value(key, 4);
+		expected->write_value(key, 4);
+		ms.reset();
+		ms = merkle_storage::open("test.db");
+		BOOST_REQUIRE_EQUAL(ms->root_hash(), expected->root_hash());
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE(merkle_storage_verify_all, NoTestDBFixture)
+{
+	const unsigned count = 3000;
+	{
+		auto ms = merkle_storage::create("test.db");
+		std::vector<std::pair<bi::uint256_t, bi::uint256_t>> items;
+		for (unsigned i = 0; i < count; i++)
+			items.push_back(std::make_pair(bi::uint256_t(i * 0x9e3779b97f4a7c15ULL, i) << 64, i));
+		ms->write_batch(items);
+		std::vector<uint8_t> bytes(500, 3);
+		ms->write_value(items[5].first, bytes.data(), 10);
+		ms->write_value(items[6].first, bytes.data(), bytes.size());
+		// threads, split depth
+		const std::pair<unsigned, unsigned> configs[] = { { 1, 8 }, { 4, 0 }, { 3, 6 }, { 8, 12 } };
+		uint64_t nodes = 0;
+		for (auto& config : configs)
+		{
+			verify_report report = ms->verify_all(config.first, config.second);
+			BOOST_REQUIRE(report.mismatches_.empty());
+			BOOST_REQUIRE_EQUAL(report.root_hash_, ms->root_hash());
+			// a leaf per key and a branching node per leaf but one, with the root
+			BOOST_REQUIRE(report.nodes_ >= 2 * count - 1);
+			if (nodes != 0)
+				BOOST_REQUIRE_EQUAL(report.nodes_, nodes);
+			nodes = report.nodes_;
+		}
+	}
+
+	// a leaf value changed behind the hashes and a node with a broken child hash
+	uint32_t leaf_idx = 0, node_idx = 0, parent_idx = 0;
+	{
+		storage_file file;
+		file.open("test.db");
+		data_block data;
+		storage_block_parser parser(data);
+		for (uint32_t idx = MERKLE_ROOT_BLOCK + 1; leaf_idx == 0 || node_idx == 0; idx++)
+		{
+			if (idx % FREE_MAP_PAGE_BLOCKS == 0)
+				continue;
+			file.read_block(idx, data);
+			if (parser.get_prefix_length() == KEY_LENGTH && parser.get_value_size() == 0 &&
+				leaf_idx == 0)
+			{
+				leaf_idx = idx;
+				bi::uint256_t value;
+				parser.get_value(value);
+				parser.set_value(value + 1);
+				file.write_block(idx, data);
+			}
+			else if (parser.get_prefix_length() < KEY_LENGTH &&
+				parser.get_parent_id() != MERKLE_ROOT_BLOCK && parser.get_parent_id() != leaf_idx &&
+				node_idx == 0)
+			{
+				node_idx = idx;
+				parent_idx = parser.get_parent_id();
+				parser.set_second_child_hash(bi::uint256_t(7));
+				file.write_block(idx, data);
+			}
+		}
+		file.commit();
+	}
+	auto ms = merkle_storage::open("test.db");
+	for (unsigned threads = 1; threads <= 4; threads += 3)
+	{
+		verify_report report = ms->verify_all(threads, 4);
+		BOOST_REQUIRE(report.root_hash_ != ms->root_hash());
+		std::set<uint32_t> blocks;
+		for (auto& mismatch : report.mismatches_)
+			blocks.insert(mismatch.block_);
+		BOOST_REQUIRE(blocks.count(leaf_idx));
+		BOOST_REQUIRE(blocks.count(node_idx));
+		BOOST_REQUIRE(blocks.count(parent_idx));
+		BOOST_REQUIRE_EQUAL(blocks.size(), 3);
+		for (auto& mismatch : report.mismatches_)
+			if (mismatch.block_ == node_idx)
+			{
+				BOOST_REQUIRE_EQUAL(mismatch.child_, 1);
+				BOOST_REQUIRE_EQUAL(mismatch.stored_, 7);
+			}
+	}
+
+	// dangling children: past the file end and a free info block
+	ms.reset();
+	std::vector<uint32_t> dangling;
+	{
+		storage_file file;
+		file.open("test.db");
+		data_block data;
+		storage_block_parser parser(data);
+		const uint32_t targets[] = { 0x7fffffff, FREE_MAP_PAGE_BLOCKS };
+		for (uint32_t idx = MERKLE_ROOT_BLOCK + 1; dangling.size() < 2; idx++)
+		{
+			if (idx % FREE_MAP_PAGE_BLOCKS == 0 || idx == node_idx || idx == parent_idx)
+				continue;
+			file.read_block(idx, data);
+			// value extents don't count. a node losing a leaf child keeps the
+			// other nodes reachable
+			if (parser.get_type() != MERKLE_NODE_BLOCK_TYPE ||
+				parser.get_prefix_length() == KEY_LENGTH || parser.get_first_child_id() == 0 ||
+				parser.get_first_child_id() == leaf_idx)
+				continue;
+			data_block child;
+			file.read_block(parser.get_first_child_id(), child);
+			if (storage_block_parser(child).get_prefix_length() != KEY_LENGTH)
+				continue;
+			parser.set_first_child_id(targets[dangling.size()]);
+			file.write_block(idx, data);
+			dangling.push_back(idx);
+		}
+		file.commit();
+	}
+	ms = merkle_storage::open("test.db");
+	for (unsigned threads = 1; threads <= 4; threads += 3)
+	{
+		verify_report report = ms->verify_all(threads, 4);
+		for (uint32_t idx : dangling)
+		{
+			auto it = std::find_if(report.mismatches_.begin(), report.mismatches_.end(),
+				[idx](const hash_mismatch& mismatch) { return mismatch.block_ == idx; });
+			BOOST_REQUIRE(it != report.mismatches_.end());
+			BOOST_REQUIRE_EQUAL(it->child_, 0);
+			BOOST_REQUIRE_EQUAL(it->computed_, 0);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(hash_many_test)
+{
+	std::vector<bi::uint256_t> val1, val2, expected;
+	uint64_t seed = 777;
+	for (unsigned i = 0; i < 37; i++)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		val1.push_back(bi::uint256_t(seed, ~seed) << (i * 3));
+		val2.push_back(bi::uint256_t(i, seed));
+		expected.push_back(::hash(val1.back(), val2.back()));
+	}
+	hash_kernel kernels[] = { hash_kernel::scalar, hash_kernel::sse2,
+		hash_kernel::avx2, hash_kernel::avx512 };
+	for (auto kernel : kernels)
+	{
+		if (!is_hash_kernel_supported(kernel))
+		{
+			BOOST_REQUIRE_THROW(hash_many(val1.data(), val2.data(), expected.data(),
+				val1.size(), kernel), std::exception);
+			continue;
+		}
+		for (size_t count = 0; count <= val1.size(); count += 7)
+		{
+			std::vector<bi::uint256_t> res(count);
+			hash_many(val1.data(), val2.data(), res.data(), count, kernel);
+			for (size_t i = 0; i < count; i++)
+				BOOST_REQUIRE_EQUAL(res[i], expected[i]);
+		}
+	}
+	std::vector<bi::uint256_t> res(val1.size());
+	hash_many(val1.data(), val2.data(), res.data(), res.size());
+	for (size_t i = 0; i < res.size(); i++)
+		BOOST_REQUIRE_EQUAL(res[i], expected[i]);
+}
+
+BOOST_AUTO_TEST_CASE(sha256_impl_test)
+{
+	BOOST_REQUIRE(sha256_self_test(1000));
+	sha256_impl accelerated = get_sha256_impl();
+	std::vector<bi::uint256_t> val1, val2, expected1, expected2;
+	set_sha256_impl(sha256_impl::portable);
+	uint64_t seed = 99;
+	for (unsigned i = 0; i < 100; i++)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		val1.push_back(bi::uint256_t(seed, seed >> 7) << (i % 64));
+		val2.push_back(bi::uint256_t(~seed, i));
+		expected1.push_back(::hash(val1.back()));
+		expected2.push_back(::hash(val1.back(), val2.back()));
+	}
+	sha256_impl impls[] = { sha256_impl::sha_ni, sha256_impl::armv8 };
+	for (auto impl : impls)
+	{
+		if (!is_sha256_impl_supported(impl))
+		{
+			BOOST_REQUIRE_THROW(set_sha256_impl(impl), std::exception);
+			continue;
+		}
+		set_sha256_impl(impl);
+		for (size_t i = 0; i < val1.size(); i++)
+		{
+			BOOST_REQUIRE_EQUAL(::hash(val1[i]), expected1[i]);
+			BOOST_REQUIRE_EQUAL(::hash(val1[i], val2[i]), expected2[i]);
+		}
+	}
+	set_sha256_impl(accelerated);
+}
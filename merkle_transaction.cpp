@@ -0,0 +1,88 @@
+#include "merkle_transaction.h"
+#include "merkle_storage.h"
+#include <stdexcept>
+
+merkle_transaction::merkle_transaction(merkle_storage& storage, uint64_t id)
+	: storage_(&storage), id_(id)
+{
+}
+
+merkle_transaction::merkle_transaction(merkle_transaction&& other)
+	: storage_(other.storage_), id_(other.id_)
+{
+	other.storage_ = nullptr;
+}
+
+merkle_transaction::~merkle_transaction()
+{
+	try
+	{
+		if (is_active())
+			rollback();
+	}
+	catch (...)
+	{
+	}
+}
+
+void merkle_transaction::read_value(const bi::uint256_t& key, bi::uint256_t& value)
+{
+	active_storage().read_value(key, value);
+}
+
+void merkle_transaction::read_value(const bi::uint256_t& key, std::vector<uint8_t>& value)
+{
+	active_storage().read_value(key, value);
+}
+
+void merkle_transaction::write_value(const bi::uint256_t& key, const bi::uint256_t& value)
+{
+	active_storage().write_value(key, value);
+}
+
+void merkle_transaction::write_value(const bi::uint256_t& key, const uint8_t* data, size_t size)
+{
+	active_storage().write_value(key, data, size);
+}
+
+void merkle_transaction::delete_value(const bi::uint256_t& key)
+{
+	active_storage().delete_value(key);
+}
+
+bool merkle_transaction::does_key_exist(const bi::uint256_t& key)
+{
+	return active_storage().does_key_exist(key);
+}
+
+const bi::uint256_t& merkle_transaction::root_hash() const
+{
+	return active_storage().root_hash();
+}
+
+void merkle_transaction::commit()
+{
+	merkle_storage& storage = active_storage();
+	// a finished transaction doesn't touch the storage again
+	storage_ = nullptr;
+	storage.commit_transaction();
+}
+
+void merkle_transaction::rollback()
+{
+	merkle_storage& storage = active_storage();
+	storage_ = nullptr;
+	storage.abort_operation();
+}
+
+bool merkle_transaction::is_active() const
+{
+	return storage_ && storage_->in_transaction_ && storage_->transaction_id_ == id_;
+}
+
+merkle_storage& merkle_transaction::active_storage() const
+{
+	if (!is_active())
+		throw std::runtime_error("Transaction is not active");
+	return *storage_;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <vector>
+#include "common.h"
+
+class merkle_storage;
+
+// Makes the writes and deletes done until commit one atomic operation.
+// The changed blocks stay in memory, the reads see them, and a block
+// changed many times is kept once. commit logs all of them as a single
+// record and syncs the log. A transaction dropped without commit is
+// rolled back, and so is one whose operation fails after changing blocks.
+class merkle_transaction
+{
+public:
+	merkle_transaction(merkle_transaction&& other);
+	~merkle_transaction();
+
+	void read_value(const bi::uint256_t& key, bi::uint256_t& value);
+	void read_value(const bi::uint256_t& key, std::vector<uint8_t>& value);
+	void write_value(const bi::uint256_t& key, const bi::uint256_t& value);
+	void write_value(const bi::uint256_t& key, const uint8_t* data, size_t size);
+	void delete_value(const bi::uint256_t& key);
+	bool does_key_exist(const bi::uint256_t& key);
+	// root with the changes of the transaction
+	const bi::uint256_t& root_hash() const;
+
+	void commit();
+	void rollback();
+	// false after commit, rollback or a failed operation
+	bool is_active() const;
+private:
+	friend class merkle_storage;
+	merkle_transaction(merkle_storage& storage, uint64_t id);
+	merkle_transaction(const merkle_transaction&) = delete;
+	merkle_transaction& operator=(const merkle_transaction&) = delete;
+	merkle_storage& active_storage() const;
+
+	merkle_storage* storage_;
+	uint64_t id_;
+};
@@ -0,0 +1,193 @@
+#include "mmap_backend.h"
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+mmap_backend::mmap_backend() :
+#ifdef WIN32
+	file_(INVALID_HANDLE_VALUE),
+	mapping_(NULL),
+#else
+	file_(-1),
+#endif
+	data_(nullptr),
+	mapped_size_(0),
+	blocks_amount_(0)
+{
+}
+
+mmap_backend::~mmap_backend()
+{
+	close();
+}
+
+void mmap_backend::open(const std::string& file_name)
+{
+	open_file(file_name, false);
+}
+
+void mmap_backend::create(const std::string& file_name)
+{
+	open_file(file_name, true);
+}
+
+uint32_t mmap_backend::blocks_amount() const
+{
+	return blocks_amount_;
+}
+
+void mmap_backend::read_block(uint32_t idx, data_block& data)
+{
+	memcpy(data.data(), data_ + (size_t)idx * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+void mmap_backend::write_block(uint32_t idx, const data_block& data)
+{
+	memcpy(data_ + (size_t)idx * BLOCK_SIZE, data.data(), BLOCK_SIZE);
+}
+
+uint32_t mmap_backend::append_block()
+{
+	size_t new_size = (size_t)(blocks_amount_ + 1) * BLOCK_SIZE;
+	if (new_size > mapped_size_)
+		map((std::max)(mapped_size_ * 2, new_size));
+#ifndef WIN32
+	// the mapping may be larger than the file, the file itself always
+	// holds exactly blocks_amount_ blocks
+	if (ftruncate(file_, new_size))
+		throw std::runtime_error("Failed to append block");
+#endif
+	memset(data_ + (size_t)blocks_amount_ * BLOCK_SIZE, 0, BLOCK_SIZE);
+	blocks_amount_++;
+	return blocks_amount_ - 1;
+}
+
+const uint8_t* mmap_backend::view_block(uint32_t idx)
+{
+	return data_ + (size_t)idx * BLOCK_SIZE;
+}
+
+void mmap_backend::prefetch_block(uint32_t idx)
+{
+#ifndef WIN32
+	static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t begin = (size_t)idx * BLOCK_SIZE;
+	size_t end = begin + BLOCK_SIZE;
+	begin -= begin % page_size;
+	madvise(data_ + begin, end - begin, MADV_WILLNEED);
+#endif
+}
+
+void mmap_backend::flush()
+{
+	if (!data_)
+		return;
+#ifdef WIN32
+	if (!FlushViewOfFile(data_, (size_t)blocks_amount_ * BLOCK_SIZE) ||
+		!FlushFileBuffers(file_))
+		throw std::runtime_error("Failed to flush file");
+#else
+	if (msync(data_, (size_t)blocks_amount_ * BLOCK_SIZE, MS_SYNC))
+		throw std::runtime_error("Failed to flush file");
+#endif
+}
+
+void mmap_backend::sync()
+{
+	flush();
+#ifndef WIN32
+	// msync doesn't cover the file size changed by ftruncate
+	if (file_ != -1 && fsync(file_))
+		throw std::runtime_error("Failed to sync file");
+#endif
+}
+
+void mmap_backend::open_file(const std::string& file_name, bool create)
+{
+	close();
+	size_t file_size = 0;
+#ifdef WIN32
+	file_ = CreateFileA(file_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		create ? CREATE_NEW : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file_ == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Failed to open file");
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_, &size))
+		throw std::runtime_error("Failed to get file size");
+	file_size = (size_t)size.QuadPart;
+#else
+	file_ = ::open(file_name.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0644);
+	if (file_ < 0)
+		throw std::runtime_error("Failed to open file");
+	struct stat st;
+	if (fstat(file_, &st))
+		throw std::runtime_error("Failed to get file size");
+	file_size = (size_t)st.st_size;
+#endif
+	blocks_amount_ = (uint32_t)(file_size / BLOCK_SIZE);
+	map((std::max)(file_size, (size_t)MMAP_MIN_MAPPING_SIZE));
+}
+
+void mmap_backend::map(size_t size)
+{
+	unmap();
+#ifdef WIN32
+	// windows grows the file up to the mapping size, close() cuts it back
+	LARGE_INTEGER max_size;
+	max_size.QuadPart = size;
+	mapping_ = CreateFileMappingA(file_, NULL, PAGE_READWRITE,
+		max_size.HighPart, max_size.LowPart, NULL);
+	if (mapping_ == NULL)
+		throw std::runtime_error("Failed to map file");
+	data_ = (uint8_t*)MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (data_ == nullptr)
+		throw std::runtime_error("Failed to map file");
+#else
+	void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+	if (p == MAP_FAILED)
+		throw std::runtime_error("Failed to map file");
+	data_ = (uint8_t*)p;
+#endif
+	mapped_size_ = size;
+}
+
+void mmap_backend::unmap()
+{
+	if (!data_)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(data_);
+	CloseHandle(mapping_);
+	mapping_ = NULL;
+#else
+	munmap(data_, mapped_size_);
+#endif
+	data_ = nullptr;
+	mapped_size_ = 0;
+}
+
+void mmap_backend::close()
+{
+	unmap();
+#ifdef WIN32
+	if (file_ == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER size;
+	size.QuadPart = (LONGLONG)blocks_amount_ * BLOCK_SIZE;
+	SetFilePointerEx(file_, size, NULL, FILE_BEGIN);
+	SetEndOfFile(file_);
+	CloseHandle(file_);
+	file_ = INVALID_HANDLE_VALUE;
+#else
+	if (file_ < 0)
+		return;
+	::close(file_);
+	file_ = -1;
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "storage_backend.h"
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#define MMAP_MIN_MAPPING_SIZE (1024 * 1024)
+
+// Maps the whole database file into memory. Reads and writes are plain
+// memory copies, the mapping is grown geometrically when blocks are
+// appended.
+class mmap_backend : public storage_backend
+{
+public:
+	mmap_backend();
+	~mmap_backend();
+
+	void open(const std::string& file_name) override;
+	void create(const std::string& file_name) override;
+
+	uint32_t blocks_amount() const override;
+	void read_block(uint32_t idx, data_block& data) override;
+	void write_block(uint32_t idx, const data_block& data) override;
+	uint32_t append_block() override;
+	const uint8_t* view_block(uint32_t idx) override;
+	void prefetch_block(uint32_t idx) override;
+	void flush() override;
+	void sync() override;
+private:
+	void open_file(const std::string& file_name, bool create);
+	void map(size_t size);
+	void unmap();
+	void close();
+
+#ifdef WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#else
+	int file_;
+#endif
+	uint8_t* data_;
+	size_t mapped_size_;
+	uint32_t blocks_amount_;
+};
@@ -0,0 +1,76 @@
+#include "proof_verifier.h"
+#include "hashes.h"
+#include "utils.h"
+#include <stdexcept>
+
+proof_verifier::proof_verifier()
+{
+}
+
+void proof_verifier::verify(const bi::uint256_t& root, const std::vector<bi::uint256_t>& keys,
+	const std::vector<bi::uint256_t>& values, const std::vector<bool>& found,
+	const std::vector<merkle_proof>& proofs, std::vector<bool>& valid)
+{
+	verify(std::vector<bi::uint256_t>(keys.size(), root), keys, values, found, proofs, valid);
+}
+
+void proof_verifier::verify(const std::vector<bi::uint256_t>& roots,
+	const std::vector<bi::uint256_t>& keys, const std::vector<bi::uint256_t>& values,
+	const std::vector<bool>& found, const std::vector<merkle_proof>& proofs,
+	std::vector<bool>& valid)
+{
+	size_t count = keys.size();
+	if (roots.size() != count || values.size() != count || found.size() != count ||
+		proofs.size() != count)
+		throw std::runtime_error("Proof verification input size mismatch");
+	valid.assign(count, true);
+	nodes_.resize(count);
+	next_sibling_.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		next_sibling_[i] = proofs[i].siblings_.size();
+		if (count_proof_siblings(proofs[i]) != next_sibling_[i])
+			valid[i] = false;
+		nodes_[i] = found[i] ? hash(values[i]) : default_hash(KEY_LENGTH);
+	}
+	for (unsigned depth = KEY_LENGTH; depth > 0; depth--)
+	{
+		lanes_.clear();
+		left_.clear();
+		right_.clear();
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!valid[i])
+				continue;
+			const merkle_proof& proof = proofs[i];
+			bi::uint256_t& node = nodes_[i];
+			const bi::uint256_t* sibling = &default_hash(depth);
+			if (has_proof_sibling(proof, depth - 1))
+				sibling = &proof.siblings_[--next_sibling_[i]];
+			else if (node == default_hash(depth))
+			{
+				// empty subtree stays empty one level up
+				node = default_hash(depth - 1);
+				continue;
+			}
+			lanes_.push_back(i);
+			if (key_bit(keys[i], depth - 1))
+			{
+				left_.push_back(*sibling);
+				right_.push_back(node);
+			}
+			else
+			{
+				left_.push_back(node);
+				right_.push_back(*sibling);
+			}
+		}
+		hashes_.resize(lanes_.size());
+		hash_many(left_.data(), right_.data(), hashes_.data(), lanes_.size());
+		for (size_t j = 0; j < lanes_.size(); j++)
+			nodes_[lanes_[j]] = hashes_[j];
+	}
+	for (size_t i = 0; i < count; i++)
+		if (valid[i])
+			valid[i] = nodes_[i] == roots[i];
+}
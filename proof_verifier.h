@@ -0,0 +1,32 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "merkle_proof.h"
+
+// Checks many single key proofs against a root without any storage.
+// The proofs are folded from the leaves up in lockstep, all the hashes
+// of a level are computed by one hash_many call, and empty subtrees on
+// the way come from the default hashes table instead of hashing.
+class proof_verifier
+{
+public:
+	proof_verifier();
+
+	// valid[i] tells if proofs[i] shows that keys[i] has values[i] when
+	// found[i] is set, or that keys[i] is absent otherwise
+	void verify(const bi::uint256_t& root, const std::vector<bi::uint256_t>& keys,
+		const std::vector<bi::uint256_t>& values, const std::vector<bool>& found,
+		const std::vector<merkle_proof>& proofs, std::vector<bool>& valid);
+	// same for the proofs which may come from different roots
+	void verify(const std::vector<bi::uint256_t>& roots, const std::vector<bi::uint256_t>& keys,
+		const std::vector<bi::uint256_t>& values, const std::vector<bool>& found,
+		const std::vector<merkle_proof>& proofs, std::vector<bool>& valid);
+private:
+	// scratch buffers kept between the calls
+	std::vector<bi::uint256_t> nodes_;
+	std::vector<size_t> next_sibling_;
+	std::vector<size_t> lanes_;
+	std::vector<bi::uint256_t> left_;
+	std::vector<bi::uint256_t> right_;
+	std::vector<bi::uint256_t> hashes_;
+};
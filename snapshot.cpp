@@ -0,0 +1,202 @@
+#include "snapshot.h"
+#include "merkle_storage.h"
+#include "merkle_cursor.h"
+#include "bulk_loader.h"
+#include "hashes.h"
+#include "utils.h"
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <thread>
+#include <vector>
+
+using namespace bi;
+
+static const char snapshot_magic[4] = { 'M', 'S', 'N', 'P' };
+
+// key and value size of an entry
+#define SNAPSHOT_ENTRY_HEADER_SIZE (32 + 4)
+// number of entries and root hash
+#define SNAPSHOT_TRAILER_SIZE (8 + 32)
+
+struct snapshot_chunk
+{
+	uint32_t entries_;
+	std::vector<uint8_t> payload_;
+	uint256_t checksum_;
+	// offsets of the entries in the payload
+	std::vector<size_t> offsets_;
+};
+
+static void write_uint32(std::ostream& out, uint32_t val)
+{
+	uint8_t bytes[4];
+	split32to4x8(bytes, 0, val);
+	out.write((const char*)bytes, sizeof(bytes));
+}
+
+static void write_chunk(std::ostream& out, uint32_t entries, const std::vector<uint8_t>& payload)
+{
+	uint8_t checksum[32];
+	uint256_to_bytes(hash(payload.data(), payload.size()), checksum);
+	write_uint32(out, entries);
+	write_uint32(out, (uint32_t)payload.size());
+	out.write((const char*)payload.data(), payload.size());
+	out.write((const char*)checksum, sizeof(checksum));
+}
+
+static void read_bytes(std::istream& in, uint8_t* data, size_t size)
+{
+	if (!in.read((char*)data, size))
+		throw std::runtime_error("Truncated snapshot");
+}
+
+static uint32_t read_uint32(std::istream& in)
+{
+	uint8_t bytes[4];
+	read_bytes(in, bytes, sizeof(bytes));
+	return merge4x8to32(bytes, 0);
+}
+
+static void read_chunk(std::istream& in, snapshot_chunk& chunk)
+{
+	chunk.entries_ = read_uint32(in);
+	uint32_t size = read_uint32(in);
+	// an entry never starts past the chunk size
+	if (size > SNAPSHOT_CHUNK_SIZE + SNAPSHOT_ENTRY_HEADER_SIZE + MAX_VALUE_SIZE)
+		throw std::runtime_error("Invalid snapshot chunk");
+	chunk.payload_.resize(size);
+	read_bytes(in, chunk.payload_.data(), size);
+	uint8_t checksum[32];
+	read_bytes(in, checksum, sizeof(checksum));
+	chunk.checksum_ = uint256_from_bytes(checksum);
+}
+
+static void verify_chunk(snapshot_chunk& chunk)
+{
+	if (hash(chunk.payload_.data(), chunk.payload_.size()) != chunk.checksum_)
+		throw std::runtime_error("Snapshot chunk checksum mismatch");
+	const uint8_t* payload = chunk.payload_.data();
+	size_t size = chunk.payload_.size();
+	size_t offset = 0;
+	chunk.offsets_.clear();
+	for (uint32_t i = 0; i < chunk.entries_; i++)
+	{
+		if (size - offset < SNAPSHOT_ENTRY_HEADER_SIZE)
+			throw std::runtime_error("Invalid snapshot chunk");
+		uint32_t value_size = merge4x8to32(payload, offset + 32);
+		if (value_size != 0 && !(value_size & BYTES_VALUE_FLAG))
+			throw std::runtime_error("Invalid snapshot chunk");
+		value_size = value_size ? value_size & ~BYTES_VALUE_FLAG : 32;
+		if (value_size > MAX_VALUE_SIZE ||
+			size - offset - SNAPSHOT_ENTRY_HEADER_SIZE < value_size)
+			throw std::runtime_error("Invalid snapshot chunk");
+		chunk.offsets_.push_back(offset);
+		offset += SNAPSHOT_ENTRY_HEADER_SIZE + value_size;
+	}
+	if (offset != size)
+		throw std::runtime_error("Invalid snapshot chunk");
+}
+
+static void load_chunk(bulk_loader& loader, const snapshot_chunk& chunk)
+{
+	const uint8_t* payload = chunk.payload_.data();
+	for (size_t offset : chunk.offsets_)
+	{
+		uint256_t key = uint256_from_bytes(payload + offset);
+		uint32_t value_size = merge4x8to32(payload, offset + 32);
+		const uint8_t* value = payload + offset + SNAPSHOT_ENTRY_HEADER_SIZE;
+		if (value_size == 0)
+			loader.add(key, uint256_from_bytes(value));
+		else
+			loader.add(key, value, value_size & ~BYTES_VALUE_FLAG);
+	}
+}
+
+void export_snapshot(merkle_storage& storage, std::ostream& out)
+{
+	out.write(snapshot_magic, sizeof(snapshot_magic));
+	write_uint32(out, SNAPSHOT_FORMAT_VERSION);
+	std::vector<uint8_t> payload, value;
+	uint32_t entries = 0;
+	uint64_t total = 0;
+	merkle_cursor cursor(storage);
+	cursor.set_prefetch(true);
+	for (bool ok = cursor.seek_first(); ok; ok = cursor.next())
+	{
+		uint32_t value_size = cursor.value_size();
+		cursor.value(value);
+		size_t offset = payload.size();
+		payload.resize(offset + SNAPSHOT_ENTRY_HEADER_SIZE + value.size());
+		uint256_to_bytes(cursor.key(), &payload[offset]);
+		split32to4x8(payload, offset + 32, value_size);
+		std::copy(value.begin(), value.end(), payload.begin() + offset + SNAPSHOT_ENTRY_HEADER_SIZE);
+		entries++;
+		total++;
+		if (payload.size() >= SNAPSHOT_CHUNK_SIZE)
+		{
+			write_chunk(out, entries, payload);
+			payload.clear();
+			entries = 0;
+		}
+	}
+	if (entries != 0)
+		write_chunk(out, entries, payload);
+	payload.resize(SNAPSHOT_TRAILER_SIZE);
+	split32to4x8(payload, 0, (uint32_t)(total >> 32));
+	split32to4x8(payload, 4, (uint32_t)total);
+	uint256_to_bytes(storage.root_hash(), &payload[8]);
+	write_chunk(out, 0, payload);
+	if (!out)
+		throw std::runtime_error("Failed to write snapshot");
+}
+
+std::unique_ptr<merkle_storage> import_snapshot(const std::string& file_name,
+	std::istream& in, storage_backend_type type)
+{
+	char magic[sizeof(snapshot_magic)];
+	read_bytes(in, (uint8_t*)magic, sizeof(magic));
+	if (!std::equal(magic, magic + sizeof(magic), snapshot_magic) ||
+		read_uint32(in) != SNAPSHOT_FORMAT_VERSION)
+		throw std::runtime_error("Unsupported snapshot format");
+	// chunks checked ahead of the one being loaded
+	size_t window = (std::max)(2u, std::thread::hardware_concurrency());
+	std::deque<std::future<snapshot_chunk>> pending;
+	bulk_loader loader(file_name, type);
+	uint64_t total = 0;
+	snapshot_chunk chunk;
+	while (true)
+	{
+		read_chunk(in, chunk);
+		if (chunk.entries_ == 0)
+			break;
+		total += chunk.entries_;
+		pending.push_back(std::async(std::launch::async,
+			[](snapshot_chunk chunk) { verify_chunk(chunk); return chunk; }, std::move(chunk)));
+		if (pending.size() >= window)
+		{
+			load_chunk(loader, pending.front().get());
+			pending.pop_front();
+		}
+	}
+	for (; !pending.empty(); pending.pop_front())
+		load_chunk(loader, pending.front().get());
+	if (hash(chunk.payload_.data(), chunk.payload_.size()) != chunk.checksum_ ||
+		chunk.payload_.size() != SNAPSHOT_TRAILER_SIZE)
+		throw std::runtime_error("Invalid snapshot trailer");
+	const uint8_t* trailer = chunk.payload_.data();
+	uint32_t entries_high = merge4x8to32(trailer, 0);
+	uint32_t entries_low = merge4x8to32(trailer, 4);
+	uint64_t entries = ((uint64_t)entries_high << 32) | entries_low;
+	uint256_t root = uint256_from_bytes(trailer + 8);
+	if (entries != total)
+		throw std::runtime_error("Snapshot entries are missing");
+	std::unique_ptr<merkle_storage> res = loader.finish();
+	if (res->root_hash() != root)
+	{
+		res.reset();
+		delete_file(file_name);
+		throw std::runtime_error("Snapshot root hash mismatch");
+	}
+	return res;
+}
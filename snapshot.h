@@ -0,0 +1,29 @@
+#pragma once
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include "common.h"
+#include "storage_backend.h"
+
+class merkle_storage;
+
+#define SNAPSHOT_FORMAT_VERSION 1
+// chunks are closed once their payload reaches this size
+#define SNAPSHOT_CHUNK_SIZE (256 * 1024)
+
+// Snapshot stream: "MSNP", format version, then chunks of the key value
+// pairs in key order. A chunk is the number of its entries, the payload
+// size, the payload and SHA-256 of the payload. An entry is the key, the
+// value size as kept in the leaf and the value bytes, 32 for a 256 bit
+// value. The last chunk has no entries, its payload is the number of all
+// the entries and the root hash. All numbers are big endian.
+
+// writes the keys of the storage in key order
+void export_snapshot(merkle_storage& storage, std::ostream& out);
+// builds a new database from a snapshot. the chunks are checked and
+// decoded by worker threads while the trie is built from the ones before.
+// throws and removes the file if the stream is damaged or the root
+// differs from the exported one
+std::unique_ptr<merkle_storage> import_snapshot(const std::string& file_name,
+	std::istream& in, storage_backend_type type = storage_backend_type::stdio);
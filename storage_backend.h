@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include "common.h"
+
+enum class storage_backend_type
+{
+	stdio,
+	mmap
+};
+
+// Raw block I/O over the database file. Knows nothing about free blocks
+// or caching, those are handled by storage_file.
+class storage_backend
+{
+public:
+	virtual ~storage_backend() {}
+
+	virtual void open(const std::string& file_name) = 0;
+	virtual void create(const std::string& file_name) = 0;
+
+	virtual uint32_t blocks_amount() const = 0;
+	virtual void read_block(uint32_t idx, data_block& data) = 0;
+	virtual void write_block(uint32_t idx, const data_block& data) = 0;
+	// appends zero filled block, returns its index
+	virtual uint32_t append_block() = 0;
+	// pointer to the block bytes or nullptr if backend can't provide it,
+	// stays valid until the next append_block
+	virtual const uint8_t* view_block(uint32_t idx) = 0;
+	// hints that the block is going to be read soon, may do nothing
+	virtual void prefetch_block(uint32_t idx) = 0;
+	virtual void flush() = 0;
+	// flush plus waiting for the data to reach the disk
+	virtual void sync() = 0;
+};
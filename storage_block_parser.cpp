@@ -1,5 +1,6 @@
 #include "storage_block_parser.h"
 #include "utils.h"
+#include "hashes.h"
 
 storage_block_parser::operator data_block&()
 {
@@ -56,6 +57,34 @@ void storage_block_parser::get_value(bi::uint256_t & val)
 	memcpy(&val, &data_[BLOCK_HEADER_SIZE], sizeof(val));
 }
 
+void storage_block_parser::set_value_bytes(const uint8_t* data, size_t size)
+{
+	if (size > BLOCK_VALUE_SIZE)
+		throw std::runtime_error("Value doesn't fit the block");
+	memset(&data_[BLOCK_HEADER_SIZE], 0, BLOCK_VALUE_SIZE);
+	// an empty value may come as nullptr, which memcpy doesn't take
+	if (size)
+		memcpy(&data_[BLOCK_HEADER_SIZE], data, size);
+}
+
+void storage_block_parser::get_value_bytes(uint8_t* data, size_t size)
+{
+	if (size > BLOCK_VALUE_SIZE)
+		throw std::runtime_error("Value doesn't fit the block");
+	if (size)
+		memcpy(data, &data_[BLOCK_HEADER_SIZE], size);
+}
+
+void storage_block_parser::set_value_size(uint32_t size)
+{
+	split32to4x8(data_, 9, size);
+}
+
+uint32_t storage_block_parser::get_value_size()
+{
+	return merge4x8to32(data_, 9);
+}
+
 void storage_block_parser::set_32value(uint32_t idx, uint32_t val)
 {
 	if (idx >= BLOCK_VALUE_SIZE / sizeof(uint32_t))
@@ -73,6 +102,108 @@ uint32_t storage_block_parser::get_32value(uint32_t idx)
 		BLOCK_HEADER_SIZE + idx * sizeof(uint32_t));
 }
 
+// two consecutive 32 bit values, the lower half first
+void storage_block_parser::set_64value(uint32_t idx, uint64_t val)
+{
+	set_32value(idx, (uint32_t)val);
+	set_32value(idx + 1, (uint32_t)(val >> 32));
+}
+
+uint64_t storage_block_parser::get_64value(uint32_t idx)
+{
+	uint64_t high = get_32value(idx + 1);
+	return (high << 32) | get_32value(idx);
+}
+
+void storage_block_parser::set_prefix_length(uint16_t len)
+{
+	data_[BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE] = (uint8_t)(len >> 8);
+	data_[BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE + 1] = (uint8_t)len;
+}
+
+uint16_t storage_block_parser::get_prefix_length()
+{
+	return (((uint16_t)data_[BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE]) << 8) +
+		data_[BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE + 1];
+}
+
+void storage_block_parser::set_prefix(const bi::uint256_t & prefix)
+{
+	memcpy(&data_[BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE + 2], &prefix, sizeof(prefix));
+}
+
+void storage_block_parser::get_prefix(bi::uint256_t & prefix)
+{
+	memcpy(&prefix, &data_[BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE + 2], sizeof(prefix));
+}
+
+#define BLOCK_HASHES_OFFSET (BLOCK_HEADER_SIZE + BLOCK_VALUE_SIZE + BLOCK_PREFIX_SIZE)
+
+void storage_block_parser::set_first_child_hash(const bi::uint256_t & hash)
+{
+	memcpy(&data_[BLOCK_HASHES_OFFSET], &hash, sizeof(hash));
+}
+
+void storage_block_parser::get_first_child_hash(bi::uint256_t & hash)
+{
+	memcpy(&hash, &data_[BLOCK_HASHES_OFFSET], sizeof(hash));
+}
+
+void storage_block_parser::set_second_child_hash(const bi::uint256_t & hash)
+{
+	memcpy(&data_[BLOCK_HASHES_OFFSET + 32], &hash, sizeof(hash));
+}
+
+void storage_block_parser::get_second_child_hash(bi::uint256_t & hash)
+{
+	memcpy(&hash, &data_[BLOCK_HASHES_OFFSET + 32], sizeof(hash));
+}
+
+static_assert(FREE_MAP_PAGE_BLOCKS / 8 <= BLOCK_SIZE - BLOCK_HEADER_SIZE,
+	"free map doesn't fit into a block");
+
+void storage_block_parser::set_free_map(const uint64_t* words)
+{
+	for (unsigned w = 0; w < FREE_MAP_PAGE_WORDS; w++)
+		for (unsigned i = 0; i < 8; i++)
+			data_[BLOCK_HEADER_SIZE + w * 8 + i] = (uint8_t)(words[w] >> (i * 8));
+}
+
+void storage_block_parser::get_free_map(uint64_t* words)
+{
+	for (unsigned w = 0; w < FREE_MAP_PAGE_WORDS; w++)
+	{
+		words[w] = 0;
+		for (unsigned i = 0; i < 8; i++)
+			words[w] |= (uint64_t)data_[BLOCK_HEADER_SIZE + w * 8 + i] << (i * 8);
+	}
+}
+
+void storage_block_parser::set_journal_entry(uint32_t idx, uint32_t block)
+{
+	if (idx >= JOURNAL_BLOCK_ENTRIES)
+		throw std::runtime_error("Invalid storage block index");
+	split32to4x8(data_, BLOCK_HEADER_SIZE + idx * sizeof(uint32_t), block);
+}
+
+uint32_t storage_block_parser::get_journal_entry(uint32_t idx)
+{
+	if (idx >= JOURNAL_BLOCK_ENTRIES)
+		throw std::runtime_error("Invalid storage block index");
+	return merge4x8to32(data_, BLOCK_HEADER_SIZE + idx * sizeof(uint32_t));
+}
+
+// the parent id field, free info blocks have no parent
+void storage_block_parser::set_format_version(uint32_t version)
+{
+	split32to4x8(data_, 1, version);
+}
+
+uint32_t storage_block_parser::get_format_version()
+{
+	return merge4x8to32(data_, 1);
+}
+
 void storage_block_parser::clear()
 {
 	data_.fill(0);
@@ -82,4 +213,6 @@ void storage_block_parser::fill_as_empty_root()
 {
 	clear();
 	set_type(MERKLE_NODE_BLOCK_TYPE);
+	set_first_child_hash(default_hash(1));
+	set_second_child_hash(default_hash(1));
 }
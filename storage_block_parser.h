@@ -20,11 +20,53 @@ public:
 	void set_second_child_id(uint32_t id);
 	uint32_t get_second_child_id();
 
+	// value of a leaf node, format 4 files keep it in a separate value block
 	void set_value(const bi::uint256_t& val);
 	void get_value(bi::uint256_t& val);
 
+	// byte string leaf values up to BLOCK_VALUE_SIZE, the rest of the
+	// field is zeroed
+	void set_value_bytes(const uint8_t* data, size_t size);
+	void get_value_bytes(uint8_t* data, size_t size);
+	// leaf nodes only, zero for a 256 bit value or size of a byte string
+	// value with BYTES_VALUE_FLAG. shares the second child id field
+	void set_value_size(uint32_t size);
+	uint32_t get_value_size();
+
 	void set_32value(uint32_t idx, uint32_t val);
 	uint32_t get_32value(uint32_t idx);
+	void set_64value(uint32_t idx, uint64_t val);
+	uint64_t get_64value(uint32_t idx);
+
+	// number of leading key bits fixed by the merkle node,
+	// KEY_LENGTH for leaf nodes
+	void set_prefix_length(uint16_t len);
+	uint16_t get_prefix_length();
+
+	void set_prefix(const bi::uint256_t& prefix);
+	void get_prefix(bi::uint256_t& prefix);
+
+	// hash of the child subtree lifted to the level right below the node,
+	// leaf nodes keep hash of their value as the first child hash
+	void set_first_child_hash(const bi::uint256_t& hash);
+	void get_first_child_hash(bi::uint256_t& hash);
+
+	void set_second_child_hash(const bi::uint256_t& hash);
+	void get_second_child_hash(bi::uint256_t& hash);
+
+	// allocation bits of the free info block group,
+	// FREE_MAP_PAGE_WORDS words, bit i of word w is block w * 64 + i
+	void set_free_map(const uint64_t* words);
+	void get_free_map(uint64_t* words);
+
+	// block indices of a journal block, JOURNAL_BLOCK_ENTRIES of them
+	// after the header
+	void set_journal_entry(uint32_t idx, uint32_t block);
+	uint32_t get_journal_entry(uint32_t idx);
+
+	// stored in the first free info block only
+	void set_format_version(uint32_t version);
+	uint32_t get_format_version();
 
 	void clear();
 	void fill_as_empty_root();
@@ -1,13 +1,47 @@
 #include "storage_file.h"
 #include "utils.h"
 #include "storage_block_parser.h"
+#include "file_backend.h"
+#include "mmap_backend.h"
 #include <array>
 #include <iterator>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static unsigned lowest_bit(uint64_t word)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward64(&idx, word);
+	return idx;
+#else
+	return __builtin_ctzll(word);
+#endif
+}
 
 storage_file::storage_file():
-	file_(nullptr, fclose), 
-	blocks_amount_(0)
+	first_free_word_(0),
+	blocks_amount_(0),
+	format_version_(STORAGE_FORMAT_VERSION),
+	cache_(DEFAULT_BLOCK_CACHE_SIZE, 
+		[this](uint32_t idx, const data_block& data) { backend_->write_block(idx, data); }),
+	group_commit_size_(WAL_DEFAULT_GROUP_COMMIT_SIZE),
+	group_size_(0)
+{
+}
+
+storage_file::~storage_file()
 {
+	try
+	{
+		close();
+	}
+	catch (...)
+	{
+	}
 }
 
 bool storage_file::exist(const std::string& file_name)
@@ -15,196 +49,512 @@ bool storage_file::exist(const std::string& file_name)
 	return is_file_exists(file_name);
 }
 
-void storage_file::open(const std::string& file_name)
+void storage_file::open(const std::string& file_name, storage_backend_type type,
+	bool use_wal)
 {
 	if (!storage_file::exist(file_name))
 		throw std::runtime_error("Failed to open file");
-	file_ = std::unique_ptr<FILE, file_closer>(
-		fopen(file_name.c_str(), "rb+"), 
-		fclose
-		);
-	int n = fseek(file_.get(), 0, SEEK_END);
-	if (n)
-		throw std::runtime_error("Failed to position cursor");
-	long pos = ftell(file_.get());
-	blocks_amount_ = pos / BLOCK_SIZE;
-	read_free_blocks_info();
+	init_backend(type);
+	backend_->open(file_name);
+	if (use_wal)
+	{
+		wal_.reset(new write_ahead_log());
+		wal_->open(file_name + WAL_FILE_SUFFIX);
+		recover();
+	}
+	blocks_amount_ = backend_->blocks_amount();
+	if (blocks_amount_ == 0)
+		throw std::runtime_error("Invalid storage file");
+	data_block data;
+	storage_block_parser parser(data);
+	backend_->read_block(0, data);
+	if (parser.get_type() != STORAGE_FREE_INFO_BLOCK_TYPE ||
+		parser.get_format_version() < STORAGE_MIN_FORMAT_VERSION ||
+		parser.get_format_version() > STORAGE_FORMAT_VERSION)
+		throw std::runtime_error("Unsupported storage format version");
+	format_version_ = parser.get_format_version();
+	read_free_map();
 }
 
-void storage_file::create(const std::string& file_name)
+void storage_file::create(const std::string& file_name, storage_backend_type type,
+	bool use_wal)
 {
 	if (storage_file::exist(file_name))
 		throw std::runtime_error("File already exists");
-	file_ = std::unique_ptr<FILE, file_closer>(
-		fopen(file_name.c_str(), "wb+"),
-		fclose
-		);
-	uint32_t idx = append_block();
-	data_block first;
-	first.fill(0);
-	first[0] = 1;
-	write_block(idx, first);
+	init_backend(type);
+	backend_->create(file_name);
+	if (use_wal)
+	{
+		// a log left from a removed database must not be replayed
+		if (is_file_exists(file_name + WAL_FILE_SUFFIX))
+			delete_file(file_name + WAL_FILE_SUFFIX);
+		wal_.reset(new write_ahead_log());
+		wal_->open(file_name + WAL_FILE_SUFFIX);
+	}
+	blocks_amount_ = 0;
+	format_version_ = STORAGE_FORMAT_VERSION;
+	// the first free map block
+	append_block();
+	if (wal_)
+	{
+		commit();
+		sync();
+		checkpoint();
+	}
 }
 
 void storage_file::read_block(uint32_t idx, data_block& data)
 {
-	if (!file_)
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
 		throw std::runtime_error("Reading from uninitialized object");
 	if (is_block_free(idx))
 		throw std::runtime_error("Reading from free block");
 	if (idx >= blocks_amount_)
 		throw std::runtime_error("Invalid block index");
-	int n = fseek(file_.get(), idx * BLOCK_SIZE, SEEK_SET);
-	if (n > 0)
-		throw std::runtime_error("Failed to seek file to block position");
-	n = fread(data.data(), data.size(), 1, file_.get());
-	if (n != 1)
-		throw std::runtime_error("Failed to read block");
+	const data_block* logged = find_logged_block(idx);
+	if (logged)
+	{
+		data = *logged;
+		return;
+	}
+	if (cache_.read(idx, data))
+		return;
+	backend_->read_block(idx, data);
+	cache_.write(idx, data, false);
+}
+
+void storage_file::read_block_shared(uint32_t idx, data_block& data)
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
+		throw std::runtime_error("Reading from uninitialized object");
+	if (idx >= blocks_amount_ || is_block_free(idx))
+		throw std::runtime_error("Invalid block index");
+	const data_block* logged = find_logged_block(idx);
+	if (logged)
+		data = *logged;
+	else if (!cache_.peek(idx, data))
+		backend_->read_block(idx, data);
+}
+
+bool storage_file::is_block_used(uint32_t idx)
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+	return idx < blocks_amount_ && !is_free_map_block(idx) && !is_block_free(idx);
 }
 
 void storage_file::write_block(uint32_t idx, const data_block& data)
 {
-	if (!file_)
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
 		throw std::runtime_error("Writing to uninitialized object");
-	if (idx >= blocks_amount_)
+	if (idx >= blocks_amount_ || is_free_map_block(idx))
 		throw std::runtime_error("Invalid block index");
-	int n = fseek(file_.get(), idx * BLOCK_SIZE, SEEK_SET);
-	if (n > 0)
-		throw std::runtime_error("Failed to seek file to block position");
-	n = fwrite(data.data(), data.size(), 1, file_.get());
-	if (n != 1)
-		throw std::runtime_error("Failed to write block");
-	if(set_block_free(idx, false))
-		write_free_blocks_info();
+	put_block(idx, data);
+	set_block_free(idx, false);
 }
 
 void storage_file::free_block(uint32_t idx)
 {
-	if (!file_)
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
 		throw std::runtime_error("Uninitialized object");
-	if (idx >= blocks_amount_)
+	if (idx >= blocks_amount_ || is_free_map_block(idx))
 		throw std::runtime_error("Invalid block index");
-	if(set_block_free(idx, true))
-		write_free_blocks_info();
+	// the logged content is needed by rollback
+	if (!wal_)
+		cache_.erase(idx);
+	set_block_free(idx, true);
 }
 
 uint32_t storage_file::next_available_block_idx()
 {
-	if (!file_)
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	return find_available_block();
+}
+
+uint32_t storage_file::allocate_block()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	uint32_t idx = find_available_block();
+	set_block_free(idx, false);
+	return idx;
+}
+
+uint32_t storage_file::find_available_block()
+{
+	if (!backend_)
 		throw std::runtime_error("Uninitialized object");
-	if (free_blocks_.empty())
-		free_blocks_.insert(append_block());
-	return *(free_blocks_.begin());
+	for (; first_free_word_ < used_blocks_.size(); first_free_word_++)
+	{
+		uint64_t free_bits = ~used_blocks_[first_free_word_];
+		if (free_bits == 0)
+			continue;
+		// bits past the end of file are clear, the block has to be appended then
+		uint32_t idx = (uint32_t)(first_free_word_ * 64 + lowest_bit(free_bits));
+		if (idx < blocks_amount_)
+			return idx;
+		break;
+	}
+	uint32_t idx = append_block();
+	while (is_free_map_block(idx))
+		idx = append_block();
+	return idx;
 }
 
-bool storage_file::set_block_free(uint32_t idx, bool free)
+uint32_t storage_file::allocate_extent(uint32_t count)
 {
-	if (!file_)
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
 		throw std::runtime_error("Uninitialized object");
-	bool changed = false;
-	auto it = free_blocks_.find(idx);
-	if (free)
+	if (count == 0 || count >= FREE_MAP_PAGE_BLOCKS)
+		throw std::runtime_error("Invalid extent size");
+	uint32_t start = 0;
+	uint32_t run = 0;
+	for (uint32_t idx = (uint32_t)(first_free_word_ * 64); idx < blocks_amount_ && run < count; idx++)
+	{
+		if (idx % 64 == 0 && used_blocks_[idx / 64] == ~0ULL)
+		{
+			run = 0;
+			idx += 63;
+			continue;
+		}
+		if (is_free_map_block(idx) || !is_block_free(idx))
+		{
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			start = idx;
+	}
+	// a shorter run can only be the one at the end of file, it is
+	// completed with new blocks
+	if (run == 0)
+		start = blocks_amount_;
+	while (blocks_amount_ < start + count)
 	{
-		changed = (it == free_blocks_.end());
-		free_blocks_.insert(idx);
+		uint32_t idx = append_block();
+		if (is_free_map_block(idx))
+			start = idx + 1;
 	}
-	else
+	for (uint32_t idx = start; idx < start + count; idx++)
+		set_block_free(idx, false);
+	return start;
+}
+
+const uint8_t* storage_file::view_block(uint32_t idx)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	return mapped_block(idx);
+}
+
+const uint8_t* storage_file::view_extent(uint32_t idx, uint32_t count)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	const uint8_t* res = nullptr;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint8_t* block = mapped_block(idx + i);
+		if (!block || (res && block != res + (size_t)i * BLOCK_SIZE))
+			return nullptr;
+		if (i == 0)
+			res = block;
+	}
+	return res;
+}
+
+const uint8_t* storage_file::mapped_block(uint32_t idx)
+{
+	if (!backend_)
+		throw std::runtime_error("Reading from uninitialized object");
+	if (is_block_free(idx))
+		throw std::runtime_error("Reading from free block");
+	if (idx >= blocks_amount_)
+		throw std::runtime_error("Invalid block index");
+	// the file doesn't have logged writes yet
+	if (find_logged_block(idx))
+		return nullptr;
+	cache_.flush_block(idx);
+	return backend_->view_block(idx);
+}
+
+void storage_file::prefetch_block(uint32_t idx)
+{
+	if (!backend_)
+		throw std::runtime_error("Reading from uninitialized object");
+	if (idx >= blocks_amount_ || find_logged_block(idx) || cache_.contains(idx))
+		return;
+	backend_->prefetch_block(idx);
+}
+
+void storage_file::flush()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
+		return;
+	if (wal_)
+		sync_log();
+	cache_.flush();
+	backend_->flush();
+}
+
+void storage_file::commit(bool deferred)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!wal_ || op_blocks_.empty())
+		return;
+	wal_->append_record(op_blocks_);
+	for (auto& block : op_blocks_)
+		committed_blocks_[block.first] = block.second;
+	op_blocks_.clear();
+	if (!deferred && ++group_size_ >= group_commit_size_)
+		sync_log();
+}
+
+void storage_file::rollback()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!wal_)
+		throw std::runtime_error("Rollback without write ahead log");
+	std::vector<uint32_t> pages;
+	for (auto& block : op_blocks_)
+		if (is_free_map_block(block.first))
+			pages.push_back(block.first / FREE_MAP_PAGE_BLOCKS);
+	op_blocks_.clear();
+	for (uint32_t page : pages)
+		load_free_map_page(page);
+	first_free_word_ = 0;
+}
+
+void storage_file::sync()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	sync_log();
+}
+
+void storage_file::sync_log()
+{
+	if (!backend_)
+		throw std::runtime_error("Uninitialized object");
+	if (!wal_)
 	{
-		changed = (it != free_blocks_.end());
-		free_blocks_.erase(idx);
+		cache_.flush();
+		backend_->sync();
+		return;
 	}
-	return changed;
+	wal_->sync();
+	// logged blocks may reach the file from now on
+	for (auto& block : committed_blocks_)
+		cache_.write(block.first, block.second, true);
+	committed_blocks_.clear();
+	group_size_ = 0;
+	if (wal_->size() >= WAL_CHECKPOINT_SIZE)
+		checkpoint();
+}
+
+void storage_file::set_group_commit_size(unsigned size)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	group_commit_size_ = (std::max)(size, 1u);
+	if (wal_ && group_size_ >= group_commit_size_)
+		sync_log();
+}
+
+void storage_file::set_cache_size(size_t size)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	cache_.set_budget(size);
+}
+
+const block_cache_stats& storage_file::get_cache_stats() const
+{
+	return cache_.get_stats();
+}
+
+uint32_t storage_file::get_format_version() const
+{
+	return format_version_;
+}
+
+void storage_file::set_format_version(uint32_t version)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	if (!backend_)
+		throw std::runtime_error("Uninitialized object");
+	format_version_ = version;
+	write_free_map_page(0);
+}
+
+bool storage_file::set_block_free(uint32_t idx, bool free)
+{
+	if (!backend_)
+		throw std::runtime_error("Uninitialized object");
+	uint64_t& word = used_blocks_[idx / 64];
+	uint64_t bit = 1ULL << (idx % 64);
+	if (((word & bit) == 0) == free)
+		return false;
+	word ^= bit;
+	if (free && idx / 64 < first_free_word_)
+		first_free_word_ = idx / 64;
+	write_free_map_page(idx / FREE_MAP_PAGE_BLOCKS);
+	return true;
 }
 
 bool storage_file::is_block_free(uint32_t idx)
 {
-	if (!file_)
+	if (!backend_)
 		throw std::runtime_error("Uninitialized object");
-	return (free_blocks_.find(idx) != free_blocks_.end());
+	if (idx >= blocks_amount_)
+		return false;
+	return (used_blocks_[idx / 64] & (1ULL << (idx % 64))) == 0;
+}
+
+bool storage_file::is_free_map_block(uint32_t idx)
+{
+	return idx % FREE_MAP_PAGE_BLOCKS == 0;
 }
 
 uint32_t storage_file::append_block()
 {
-	if (!file_)
+	if (!backend_)
 		throw std::runtime_error("Uninitialized object");
-	int n = fseek(file_.get(), 0, SEEK_END);
-	if (n)
-		throw std::runtime_error("Failed to position cursor");
-	long pos = ftell(file_.get());
-	data_block b;
-	b.fill(0);
-	n = fwrite(b.data(), b.size(), 1, file_.get());
-	if (n != 1)
-		throw std::runtime_error("Failed to append block");
-	blocks_amount_++;
-	return blocks_amount_ - 1;
-}
-
-void storage_file::write_free_blocks_info()
-{
-	// add old blocks with free block info to the list
-	uint32_t idx = 0;
-	data_block data;
-	storage_block_parser parser(data);
-	read_block(idx, data);
-	idx = parser.get_first_child_id();
-	while (true)
-	{
-		if (idx == 0)
-			break;
-		read_block(idx, data);
-		free_blocks_.insert(idx);
-		idx = parser.get_first_child_id();
-	}
-	uint32_t parent_idx = 0;
-	uint32_t count = 0;
-	uint32_t max_count = BLOCK_VALUE_SIZE / sizeof(uint32_t);
-	std::set<uint32_t> free_blocks(free_blocks_);
-	while (true)
+	blocks_amount_ = backend_->append_block() + 1;
+	uint32_t idx = blocks_amount_ - 1;
+	if (is_free_map_block(idx))
 	{
-		parser.clear();
-		parser.set_type(STORAGE_FREE_INFO_BLOCK_TYPE);
-		count = 0;
-		while (!free_blocks.empty())
-		{
-			parser.set_32value(count, *free_blocks.begin());
-			count++;
-			free_blocks.erase(free_blocks.begin());
-			if (count == max_count)
-				break;
-		}
-		parser.set_parent_id(parent_idx);
-		parser.set_second_child_id(count);
-		if (free_blocks.empty())
-		{
-			write_block(idx, data);
-			break;
-		}
-		parent_idx = idx;
-		idx = *free_blocks.begin();
-		parser.set_first_child_id(idx);
-		free_blocks.erase(idx);
-		free_blocks_.erase(idx);
-		write_block(parent_idx, data);
+		// the block starts a new group and keeps its bitmap
+		used_blocks_.resize(used_blocks_.size() + FREE_MAP_PAGE_WORDS, 0);
+		used_blocks_[idx / 64] |= 1;
+		write_free_map_page(idx / FREE_MAP_PAGE_BLOCKS);
 	}
+	return idx;
+}
+
+void storage_file::write_free_map_page(uint32_t page)
+{
+	data_block data;
+	storage_block_parser parser(data);
+	parser.clear();
+	parser.set_type(STORAGE_FREE_INFO_BLOCK_TYPE);
+	if (page == 0)
+		parser.set_format_version(format_version_);
+	parser.set_free_map(&used_blocks_[page * FREE_MAP_PAGE_WORDS]);
+	put_block(page * FREE_MAP_PAGE_BLOCKS, data);
 }
 
-void storage_file::read_free_blocks_info()
+void storage_file::read_free_map()
 {
-	if (!file_)
+	if (!backend_)
 		throw std::runtime_error("Uninitialized object");
-	free_blocks_.clear();
-	uint32_t idx = 0;
+	uint32_t pages = (blocks_amount_ + FREE_MAP_PAGE_BLOCKS - 1) / FREE_MAP_PAGE_BLOCKS;
+	used_blocks_.assign(pages * FREE_MAP_PAGE_WORDS, 0);
+	first_free_word_ = 0;
+	for (uint32_t page = 0; page < pages; page++)
+		load_free_map_page(page);
+	// blocks past the end of file may be left marked by an interrupted write
+	for (uint32_t idx = blocks_amount_; idx < pages * FREE_MAP_PAGE_BLOCKS; idx++)
+		used_blocks_[idx / 64] &= ~(1ULL << (idx % 64));
+}
+
+void storage_file::load_free_map_page(uint32_t page)
+{
+	uint32_t idx = page * FREE_MAP_PAGE_BLOCKS;
 	data_block data;
 	storage_block_parser parser(data);
-	while (true)
-	{
-		read_block(idx, data);
-		idx = parser.get_first_child_id();
-		uint32_t count = parser.get_second_child_id();
-		for (uint32_t i = 0; i < count; i++)
-			free_blocks_.insert(parser.get_32value(i));
-		if (idx == 0)
-			break;
+	const data_block* logged = find_logged_block(idx);
+	if (logged)
+		data = *logged;
+	else if (!cache_.read(idx, data))
+		backend_->read_block(idx, data);
+	if (parser.get_type() != STORAGE_FREE_INFO_BLOCK_TYPE)
+	{
+		// group appended by a lost operation, nothing is allocated there
+		if (parser.get_type() != FREE_BLOCK_TYPE)
+			throw std::runtime_error("Invalid storage file");
+		parser.clear();
+	}
+	else if (page == 0)
+		format_version_ = parser.get_format_version();
+	parser.get_free_map(&used_blocks_[page * FREE_MAP_PAGE_WORDS]);
+	used_blocks_[page * FREE_MAP_PAGE_WORDS] |= 1;
+}
+
+const data_block* storage_file::find_logged_block(uint32_t idx) const
+{
+	if (!wal_)
+		return nullptr;
+	auto it = op_blocks_.find(idx);
+	if (it != op_blocks_.end())
+		return &it->second;
+	it = committed_blocks_.find(idx);
+	if (it != committed_blocks_.end())
+		return &it->second;
+	return nullptr;
+}
+
+void storage_file::put_block(uint32_t idx, const data_block& data)
+{
+	if (wal_)
+		op_blocks_[idx] = data;
+	else
+		cache_.write(idx, data, true);
+}
+
+void storage_file::recover()
+{
+	if (wal_->size() == 0)
+		return;
+	wal_->replay([this](uint32_t idx, const data_block& data)
+	{
+		while (backend_->blocks_amount() <= idx)
+			backend_->append_block();
+		backend_->write_block(idx, data);
+	});
+	backend_->sync();
+	wal_->reset();
+}
+
+void storage_file::checkpoint()
+{
+	cache_.flush();
+	backend_->sync();
+	wal_->reset();
+}
+
+void storage_file::close()
+{
+	if (!backend_)
+		return;
+	// uncommitted writes are dropped
+	op_blocks_.clear();
+	flush();
+	if (wal_)
+	{
+		backend_->sync();
+		wal_->remove();
+		wal_.reset();
+	}
+}
+
+void storage_file::init_backend(storage_backend_type type)
+{
+	close();
+	cache_.clear();
+	used_blocks_.clear();
+	first_free_word_ = 0;
+	op_blocks_.clear();
+	committed_blocks_.clear();
+	group_size_ = 0;
+	if (type == storage_backend_type::mmap)
+	{
+		backend_.reset(new mmap_backend());
+		// blocks are already served from memory
+		cache_.set_budget(0);
+	}
+	else
+	{
+		backend_.reset(new file_backend());
+		cache_.set_budget(DEFAULT_BLOCK_CACHE_SIZE);
 	}
 }
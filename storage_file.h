@@ -1,34 +1,114 @@
 #pragma once
 #include <string>
 #include <memory>
-#include <set>
-#include <cstdio>
+#include <vector>
+#include <shared_mutex>
 #include "common.h"
+#include "block_cache.h"
+#include "storage_backend.h"
+#include "wal.h"
 
+#define DEFAULT_BLOCK_CACHE_SIZE (8 * 1024 * 1024)
+
+// Blocks of one writer with any number of concurrent readers using
+// read_block_shared. The other methods are for the writer thread only.
 class storage_file
 {
 public:
 	storage_file();
+	~storage_file();
 
 	static bool exist(const std::string& file_name);
-	void open(const std::string& file_name);
-	void create(const std::string& file_name);
+	// with use_wal writes become visible to the file only through the
+	// write ahead log, open replays the log left by a crash
+	void open(const std::string& file_name,
+		storage_backend_type type = storage_backend_type::stdio,
+		bool use_wal = false);
+	void create(const std::string& file_name,
+		storage_backend_type type = storage_backend_type::stdio,
+		bool use_wal = false);
 
 	void read_block(uint32_t idx, data_block& data);
+	// read of a block the writer doesn't change anymore, safe to call from
+	// any thread while the writer works. doesn't touch the cache state
+	void read_block_shared(uint32_t idx, data_block& data);
+	// if the block is in the file, in use and not a free info block.
+	// safe to call from any thread as read_block_shared
+	bool is_block_used(uint32_t idx);
 	void write_block(uint32_t idx, const data_block& data);
 	void free_block(uint32_t idx);
 	uint32_t next_available_block_idx();
+	// marks the next available block used without writing it,
+	// the block has to be written before the next commit
+	uint32_t allocate_block();
+	// same for count consecutive blocks, count is below
+	// FREE_MAP_PAGE_BLOCKS. returns the first block
+	uint32_t allocate_extent(uint32_t count);
+	// direct pointer to block bytes, nullptr if backend doesn't support it.
+	// valid until the next block allocation
+	const uint8_t* view_block(uint32_t idx);
+	// direct pointer to count consecutive blocks or nullptr
+	const uint8_t* view_extent(uint32_t idx, uint32_t count);
+	// asks the backend to start loading a block which isn't in memory
+	void prefetch_block(uint32_t idx);
+	// writes cached dirty blocks to the file
+	void flush();
+
+	// ends an atomic group of writes, no-op without the log. a deferred
+	// group doesn't count towards the synced group size, it reaches the
+	// log on disk with the next sync
+	void commit(bool deferred = false);
+	// drops writes since the last commit
+	void rollback();
+	// waits for committed writes to reach the log on disk
+	void sync();
+	// committed groups written to the log with one fsync
+	void set_group_commit_size(unsigned size);
+
+	void set_cache_size(size_t size);
+	const block_cache_stats& get_cache_stats() const;
+
+	// open accepts files from STORAGE_MIN_FORMAT_VERSION on,
+	// the owner upgrades them and sets the new version
+	uint32_t get_format_version() const;
+	void set_format_version(uint32_t version);
 private: 
-	// returns if list was changed really
+	// returns if the bitmap was changed really
 	bool set_block_free(uint32_t idx, bool free);
 	bool is_block_free(uint32_t idx);
+	static bool is_free_map_block(uint32_t idx);
+	uint32_t find_available_block();
+	const uint8_t* mapped_block(uint32_t idx);
+	void sync_log();
 	uint32_t append_block();
-	void write_free_blocks_info();
-	void read_free_blocks_info();
+	void write_free_map_page(uint32_t page);
+	void read_free_map();
+	void load_free_map_page(uint32_t page);
+	// block written since the last log sync or nullptr
+	const data_block* find_logged_block(uint32_t idx) const;
+	void put_block(uint32_t idx, const data_block& data);
+	void recover();
+	void checkpoint();
+	void close();
+	void init_backend(storage_backend_type type);
 
-	typedef int(*file_closer)(FILE*);
-	std::unique_ptr<FILE, file_closer> file_;
-	std::set<uint32_t> free_blocks_;
+	std::unique_ptr<storage_backend> backend_;
+	// one bit per block, set for used blocks
+	std::vector<uint64_t> used_blocks_;
+	// no free blocks below this word of used_blocks_
+	size_t first_free_word_;
 	uint32_t blocks_amount_;
+	uint32_t format_version_;
+	block_cache cache_;
+	std::unique_ptr<write_ahead_log> wal_;
+	// writes of the current operation
+	write_ahead_log::block_images op_blocks_;
+	// committed writes not synced to the log yet
+	write_ahead_log::block_images committed_blocks_;
+	unsigned group_commit_size_;
+	unsigned group_size_;
+	// shared by read_block_shared, the writer holds it exclusively
+	// while changing the blocks, the cache or the free map
+	std::shared_timed_mutex mutex_;
 };
 
@@ -1,8 +1,64 @@
 #include "utils.h"
 #ifdef WIN32
 #include <windows.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
+#include <cstring>
+#include <stdexcept>
 
+void uint256_to_bytes(const bi::uint256_t& val, uint8_t* bytes)
+{
+	// uint256_t keeps its 64 bit words from the most significant one
+	uint64_t words[4];
+	memcpy(words, &val, sizeof(words));
+	for (unsigned i = 0; i < 4; i++, bytes += 8)
+	{
+		uint64_t w = words[i];
+		bytes[0] = (uint8_t)(w >> 56);
+		bytes[1] = (uint8_t)(w >> 48);
+		bytes[2] = (uint8_t)(w >> 40);
+		bytes[3] = (uint8_t)(w >> 32);
+		bytes[4] = (uint8_t)(w >> 24);
+		bytes[5] = (uint8_t)(w >> 16);
+		bytes[6] = (uint8_t)(w >> 8);
+		bytes[7] = (uint8_t)w;
+	}
+}
+
+bi::uint256_t uint256_from_bytes(const uint8_t* bytes)
+{
+	uint64_t words[4];
+	for (unsigned i = 0; i < 4; i++, bytes += 8)
+	{
+		words[i] = ((uint64_t)bytes[0] << 56) | ((uint64_t)bytes[1] << 48) |
+			((uint64_t)bytes[2] << 40) | ((uint64_t)bytes[3] << 32) |
+			((uint64_t)bytes[4] << 24) | ((uint64_t)bytes[5] << 16) |
+			((uint64_t)bytes[6] << 8) | (uint64_t)bytes[7];
+	}
+	bi::uint256_t val;
+	memcpy(&val, words, sizeof(words));
+	return val;
+}
+
+unsigned key_bit(const bi::uint256_t& key, unsigned depth)
+{
+	return ((key >> (KEY_LENGTH - 1 - depth)) & 1) ? 1 : 0;
+}
+
+unsigned common_prefix_length(const bi::uint256_t& a, const bi::uint256_t& b)
+{
+	return KEY_LENGTH - (a ^ b).bits();
+}
+
+bi::uint256_t key_prefix(const bi::uint256_t& key, unsigned len)
+{
+	if (len == 0)
+		return bi::uint256_0;
+	return (key >> (KEY_LENGTH - len)) << (KEY_LENGTH - len);
+}
 
 bool is_file_exists(const std::string& path)
 {
@@ -11,6 +67,9 @@ bool is_file_exists(const std::string& path)
 
 	return (dwAttrib != INVALID_FILE_ATTRIBUTES &&
 		!(dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
+#else
+	struct stat st;
+	return (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode));
 #endif
 }
 
@@ -18,5 +77,19 @@ void delete_file(const std::string& path)
 {
 #ifdef WIN32
 	::DeleteFileA(path.c_str());
+#else
+	::unlink(path.c_str());
+#endif
+}
+
+void sync_file(FILE* file)
+{
+	if (fflush(file))
+		throw std::runtime_error("Failed to flush file");
+#ifdef WIN32
+	if (_commit(_fileno(file)))
+#else
+	if (fsync(fileno(file)))
 #endif
+		throw std::runtime_error("Failed to sync file");
 }
\ No newline at end of file
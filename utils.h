@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <cstdio>
+#include "common.h"
 
 #define merge4x8to32(var, start) (((uint32_t)var[start]) << 24) + (((uint32_t)var[start+1]) << 16) + (((uint32_t)var[start+2]) << 8) + var[start+3]
 #define	split32to4x8(var, start, val32) \
@@ -9,6 +11,19 @@
 	var[start+2] = (uint8_t)(val32 >> 8);	\
 	var[start+3] = (uint8_t)val32;
 
+// big endian byte representation of 256 bit value
+void uint256_to_bytes(const bi::uint256_t& val, uint8_t* bytes);
+bi::uint256_t uint256_from_bytes(const uint8_t* bytes);
+// key bits are consumed starting from the most significant one, so
+// the trie keeps keys in their natural order
+unsigned key_bit(const bi::uint256_t& key, unsigned depth);
+// number of leading bits the keys share
+unsigned common_prefix_length(const bi::uint256_t& a, const bi::uint256_t& b);
+// first len bits of the key, the rest zeroed
+bi::uint256_t key_prefix(const bi::uint256_t& key, unsigned len);
+
 bool is_file_exists(const std::string& path);
 void delete_file(const std::string& path);
+// flushes stdio buffers and waits for the file data to reach the disk
+void sync_file(FILE* file);
 
@@ -0,0 +1,139 @@
+#include "wal.h"
+#include "utils.h"
+#include <stdexcept>
+#include <cstring>
+
+#define WAL_RECORD_MAGIC 0x57414c31
+// magic + blocks count
+#define WAL_RECORD_HEADER_SIZE (4 + 4)
+#define WAL_BLOCK_ENTRY_SIZE (4 + BLOCK_SIZE)
+#define WAL_CHECKSUM_SIZE 8
+
+// FNV-1a, enough to tell a torn write from a complete record
+static uint64_t record_checksum(const uint8_t* data, size_t size)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+write_ahead_log::write_ahead_log() :
+	file_(nullptr, fclose),
+	size_(0)
+{
+}
+
+void write_ahead_log::open(const std::string& file_name)
+{
+	file_name_ = file_name;
+	buffer_.clear();
+	const char* mode = is_file_exists(file_name) ? "rb+" : "wb+";
+	file_ = std::unique_ptr<FILE, file_closer>(fopen(file_name.c_str(), mode), fclose);
+	if (!file_)
+		throw std::runtime_error("Failed to open log file");
+	if (fseek(file_.get(), 0, SEEK_END))
+		throw std::runtime_error("Failed to position cursor");
+	size_ = ftell(file_.get());
+}
+
+void write_ahead_log::close()
+{
+	file_.reset();
+	buffer_.clear();
+	size_ = 0;
+}
+
+void write_ahead_log::remove()
+{
+	close();
+	if (!file_name_.empty() && is_file_exists(file_name_))
+		delete_file(file_name_);
+}
+
+void write_ahead_log::append_record(const block_images& blocks)
+{
+	size_t start = buffer_.size();
+	buffer_.resize(start + WAL_RECORD_HEADER_SIZE +
+		blocks.size() * WAL_BLOCK_ENTRY_SIZE + WAL_CHECKSUM_SIZE);
+	uint8_t* p = &buffer_[start];
+	split32to4x8(p, 0, WAL_RECORD_MAGIC);
+	split32to4x8(p, 4, (uint32_t)blocks.size());
+	p += WAL_RECORD_HEADER_SIZE;
+	for (auto& block : blocks)
+	{
+		split32to4x8(p, 0, block.first);
+		memcpy(p + 4, block.second.data(), BLOCK_SIZE);
+		p += WAL_BLOCK_ENTRY_SIZE;
+	}
+	uint64_t checksum = record_checksum(&buffer_[start], p - &buffer_[start]);
+	split32to4x8(p, 0, (uint32_t)(checksum >> 32));
+	split32to4x8(p, 4, (uint32_t)checksum);
+}
+
+void write_ahead_log::sync()
+{
+	if (!file_)
+		throw std::runtime_error("Uninitialized log");
+	if (buffer_.empty())
+		return;
+	if (fseek(file_.get(), 0, SEEK_END))
+		throw std::runtime_error("Failed to position cursor");
+	if (fwrite(buffer_.data(), buffer_.size(), 1, file_.get()) != 1)
+		throw std::runtime_error("Failed to write log");
+	sync_file(file_.get());
+	size_ += buffer_.size();
+	buffer_.clear();
+}
+
+void write_ahead_log::reset()
+{
+	buffer_.clear();
+	file_ = std::unique_ptr<FILE, file_closer>(fopen(file_name_.c_str(), "wb+"), fclose);
+	if (!file_)
+		throw std::runtime_error("Failed to truncate log file");
+	sync_file(file_.get());
+	size_ = 0;
+}
+
+void write_ahead_log::replay(const apply_func& apply)
+{
+	if (!file_)
+		throw std::runtime_error("Uninitialized log");
+	std::vector<uint8_t> data((size_t)size_);
+	if (fseek(file_.get(), 0, SEEK_SET))
+		throw std::runtime_error("Failed to position cursor");
+	if (!data.empty() && fread(data.data(), data.size(), 1, file_.get()) != 1)
+		throw std::runtime_error("Failed to read log");
+	size_t pos = 0;
+	data_block block;
+	while (data.size() - pos >= WAL_RECORD_HEADER_SIZE)
+	{
+		const uint8_t* p = &data[pos];
+		if ((merge4x8to32(p, 0)) != WAL_RECORD_MAGIC)
+			break;
+		uint64_t count = (merge4x8to32(p, 4));
+		uint64_t body = WAL_RECORD_HEADER_SIZE + count * WAL_BLOCK_ENTRY_SIZE;
+		if (data.size() - pos < body + WAL_CHECKSUM_SIZE)
+			break;
+		uint64_t checksum = ((uint64_t)(merge4x8to32(p, body)) << 32) |
+			(merge4x8to32(p, body + 4));
+		if (checksum != record_checksum(p, (size_t)body))
+			break;
+		p += WAL_RECORD_HEADER_SIZE;
+		for (uint64_t i = 0; i < count; i++, p += WAL_BLOCK_ENTRY_SIZE)
+		{
+			memcpy(block.data(), p + 4, BLOCK_SIZE);
+			apply((merge4x8to32(p, 0)), block);
+		}
+		pos += (size_t)(body + WAL_CHECKSUM_SIZE);
+	}
+}
+
+uint64_t write_ahead_log::size() const
+{
+	return size_;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <cstdio>
+#include "common.h"
+
+#define WAL_FILE_SUFFIX ".wal"
+// committed operations written to the log with one fsync
+#define WAL_DEFAULT_GROUP_COMMIT_SIZE 64
+// log size after which the data file is synced and the log is truncated
+#define WAL_CHECKPOINT_SIZE (16 * 1024 * 1024)
+
+// Redo log of block images. Every record holds the blocks written by one
+// atomic operation and is replayed only if it reached the disk completely,
+// so recovery never applies half of an operation. Records are buffered in
+// memory and go to the disk in groups on sync.
+class write_ahead_log
+{
+public:
+	typedef std::unordered_map<uint32_t, data_block> block_images;
+	typedef std::function<void(uint32_t, const data_block&)> apply_func;
+
+	write_ahead_log();
+
+	// opens the log, creating an empty one if it doesn't exist
+	void open(const std::string& file_name);
+	void close();
+	// closes and deletes the log file
+	void remove();
+
+	void append_record(const block_images& blocks);
+	// writes buffered records and waits for them to reach the disk
+	void sync();
+	// drops all records, the data file has to be synced before
+	void reset();
+	// hands blocks of the complete records to apply in the log order,
+	// stops at the first torn or corrupted record
+	void replay(const apply_func& apply);
+
+	// bytes in the log file, buffered records excluded
+	uint64_t size() const;
+private:
+	typedef int(*file_closer)(FILE*);
+	std::unique_ptr<FILE, file_closer> file_;
+	std::string file_name_;
+	std::vector<uint8_t> buffer_;
+	uint64_t size_;
+};
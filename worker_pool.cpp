@@ -0,0 +1,119 @@
+#include "worker_pool.h"
+
+worker_pool::worker_pool(unsigned threads)
+	: task_(nullptr), busy_(0), job_(0), stop_(false)
+{
+	for (unsigned i = 0; i <= threads; i++)
+		queues_.emplace_back(new task_queue());
+	for (unsigned i = 1; i <= threads; i++)
+		threads_.emplace_back([this, i]() { work(i); });
+}
+
+worker_pool::~worker_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (auto& thread : threads_)
+		thread.join();
+}
+
+void worker_pool::run(size_t count, const std::function<void(size_t)>& task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		task_ = &task;
+		for (size_t i = 0; i < count; i++)
+		{
+			// contiguous runs keep neighbouring tasks on one thread
+			task_queue& queue = *queues_[i * queues_.size() / count];
+			std::lock_guard<std::mutex> queue_lock(queue.mutex_);
+			queue.tasks_.push_back(i);
+		}
+		error_ = nullptr;
+		busy_ = (unsigned)threads_.size();
+		job_++;
+	}
+	wake_.notify_all();
+	run_tasks(0);
+	std::exception_ptr error;
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait(lock, [this]() { return busy_ == 0; });
+		task_ = nullptr;
+		error.swap(error_);
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+unsigned worker_pool::threads() const
+{
+	return (unsigned)threads_.size();
+}
+
+void worker_pool::work(unsigned self)
+{
+	uint64_t seen = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [this, seen]() { return stop_ || job_ != seen; });
+			if (stop_)
+				return;
+			seen = job_;
+		}
+		run_tasks(self);
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--busy_ == 0)
+			done_.notify_all();
+	}
+}
+
+void worker_pool::run_tasks(unsigned self)
+{
+	// no task adds more, once all the queues are empty the job is done
+	size_t task;
+	while (take_task(self, task) || steal_task(self, task))
+	{
+		try
+		{
+			(*task_)(task);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!error_)
+				error_ = std::current_exception();
+		}
+	}
+}
+
+bool worker_pool::take_task(unsigned self, size_t& task)
+{
+	task_queue& queue = *queues_[self];
+	std::lock_guard<std::mutex> lock(queue.mutex_);
+	if (queue.tasks_.empty())
+		return false;
+	task = queue.tasks_.front();
+	queue.tasks_.pop_front();
+	return true;
+}
+
+bool worker_pool::steal_task(unsigned self, size_t& task)
+{
+	for (size_t i = 1; i < queues_.size(); i++)
+	{
+		task_queue& queue = *queues_[(self + i) % queues_.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex_);
+		if (queue.tasks_.empty())
+			continue;
+		task = queue.tasks_.back();
+		queue.tasks_.pop_back();
+		return true;
+	}
+	return false;
+}
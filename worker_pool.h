@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+// Threads running the tasks of one job at a time. The thread calling run
+// takes part too, so a pool of n threads runs up to n + 1 tasks at once.
+// Every thread gets a run of neighbouring tasks and takes them in order,
+// a thread out of tasks steals from the end of the others' runs.
+class worker_pool
+{
+public:
+	explicit worker_pool(unsigned threads);
+	~worker_pool();
+
+	// runs task(0) ... task(count - 1) and waits for all of them,
+	// rethrows the first exception of a task
+	void run(size_t count, const std::function<void(size_t)>& task);
+	unsigned threads() const;
+private:
+	worker_pool(const worker_pool&) = delete;
+	worker_pool& operator=(const worker_pool&) = delete;
+	struct task_queue
+	{
+		std::mutex mutex_;
+		std::deque<size_t> tasks_;
+	};
+
+	void work(unsigned self);
+	void run_tasks(unsigned self);
+	bool take_task(unsigned self, size_t& task);
+	bool steal_task(unsigned self, size_t& task);
+
+	std::vector<std::thread> threads_;
+	// queue 0 is of the thread calling run
+	std::vector<std::unique_ptr<task_queue>> queues_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	const std::function<void(size_t)>* task_;
+	// workers still in the current job
+	unsigned busy_;
+	uint64_t job_;
+	bool stop_;
+	std::exception_ptr error_;
+};